@@ -0,0 +1,163 @@
+/*
+ *    Channelizer.h
+ *
+ *    Splits wideband audio into narrow channels, with an overlapped FFT.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __CHANNELIZER_H
+#define __CHANNELIZER_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+// Every hop samples, transforms the last size samples (Hann windowed)
+// with an FFT, and passes the levels of bins [first_bin, first_bin +
+// bins) to on_frame. Like the levels of ToneDetector, these are tone
+// amplitudes relative to full scale. The bins are rate / size Hz apart;
+// the window makes a tone show up in (at most) two neighbouring bins, and
+// smears its keying edges over size samples. Those stay symmetric, so
+// halfway crossings are still at the right time.
+//
+// size must be a power of two, and hop at most size.
+class Channelizer {
+public:
+	typedef std::function<void(const float *levels)> FrameCallback;
+
+	Channelizer(unsigned size, unsigned hop, unsigned first_bin, unsigned bins)
+		: size(size), hop(hop), first_bin(first_bin), bins(bins) {
+		assert(hop <= size);
+		window.resize(size);
+		float window_sum = 0;
+		for (unsigned i = 0; i < size; ++i) {
+			window[i] = 0.5 - 0.5 * cos(2 * M_PI * (i + 0.5) / size);
+			window_sum += window[i];
+		}
+		// A full scale tone gives |X| = window_sum / 2 in its bin
+		scale = 2 / (window_sum * 32768);
+
+		twiddle_re.resize(size / 2);
+		twiddle_im.resize(size / 2);
+		for (unsigned k = 0; k < size / 2; ++k) {
+			twiddle_re[k] = cos(2 * M_PI * k / size);
+			twiddle_im[k] = -sin(2 * M_PI * k / size);
+		}
+
+		unsigned log_size = 0;
+		while ((1U << log_size) < size)
+			log_size++;
+		reversed.resize(size);
+		for (unsigned i = 0; i < size; ++i) {
+			unsigned r = 0;
+			for (unsigned b = 0; b < log_size; ++b)
+				r |= ((i >> b) & 1) << (log_size - 1 - b);
+			reversed[i] = r;
+		}
+
+		input.reserve(size);
+		re.resize(size);
+		im.resize(size);
+		levels.resize(bins);
+	}
+
+	FrameCallback on_frame;
+
+	void process(const int16_t *samples, size_t count) {
+		while (count) {
+			size_t n = std::min(count, size - input.size());
+			input.insert(input.end(), samples, samples + n);
+			samples += n;
+			count -= n;
+			if (input.size() < size)
+				break;
+
+			transform();
+			for (unsigned b = 0; b < bins; ++b) {
+				unsigned k = first_bin + b;
+				levels[b] = sqrtf(re[k] * re[k] + im[k] * im[k]) * scale;
+			}
+			frame_count++;
+			if (on_frame)
+				on_frame(levels.data());
+
+			input.erase(input.begin(), input.begin() + hop);
+		}
+	}
+
+	// Frames produced so far
+	uint64_t frames() const { return frame_count; }
+
+	// Time between frames, in samples
+	unsigned frame_hop() const { return hop; }
+
+private:
+	// Radix-2 decimation in time FFT of the windowed input into re/im.
+	// The real and imaginary parts are kept apart, which the compiler
+	// vectorizes better than std::complex (and avoids its slow
+	// multiplication that handles infinities).
+	void transform() {
+		for (unsigned i = 0; i < size; ++i) {
+			unsigned r = reversed[i];
+			re[i] = input[r] * window[r];
+			im[i] = 0;
+		}
+
+		for (unsigned half = 1; half < size; half *= 2) {
+			unsigned step = size / (2 * half);
+			for (unsigned i = 0; i < size; i += 2 * half) {
+				for (unsigned j = 0; j < half; ++j) {
+					float w_re = twiddle_re[j * step];
+					float w_im = twiddle_im[j * step];
+					unsigned a = i + j, b = a + half;
+					float t_re = re[b] * w_re - im[b] * w_im;
+					float t_im = re[b] * w_im + im[b] * w_re;
+					re[b] = re[a] - t_re;
+					im[b] = im[a] - t_im;
+					re[a] += t_re;
+					im[a] += t_im;
+				}
+			}
+		}
+	}
+
+	size_t size;
+	unsigned hop;
+	unsigned first_bin;
+	unsigned bins;
+	float scale;
+
+	std::vector<float> window;
+	std::vector<float> twiddle_re, twiddle_im;
+	std::vector<unsigned> reversed;
+
+	// The last (up to) size samples
+	std::vector<int16_t> input;
+	std::vector<float> re, im;
+	std::vector<float> levels;
+	uint64_t frame_count = 0;
+};
+
+#endif
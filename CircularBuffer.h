@@ -28,6 +28,8 @@
 #ifndef __CIRCULAR_BUFFER_H
 #define __CIRCULAR_BUFFER_H
 
+#include <atomic>
+
 namespace KK5JY {
 	namespace Collections {
 		/// <summary>
@@ -187,6 +189,221 @@ namespace KK5JY {
 					return m_Data[offset];
 				}
 		};
+
+		/// <summary>
+		/// Up to two contiguous runs of items, oldest first, as returned by
+		/// <c>StaticCircularBuffer::Spans()</c>.
+		/// </summary>
+		template <typename T>
+		struct CircularSpans {
+			const T *Data[2];
+			int Length[2];
+		};
+
+		/// <summary>
+		/// Circular buffer with a compile-time capacity, which must be a
+		/// power of two.  The storage is part of the object, and indices
+		/// are masked instead of using a modulo.  Items that do not fit
+		/// are dropped and counted.
+		/// </summary>
+		template <typename T, unsigned N>
+		class StaticCircularBuffer {
+			static_assert(N > 0 && (N & (N - 1)) == 0, "capacity must be a power of two");
+
+			private:
+				/// <summary>
+				/// The index mask.
+				/// </summary>
+				static const unsigned Mask = N - 1;
+
+				/// <summary>
+				/// The data storage.
+				/// </summary>
+				T m_Data[N];
+
+				/// <summary>
+				/// The input counter; wraps, only used masked.
+				/// </summary>
+				unsigned m_In;
+
+				/// <summary>
+				/// The output counter; wraps, only used masked.
+				/// </summary>
+				unsigned m_Out;
+
+				/// <summary>
+				/// Number of items dropped because the buffer was full, only written by the thread that adds.
+				/// </summary>
+				std::atomic<unsigned> m_Overflows;
+
+			public:
+				/// <summary>
+				/// Create a new, empty circular buffer.
+				/// </summary>
+				StaticCircularBuffer() : m_Overflows(0) {
+					Clear();
+				}
+
+				/// <summary>
+				/// Gets the number of items in the buffer.
+				/// </summary>
+				int Count() const {
+					return m_In - m_Out;
+				}
+
+				/// <summary>
+				/// Gets the number of items the buffer can hold.
+				/// </summary>
+				int Capacity() const {
+					return N;
+				}
+
+				/// <summary>
+				/// Returns true if the buffer is full.
+				/// </summary>
+				bool Full() const {
+					return m_In - m_Out == N;
+				}
+
+				/// <summary>
+				/// Gets the number of items dropped because the buffer was full.
+				/// </summary>
+				unsigned Overflows() const {
+					return m_Overflows.load(std::memory_order_relaxed);
+				}
+
+				/// <summary>
+				/// Return the first item in the buffer.
+				/// </summary>
+				bool First(T &result) const {
+					if (m_In == m_Out) {
+						return false;
+					}
+
+					result = m_Data[m_Out & Mask];
+					return true;
+				}
+
+				/// <summary>
+				/// Return the last item in the buffer.
+				/// </summary>
+				bool Last(T &result) const {
+					if (m_In == m_Out) {
+						return false;
+					}
+
+					result = m_Data[(m_In - 1) & Mask];
+					return true;
+				}
+
+				/// <summary>
+				/// Add a new item.
+				/// </summary>
+				/// <returns>False if the buffer was full, and the item was dropped.</returns>
+				bool Add(const T &item) {
+					if (Full()) {
+						m_Overflows.store(m_Overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+						return false;
+					}
+
+					m_Data[m_In++ & Mask] = item;
+					return true;
+				}
+
+				/// <summary>
+				/// Add a number of items, as far as they fit.
+				/// </summary>
+				/// <returns>The number of items added, the rest is dropped.</returns>
+				int AddItems(const T *items, int count) {
+					int room = N - Count();
+					if (count > room) {
+						m_Overflows.store(m_Overflows.load(std::memory_order_relaxed) + count - room, std::memory_order_relaxed);
+						count = room;
+					}
+
+					for (int i = 0; i < count; ++i) {
+						m_Data[m_In++ & Mask] = items[i];
+					}
+					return count;
+				}
+
+				/// <summary>
+				/// Remove and return an item.
+				/// </summary>
+				bool Remove(T &result) {
+					if (m_In == m_Out) {
+						return false;
+					}
+
+					result = m_Data[m_Out++ & Mask];
+					return true;
+				}
+
+				/// <summary>
+				/// Remove items from the front of the buffer, copying them out.
+				/// </summary>
+				/// <returns>The number of items removed.</returns>
+				int RemoveItems(T *result, int count) {
+					if (count > Count()) {
+						count = Count();
+					}
+
+					for (int i = 0; i < count; ++i) {
+						result[i] = m_Data[m_Out++ & Mask];
+					}
+					return count;
+				}
+
+				/// <summary>
+				/// Remove items from the front of the buffer.
+				/// </summary>
+				/// <param name="count">The number of items to remove.</param>
+				int RemoveItems(int count) {
+					if (count > Count()) {
+						count = Count();
+					}
+
+					m_Out += count;
+					return count;
+				}
+
+				/// <summary>
+				/// Clear the circular buffer.  The overflow count is kept.
+				/// </summary>
+				void Clear() {
+					m_In = m_Out = 0;
+				}
+
+				/// <summary>
+				/// Get the specified item.
+				/// </summary>
+				/// <param name="index">The index of the item.</param>
+				/// <returns>The item.</returns>
+				const T &ItemAt(int index) const {
+					return m_Data[(m_Out + index) & Mask];
+				}
+
+				/// <summary>
+				/// Get the items in the buffer without copying them, as
+				/// at most two contiguous runs.  Valid until the buffer is
+				/// modified.
+				/// </summary>
+				/// <returns>The number of non-empty runs.</returns>
+				int Spans(CircularSpans<T> &spans) const {
+					unsigned start = m_Out & Mask;
+					int count = Count();
+					int first = N - start;
+					if (first > count) {
+						first = count;
+					}
+
+					spans.Data[0] = m_Data + start;
+					spans.Length[0] = first;
+					spans.Data[1] = m_Data;
+					spans.Length[1] = count - first;
+					return (first != 0) + (count != first);
+				}
+		};
 	}
 }
 
@@ -0,0 +1,423 @@
+/*
+ *
+ *
+ *    CwBeamDecoder.h
+ *
+ *    Soft-decision decoder, translating element timing directly into text.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __CW_BEAM_DECODER_H
+#define __CW_BEAM_DECODER_H
+
+#include <stdint.h>
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include "Elements.h"
+#include "MorseCode.h"
+
+namespace KK5JY {
+	namespace CW {
+		/// <summary>
+		/// A decoded character, with the probability that it is right.
+		/// </summary>
+		struct BeamCharacter {
+			char Value;
+			float Confidence;
+		};
+
+		/// <summary>
+		/// Decodes elements into text without deciding on every element
+		/// separately.  A bounded beam of hypotheses is kept, each being
+		/// one interpretation of the elements so far (which marks are
+		/// dots or dashes, which spaces end a character or word).  They
+		/// are scored by how well the element lengths fit the dot length
+		/// (a log-normal model), and hypotheses that leave the codebook
+		/// are dropped as soon as their pattern is no prefix of a known
+		/// character.  Hypotheses with the same current pattern and text
+		/// are merged, like in the Viterbi algorithm.
+		///
+		/// Text is emitted per word, when the best hypothesis ends a word.
+		/// The confidence of each character is the share of the beam
+		/// (weighted by likelihood) that agrees with the text up to and
+		/// including that character.
+		///
+		/// The work per element is bounded by the beam width, and no
+		/// memory is allocated.
+		/// </summary>
+		class CwBeamDecoder {
+			public:
+				/// <summary>
+				/// The maximum beam width.
+				/// </summary>
+				static const unsigned MaximumWidth = 32;
+
+				/// <summary>
+				/// Longer words are emitted in parts.
+				/// </summary>
+				static const unsigned MaximumWordLength = 24;
+
+				/// <summary>
+				/// The most characters returned by a single call.
+				/// </summary>
+				static const unsigned MaximumOutput = MaximumWordLength + 1;
+
+			private:
+				/// <summary>
+				/// One interpretation of the elements since the last
+				/// emitted text.
+				/// </summary>
+				struct Hypothesis {
+					float Score;			// log likelihood
+					MorsePattern Pattern;	// the current character so far
+					uint8_t Length;			// number of characters in Text
+					bool WordEnd;			// the last element ended a word
+					uint32_t Hash;			// hash of Text, to merge quickly
+					char Text[MaximumWordLength];
+				};
+
+				/// <summary>
+				/// The current beam, best first.
+				/// </summary>
+				Hypothesis m_Beam[MaximumWidth];
+				unsigned m_Count;
+
+				/// <summary>
+				/// The candidates for the next beam.
+				/// </summary>
+				Hypothesis m_Next[MaximumWidth * 3];
+				unsigned m_NextCount;
+
+				/// <summary>
+				/// The best candidate score so far.
+				/// </summary>
+				float m_NextBest;
+
+				/// <summary>
+				/// The configured beam width.
+				/// </summary>
+				unsigned m_Width;
+
+				/// <summary>
+				/// The dot length of the last element, for Flush().
+				/// </summary>
+				float m_DotLength;
+
+				/// <summary>
+				/// The log of the element lengths in dots, and the scale of the
+				/// log likelihood, computed from the settings for each element.
+				/// </summary>
+				float m_LogDash;
+				float m_LogCharSpace;
+				float m_LogWordSpace;
+				float m_Scale;
+
+			public:
+				/// <summary>
+				/// The standard deviation of the log of element lengths.  0.25
+				/// means about 25% timing error is considered normal.
+				/// </summary>
+				float Sigma;
+
+				/// <summary>
+				/// The length of a dash, as a multiple of the dot length.
+				/// </summary>
+				float DashLength;
+
+				/// <summary>
+				/// The length of a character space, as a multiple of the dot length.
+				/// </summary>
+				float CharSpaceLength;
+
+				/// <summary>
+				/// The length of a word space, as a multiple of the dot length.
+				/// </summary>
+				float WordSpaceLength;
+
+				/// <summary>
+				/// Hypotheses this much (in log likelihood) below the best
+				/// are dropped.
+				/// </summary>
+				float PruneMargin;
+
+				/// <summary>
+				/// Emitted when no hypothesis can explain the elements.
+				/// </summary>
+				char ErrorSymbol;
+
+			public:
+				/// <summary>
+				/// Construct a new decoder.
+				/// </summary>
+				CwBeamDecoder(unsigned width = 16) {
+					Sigma = 0.25;
+					DashLength = 3;
+					CharSpaceLength = 3;
+					WordSpaceLength = 7;
+					PruneMargin = 15;
+					ErrorSymbol = '~';
+					m_DotLength = 0;
+					Width(width);
+				}
+
+				/// <summary>
+				/// Return the beam width.
+				/// </summary>
+				unsigned Width() const { return m_Width; }
+
+				/// <summary>
+				/// Set the beam width, and start over.
+				/// </summary>
+				void Width(unsigned width) {
+					if (width > MaximumWidth)
+						width = MaximumWidth;
+					m_Width = width ? width : 1;
+					Reset();
+				}
+
+				/// <summary>
+				/// Forget all hypotheses.
+				/// </summary>
+				void Reset() {
+					m_Beam[0] = Empty();
+					m_Count = 1;
+				}
+
+				/// <summary>
+				/// Decode the next element.
+				/// </summary>
+				/// <param name="element">The element.</param>
+				/// <param name="dotLength">The dot length, in the unit of the element length.</param>
+				/// <param name="out">Receives the emitted characters, needs room for MaximumOutput.</param>
+				/// <returns>The number of characters emitted.</returns>
+				int Decode(const CwElement &element, float dotLength, BeamCharacter *out) {
+					if (element.Length == 0 || dotLength <= 0)
+						return 0;
+					m_DotLength = dotLength;
+					m_LogDash = logf(DashLength);
+					m_LogCharSpace = logf(CharSpaceLength);
+					m_LogWordSpace = logf(WordSpaceLength);
+					m_Scale = -1 / (2 * Sigma * Sigma);
+
+					float x = logf(element.Length / dotLength);
+					m_NextCount = 0;
+					m_NextBest = -FLT_MAX;
+					for (unsigned i = 0; i != m_Count; ++i) {
+						if (element.Mark)
+							ExpandMark(m_Beam[i], x);
+						else
+							ExpandSpace(m_Beam[i], x);
+					}
+
+					// Nothing fits, for example too many dots for any
+					// character.  Emit what we have, with an error, and
+					// start over from this element.
+					if (m_NextCount == 0) {
+						int n = Emit(out);
+						out[n].Value = ErrorSymbol;
+						out[n].Confidence = 0;
+						++n;
+						Reset();
+						if (element.Mark) {
+							m_NextBest = -FLT_MAX;
+							ExpandMark(m_Beam[0], x);
+							Select();
+						}
+						return n;
+					}
+
+					Select();
+
+					// Emit at the end of a word, or when the text gets too long
+					if (m_Beam[0].WordEnd || m_Beam[0].Length + 2u > MaximumWordLength)
+						return Emit(out);
+					return 0;
+				}
+
+				/// <summary>
+				/// Emit the current word, as if a word space was received.
+				/// </summary>
+				int Flush(BeamCharacter *out) {
+					if (m_DotLength <= 0)
+						return 0;
+					CwElement space;
+					space.Mark = false;
+					space.Length = WordSpaceLength * m_DotLength + 1;
+					int n = Decode(space, m_DotLength, out);
+					if (n == 0)
+						n = Emit(out);
+					return n;
+				}
+
+			private:
+				/// <summary>
+				/// A hypothesis without elements or text.
+				/// </summary>
+				static Hypothesis Empty() {
+					Hypothesis h;
+					h.Score = 0;
+					h.Pattern = 1;
+					h.Length = 0;
+					h.WordEnd = true;
+					h.Hash = 2166136261u;
+					return h;
+				}
+
+				/// <summary>
+				/// The log likelihood of a (log) element length relative to the
+				/// dot length, for an element of the given (log) length in dots.
+				/// </summary>
+				float Fit(float x, float length) const {
+					float e = x - length;
+					return m_Scale * e * e;
+				}
+
+				/// <summary>
+				/// Add the hypotheses for a mark: a dot or a dash added to the
+				/// current character.
+				/// </summary>
+				void ExpandMark(const Hypothesis &h, float x) {
+					unsigned len = MorsePatternLength(h.Pattern);
+					if (len >= MorseMaxElements)
+						return;
+					MorsePattern base = h.Pattern & ~(1 << len);
+					MorsePattern dot = base | (1 << (len + 1));
+					MorsePattern dash = dot | (1 << len);
+					if (MorseCode.Prefix[dot])
+						Add(h, h.Score + Fit(x, 0), dot, 0, false);
+					if (MorseCode.Prefix[dash])
+						Add(h, h.Score + Fit(x, m_LogDash), dash, 0, false);
+				}
+
+				/// <summary>
+				/// Add the hypotheses for a space: within a character, at
+				/// the end of a character, or at the end of a word.
+				/// </summary>
+				void ExpandSpace(const Hypothesis &h, float x) {
+					// Between words, all spaces are the same
+					if (h.Pattern == 1) {
+						float score = std::max(Fit(x, m_LogCharSpace), Fit(x, m_LogWordSpace));
+						Add(h, h.Score + score, 1, 0, h.WordEnd || Fit(x, m_LogWordSpace) >= Fit(x, m_LogCharSpace));
+						return;
+					}
+
+					Add(h, h.Score + Fit(x, 0), h.Pattern, 0, false);
+
+					char ch = MorseCode.Decode[h.Pattern];
+					if (ch == 0)
+						return;
+					Add(h, h.Score + Fit(x, m_LogCharSpace), 1, ch, false);
+					Add(h, h.Score + Fit(x, m_LogWordSpace), 1, ch, true);
+				}
+
+				/// <summary>
+				/// Add a candidate for the next beam.
+				/// </summary>
+				void Add(const Hypothesis &from, float score, MorsePattern pattern, char ch, bool wordEnd) {
+					if (score < m_NextBest - PruneMargin)
+						return;
+					unsigned length = from.Length + (ch != 0) + (wordEnd && !from.WordEnd);
+					if (length > MaximumWordLength)
+						return;
+
+					Hypothesis &h = m_Next[m_NextCount++];
+					h = from;
+					h.Score = score;
+					h.Pattern = pattern;
+					h.WordEnd = wordEnd;
+					if (ch)
+						Append(h, ch);
+					if (wordEnd && !from.WordEnd)
+						Append(h, ' ');
+					if (score > m_NextBest)
+						m_NextBest = score;
+				}
+
+				static void Append(Hypothesis &h, char ch) {
+					h.Text[h.Length++] = ch;
+					h.Hash = (h.Hash ^ (unsigned char)ch) * 16777619u;
+				}
+
+				/// <summary>
+				/// Keep the best, distinct candidates as the new beam.
+				/// </summary>
+				void Select() {
+					std::sort(m_Next, m_Next + m_NextCount, [](const Hypothesis &a, const Hypothesis &b) {
+						return a.Score > b.Score;
+					});
+					m_Count = 0;
+					for (unsigned i = 0; i != m_NextCount && m_Count != m_Width; ++i) {
+						const Hypothesis &h = m_Next[i];
+						if (h.Score < m_Next[0].Score - PruneMargin)
+							break;
+						// The first (best) one of identical hypotheses wins
+						bool duplicate = false;
+						for (unsigned j = 0; j != m_Count && !duplicate; ++j) {
+							const Hypothesis &k = m_Beam[j];
+							duplicate = k.Pattern == h.Pattern && k.Length == h.Length && k.WordEnd == h.WordEnd &&
+							            k.Hash == h.Hash && std::equal(k.Text, k.Text + k.Length, h.Text);
+						}
+						if (!duplicate)
+							m_Beam[m_Count++] = h;
+					}
+				}
+
+				/// <summary>
+				/// Emit the text of the best hypothesis, with the confidence
+				/// of each character, and continue with only that hypothesis.
+				/// </summary>
+				int Emit(BeamCharacter *out) {
+					const Hypothesis &best = m_Beam[0];
+					float weights[MaximumWidth];
+					bool agree[MaximumWidth];
+					float total = 0;
+					for (unsigned j = 0; j != m_Count; ++j) {
+						weights[j] = expf(m_Beam[j].Score - best.Score);
+						agree[j] = true;
+						total += weights[j];
+					}
+
+					for (unsigned i = 0; i != best.Length; ++i) {
+						float share = 0;
+						for (unsigned j = 0; j != m_Count; ++j) {
+							const Hypothesis &h = m_Beam[j];
+							agree[j] = agree[j] && h.Length > i && h.Text[i] == best.Text[i];
+							if (agree[j])
+								share += weights[j];
+						}
+						out[i].Value = best.Text[i];
+						out[i].Confidence = share / total;
+					}
+
+					int n = best.Length;
+					Hypothesis next = Empty();
+					next.Pattern = best.Pattern;
+					next.WordEnd = best.WordEnd;
+					m_Beam[0] = next;
+					m_Count = 1;
+					return n;
+				}
+		};
+	}
+}
+
+#endif
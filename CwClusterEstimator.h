@@ -0,0 +1,386 @@
+/*
+ *
+ *
+ *    CwClusterEstimator.h
+ *
+ *    Speed estimation by tracking clusters of mark and space lengths.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __CW_CLUSTER_ESTIMATOR_H
+#define __CW_CLUSTER_ESTIMATOR_H
+
+#include <math.h>
+#include <float.h>
+#include "Elements.h"
+
+namespace KK5JY {
+	namespace CW {
+		/// <summary>
+		/// Number of mark and space clusters.
+		/// </summary>
+		const unsigned ClusterMarks = 2;
+		const unsigned ClusterSpaces = 3;
+
+		/// <summary>
+		/// Cluster lengths in dots, their logarithm, and a cost for
+		/// assigning an element to them.  The cost makes the fit prefer
+		/// the most common spaces (element spaces) when an ambiguous
+		/// sequence, like a run of dots, fits both.
+		/// </summary>
+		const float ClusterMarkMultiple[ClusterMarks] = { 1, 3 };
+		const float ClusterMarkLog[ClusterMarks] = { 0, 1.0986123f };
+		const float ClusterMarkCost[ClusterMarks] = { 0, 0 };
+		const float ClusterSpaceMultiple[ClusterSpaces] = { 1, 3, 7 };
+		const float ClusterSpaceLog[ClusterSpaces] = { 0, 1.0986123f, 1.9459101f };
+		const float ClusterSpaceCost[ClusterSpaces] = { 0, 0.05f, 0.1f };
+
+		/// <summary>
+		/// Estimates the dot length from both marks and spaces, by
+		/// tracking them as separate clusters: dots and dashes, and
+		/// element, character and word spaces.
+		///
+		/// At the start of a transmission (after a long pause), the first
+		/// few elements are fitted together: every dot length candidate
+		/// they suggest (each length divided by 1, 3 or 7) is scored by how
+		/// well it explains all of them, so the speed is known after a
+		/// handful of elements, also for runs of only dots or dashes.
+		/// After that, each cluster follows its own elements with an
+		/// exponential average, and the dot length is derived from all of
+		/// them.  Elements that fit none of the clusters restart the fit.
+		///
+		/// All comparisons are done on the logarithm of the length, so
+		/// the tolerance is relative to the element length.
+		/// </summary>
+		class CwClusterEstimator {
+			public:
+				/// <summary>
+				/// Number of elements fitted at the start of a transmission.
+				/// </summary>
+				static const unsigned AcquireLength = 8;
+
+				/// <summary>
+				/// A space at least this many dots long ends a transmission.
+				/// </summary>
+				static constexpr float PauseLength = 10;
+
+			private:
+				/// <summary>
+				/// Weight of the previous dot length in the fit, to break
+				/// ties in favour of the current speed.
+				/// </summary>
+				static constexpr float PriorWeight = 0.02f;
+
+				/// <summary>
+				/// Gain of the cluster averages when tracking.
+				/// </summary>
+				static constexpr float TrackGain = 0.25f;
+
+				/// <summary>
+				/// Elements further than this (as a log ratio, about a factor
+				/// 1.6) from their cluster do not fit.
+				/// </summary>
+				static constexpr float MisfitDistance = 0.47f;
+
+				/// <summary>
+				/// Maximum number of elements each cluster counts when
+				/// combining them into a dot length.
+				/// </summary>
+				static const unsigned MaximumWeight = 8;
+
+				/// <summary>
+				/// The current dot length.
+				/// </summary>
+				float m_DotLength;
+
+				/// <summary>
+				/// The cluster centers, as lengths.
+				/// </summary>
+				float m_Marks[ClusterMarks];
+				float m_Spaces[ClusterSpaces];
+
+				/// <summary>
+				/// Number of elements assigned to each cluster.
+				/// </summary>
+				unsigned m_MarkCounts[ClusterMarks];
+				unsigned m_SpaceCounts[ClusterSpaces];
+
+				/// <summary>
+				/// The elements being fitted, and their logarithm.
+				/// </summary>
+				CwElement m_Acquire[AcquireLength];
+				float m_AcquireLog[AcquireLength];
+
+				/// <summary>
+				/// The number of elements in m_Acquire.
+				/// </summary>
+				unsigned m_AcquireCount;
+
+				/// <summary>
+				/// True while fitting the start of a transmission.
+				/// </summary>
+				bool m_Acquiring;
+
+				/// <summary>
+				/// The last element that did not fit, while tracking.
+				/// </summary>
+				CwElement m_Misfit;
+				bool m_HaveMisfit;
+
+			public:
+				/// <summary>
+				/// Construct a new estimator.
+				/// </summary>
+				CwClusterEstimator(float dotLength = 1.0) {
+					Reset(dotLength);
+				}
+
+				/// <summary>
+				/// Return the current dot length.
+				/// </summary>
+				float DotLength() const { return m_DotLength; }
+
+				/// <summary>
+				/// Forget everything, and start over at the given dot length.
+				/// </summary>
+				void Reset(float dotLength) {
+					m_DotLength = dotLength > 1 ? dotLength : 1;
+					SetClusters();
+					m_AcquireCount = 0;
+					m_Acquiring = true;
+					m_HaveMisfit = false;
+				}
+
+				/// <summary>
+				/// Update the estimate with a new element.
+				/// </summary>
+				void Add(const CwElement &element) {
+					if (element.Length == 0)
+						return;
+
+					// A long pause starts a new transmission, maybe at
+					// another speed.
+					if (!element.Mark && element.Length >= PauseLength * m_DotLength) {
+						m_AcquireCount = 0;
+						m_Acquiring = true;
+						m_HaveMisfit = false;
+						return;
+					}
+
+					if (m_Acquiring) {
+						Acquire(element);
+						return;
+					}
+
+					float x = logf(element.Length);
+					unsigned k;
+					float dist = Nearest(element.Mark, x, k);
+					if (dist > MisfitDistance) {
+						// Two misfits in a row mean the speed changed, so
+						// start fitting from these.
+						if (m_HaveMisfit) {
+							m_AcquireCount = 0;
+							m_Acquiring = true;
+							m_HaveMisfit = false;
+							Acquire(m_Misfit);
+							Acquire(element);
+						} else {
+							m_Misfit = element;
+							m_HaveMisfit = true;
+						}
+						return;
+					}
+					m_HaveMisfit = false;
+
+					float &center = element.Mark ? m_Marks[k] : m_Spaces[k];
+					unsigned &count = element.Mark ? m_MarkCounts[k] : m_SpaceCounts[k];
+					center += TrackGain * (element.Length - center);
+					if (count < MaximumWeight)
+						++count;
+					Combine();
+				}
+
+			private:
+				/// <summary>
+				/// Add an element to the fit, and refit.
+				/// </summary>
+				void Acquire(const CwElement &element) {
+					m_Acquire[m_AcquireCount] = element;
+					m_AcquireLog[m_AcquireCount] = logf(element.Length);
+					++m_AcquireCount;
+
+					Fit();
+
+					if (m_AcquireCount == AcquireLength)
+						m_Acquiring = false;
+				}
+
+				/// <summary>
+				/// Find the dot length that best explains the elements being
+				/// fitted, and derive the clusters from it.
+				/// </summary>
+				void Fit() {
+					float prior = logf(m_DotLength);
+					float bestCost = Cost(prior, prior);
+					float best = prior;
+					for (unsigned i = 0; i != m_AcquireCount; ++i) {
+						const float *logs = m_Acquire[i].Mark ? ClusterMarkLog : ClusterSpaceLog;
+						unsigned n = m_Acquire[i].Mark ? ClusterMarks : ClusterSpaces;
+						for (unsigned k = 0; k != n; ++k) {
+							float d = m_AcquireLog[i] - logs[k];
+							float cost = Cost(d, prior);
+							if (cost < bestCost) {
+								bestCost = cost;
+								best = d;
+							}
+						}
+					}
+					m_DotLength = expf(best);
+					if (m_DotLength < 1)
+						m_DotLength = 1;
+
+					// Clusters that got elements start at their average
+					SetClusters();
+					float markSums[ClusterMarks] = {};
+					float spaceSums[ClusterSpaces] = {};
+					for (unsigned i = 0; i != m_AcquireCount; ++i) {
+						unsigned k;
+						Assign(m_Acquire[i].Mark, m_AcquireLog[i], best, k);
+						if (m_Acquire[i].Mark) {
+							markSums[k] += m_Acquire[i].Length;
+							++m_MarkCounts[k];
+						} else {
+							spaceSums[k] += m_Acquire[i].Length;
+							++m_SpaceCounts[k];
+						}
+					}
+					for (unsigned k = 0; k != ClusterMarks; ++k) {
+						if (m_MarkCounts[k])
+							m_Marks[k] = markSums[k] / m_MarkCounts[k];
+					}
+					for (unsigned k = 0; k != ClusterSpaces; ++k) {
+						if (m_SpaceCounts[k])
+							m_Spaces[k] = spaceSums[k] / m_SpaceCounts[k];
+					}
+				}
+
+				/// <summary>
+				/// How badly the given (log) dot length explains the
+				/// elements being fitted.
+				/// </summary>
+				float Cost(float dot, float prior) const {
+					float cost = PriorWeight * (dot - prior) * (dot - prior);
+					for (unsigned i = 0; i != m_AcquireCount; ++i) {
+						unsigned k;
+						cost += Assign(m_Acquire[i].Mark, m_AcquireLog[i], dot, k);
+					}
+					return cost;
+				}
+
+				/// <summary>
+				/// Find the cluster an element belongs to at the given (log)
+				/// dot length, returns the cost of that assignment.
+				/// </summary>
+				static float Assign(bool mark, float x, float dot, unsigned &cluster) {
+					const float *logs = mark ? ClusterMarkLog : ClusterSpaceLog;
+					const float *costs = mark ? ClusterMarkCost : ClusterSpaceCost;
+					unsigned n = mark ? ClusterMarks : ClusterSpaces;
+					float best = FLT_MAX;
+					cluster = 0;
+					for (unsigned k = 0; k != n; ++k) {
+						float e = x - dot - logs[k];
+						float cost = e * e + costs[k];
+						if (cost < best) {
+							best = cost;
+							cluster = k;
+						}
+					}
+					return best;
+				}
+
+				/// <summary>
+				/// Find the nearest tracked cluster, returns the (log) distance.
+				/// </summary>
+				float Nearest(bool mark, float x, unsigned &cluster) const {
+					const float *centers = mark ? m_Marks : m_Spaces;
+					unsigned n = mark ? ClusterMarks : ClusterSpaces;
+					float best = FLT_MAX;
+					cluster = 0;
+					for (unsigned k = 0; k != n; ++k) {
+						float dist = fabsf(x - logf(centers[k]));
+						if (dist < best) {
+							best = dist;
+							cluster = k;
+						}
+					}
+					return best;
+				}
+
+				/// <summary>
+				/// Set all clusters to their nominal length at the current
+				/// dot length, without any elements.
+				/// </summary>
+				void SetClusters() {
+					for (unsigned k = 0; k != ClusterMarks; ++k) {
+						m_Marks[k] = ClusterMarkMultiple[k] * m_DotLength;
+						m_MarkCounts[k] = 0;
+					}
+					for (unsigned k = 0; k != ClusterSpaces; ++k) {
+						m_Spaces[k] = ClusterSpaceMultiple[k] * m_DotLength;
+						m_SpaceCounts[k] = 0;
+					}
+				}
+
+				/// <summary>
+				/// Derive the dot length from the clusters, weighted by the
+				/// number of elements they have seen.  Word spaces vary too
+				/// much to be useful here.
+				/// </summary>
+				void Combine() {
+					float sum = 0;
+					float weight = 0;
+					for (unsigned k = 0; k != ClusterMarks; ++k) {
+						sum += m_MarkCounts[k] * m_Marks[k] / ClusterMarkMultiple[k];
+						weight += m_MarkCounts[k];
+					}
+					for (unsigned k = 0; k != ClusterSpaces - 1; ++k) {
+						sum += m_SpaceCounts[k] * m_Spaces[k] / ClusterSpaceMultiple[k];
+						weight += m_SpaceCounts[k];
+					}
+					if (weight > 0)
+						m_DotLength = sum / weight;
+
+					// Clusters without elements follow the others
+					for (unsigned k = 0; k != ClusterMarks; ++k) {
+						if (!m_MarkCounts[k])
+							m_Marks[k] = ClusterMarkMultiple[k] * m_DotLength;
+					}
+					for (unsigned k = 0; k != ClusterSpaces; ++k) {
+						if (!m_SpaceCounts[k])
+							m_Spaces[k] = ClusterSpaceMultiple[k] * m_DotLength;
+					}
+				}
+		};
+
+	}
+}
+
+#endif
@@ -32,35 +32,18 @@
 #include <ctype.h>
 #include <queue>
 
+#include "CircularBuffer.h"
+#include "Elements.h"
+#include "MorseCode.h"
+
+using namespace KK5JY::Collections;
+
 namespace KK5JY {
 	namespace CW {
 		/// <summary>
 		/// Decodes International Morse Code into a character stream.
 		/// </summary>
 		class CwDecoderLogic {
-			private:
-				typedef unsigned char byte;
-			private:
-				/// <summary>
-				/// The lookup table: an array of { length, pattern, decoded_char }
-				/// </summary>
-				byte** m_Mapping;
-
-				/// <summary>
-				/// The hash table: an array of offsets into each table section
-				/// </summary>
-				byte* m_Hashes;
-
-				/// <summary>
-				/// The maximum number of elements per character.
-				/// </summary>
-				int m_MaxElements;
-				
-				/// <summary>
-				/// The size of the mapping table.
-				/// </summary>
-				int m_MappingLength;
-
 			public:
 				/// <summary>
 				/// The symbol to print if decoding fails for a single character.
@@ -71,188 +54,66 @@ namespace KK5JY {
 				/// Returns the number of symbols in the lookup table.
 				/// </summary>
 				int SymbolCount() {
-					return m_MappingLength;
+					return MorseCodebookLength;
 				}
 
 			private:
-				/// <summary>
-				/// Converts a string/char pair into a table entry.
-				/// </summary>
-				/// <param name="sPattern">The pattern of marks.</param>
-				/// <param name="decodedValue">The character to decode when matching this pattern.</param>
-				/// <returns>The table entry, a byte[3] array containing { length, pattern, decoded_char }.</returns>
-				byte* MakeTableEntry(const char *sPattern, char decodedValue) {
-					// create the pattern
-					byte mask = 1;
-					byte pattern = 0;
-					byte len = strlen(sPattern);
-					for (int i = 0; i != len; ++i) {
-						if (sPattern[i] == '-')
-							pattern |= mask;
-						mask <<= 1;
-					}
-
-					// create the overall entry
-					byte* result = new byte[3];
-					result[0] = len;					// length
-					result[1] = pattern;				// pattern
-					result[2] = (byte)(decodedValue);	// value
-					return result;
-				}
-
 				/// <summary>
 				/// Search for a pattern.
 				/// </summary>
 				/// <param name="symbol">The symbol.</param>
 				/// <param name="sLen">The symbol length.</param>
 				/// <returns>The decoded character.</returns>
-				char Lookup(byte symbol, byte sLen) {
+				char Lookup(MorsePattern symbol, unsigned sLen) {
 					// if the length is invalid, just give up now
-					if (sLen <= 0 || sLen > m_MaxElements) {
+					if (sLen <= 0 || sLen > MorseMaxElements) {
 						return ErrorSymbol;
 					}
 
-					// lookup the hash, and start looking for the pattern there
-					for (int i = m_Hashes[sLen - 1]; i != m_MappingLength; ++i) {
-						// fetch the next table entry
-						byte *entry = m_Mapping[i];
-
-						// if the end of the table section has been reached, give up
-						if (entry[0] != sLen)
-							break;
-
-						// if a match is found, return that
-						if (entry[1] == symbol) {
-							return (char)entry[2];
-						}
-					}
-
-					// no luck?
-					return ErrorSymbol;
+					char ch = MorseCode.Decode[symbol | (1 << sLen)];
+					return ch ? ch : ErrorSymbol;
 				}
 
 				/// <summary>
 				/// Find a symbol encoding.
 				/// </summary>
-				bool Lookup(char ch, byte &pattern, byte &length) {
-					// lookup the hash, and start looking for the pattern there
-					for (int i = 0; i != m_MappingLength; ++i) {
-						// fetch the next table entry
-						byte *entry = m_Mapping[i];
-
-						// if a match is found, return that
-						if (entry[2] == ch) {
-							length = entry[0];
-							pattern = entry[1];
-							return true;
-						}
-					}
-					return false;
+				bool Lookup(char ch, MorsePattern &pattern, unsigned &length) {
+					unsigned index = (unsigned char)ch;
+					if (index >= MorseCharCount || MorseCode.Encode[index] == 0)
+						return false;
+
+					MorsePattern entry = MorseCode.Encode[index];
+					length = MorsePatternLength(entry);
+					pattern = entry & ~(1 << length);
+					return true;
 				}
+
+				/// <summary>
+				/// The symbol shift register of <c>DecodeElement()</c>.
+				/// </summary>
+				MorsePattern m_Symbol;
+
+				/// <summary>
+				/// The bit mask of the next mark in m_Symbol.
+				/// </summary>
+				MorsePattern m_Mask;
+
+				/// <summary>
+				/// The number of marks in m_Symbol.
+				/// </summary>
+				unsigned m_Bits;
 				
 
 			public:
 				/// <summary>
-				/// Initialize the decoder.
+				/// Initialize the decoder.  The lookup tables are
+				/// generated at compile time (see MorseCode.h), so this
+				/// does not allocate anything.
 				/// </summary>
 				CwDecoderLogic() {
 					// the default error symbol
 					ErrorSymbol = '~';
-					#define PSTR(x) x
-					#define strcpy_P strcpy
-
-					// lookup table, sorted by pattern length, and roughly lexically
-					m_MappingLength = 56;
-					m_Mapping = new byte*[m_MappingLength];
-					byte **bp = m_Mapping;
-					char fbuf[10]; // used to translate from flash literals
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".")),    'E');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-")),    'T');
-
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".-")),   'A');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("..")),   'I');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("--")),   'M');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-.")),   'N');
-
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-..")),  'D');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("--.")),  'G');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("---")),  'O');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-.-")),  'K');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".-.")),  'R');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("...")),  'S');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("..-")),  'U');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".--")),  'W');
-		
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-...")), 'B');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-.-.")), 'C');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("..-.")), 'F');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("....")), 'H');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".---")), 'J');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".-..")), 'L');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".--.")), 'P');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("--.-")), 'Q');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("...-")), 'V');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-..-")), 'X');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-.--")), 'Y');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("--..")), 'Z');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".-.-")), '\n');
-
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-----")), '0');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".----")), '1');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("..---")), '2');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("...--")), '3');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("....-")), '4');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".....")), '5');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-....")), '6');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("--...")), '7');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("---..")), '8');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("----.")), '9');
-/*
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-..-.")), '/');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".-...")), '&');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-...-")), '=');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".-.-.")), '+');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-.--.")), '(');
-*/
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".-.-.-")), '.');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("--..--")), ',');
-				/*	*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("..--..")), '?');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".----.")), ',');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-.-.--")), ',');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-.--.-")), ')');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("---...")), ':');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-.-.-.")), ';');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-....-")), '-');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("..--.-")), '_');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".-..-.")), '"');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR(".--.-.")), '@');
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("-.-.--")), '!');
-
-					*bp++ = MakeTableEntry(strcpy_P(fbuf, PSTR("...-..-")), '$');
-					*/
-					// Update length, because some entries were removed above
-					m_MappingLength = bp - m_Mapping;
-
-					// compute maximum element size
-					m_MaxElements = 0;
-					for (int i = 0; i != m_MappingLength; ++i) {
-						byte len = m_Mapping[i][0];
-						if (m_Mapping[i][0] > m_MaxElements) {
-							m_MaxElements = len;
-						}
-					}
-					// initialize hashes table
-					m_Hashes = new byte[m_MaxElements];
-					for (int i = 0; i != m_MaxElements; ++i) {
-						m_Hashes[i] = 0;
-					}
-					// configure hashes
-					for (int i = 0; i != m_MappingLength; ++i) {
-						byte len = m_Mapping[i][0];
-						if (len > 1 && m_Hashes[len - 1] == 0) {
-							m_Hashes[len - 1] = (byte)i;
-						}
-					}
+					ResetStream();
 				}
 
 				/// <summary>
@@ -260,11 +121,12 @@ namespace KK5JY {
 				/// </summary>
 				/// <param name="raw">The raw element stream.</param>
 				/// <returns>Decoded text.</returns>
-				int Decode(CircularBuffer<MorseElements> &rxBuffer, char *buffer, int buflen) {
+				template <unsigned N>
+				int Decode(StaticCircularBuffer<MorseElements, N> &rxBuffer, char *buffer, int buflen) {
 					int result = 0;
-					byte symbol = 0;	// the symbol shift register
-					byte mask = 1;		// the current bit mask
-					byte bits = 0;		// the number of bits/marks (dot, dash) in the current symbol
+					MorsePattern symbol = 0;	// the symbol shift register
+					MorsePattern mask = 1;		// the current bit mask
+					unsigned bits = 0;		// the number of bits/marks (dot, dash) in the current symbol
 					bool done = false;	// indicates that the current pattern should be consumed
 					bool word = false;	// indicates that the current pattern is the last character in a word
 					int count = 0;		// counts how many items to consume from RX buffer once character is decoded (includes space)
@@ -277,10 +139,13 @@ namespace KK5JY {
 						word = false;
 						count = 0;
 
-						// run through the RX buffer
-						for (count = 0; count != rxBuffer.Count() && !done; ++count) {
+						// run through the RX buffer, in place
+						CircularSpans<MorseElements> spans;
+						rxBuffer.Spans(spans);
+						for (int span = 0; span != 2 && !done; ++span)
+						for (int i = 0; i != spans.Length[span] && !done; ++i, ++count) {
 							// fetch the next item from the RX buffer
-							MorseElements element = rxBuffer.ItemAt(count);
+							MorseElements element = spans.Data[span][i];
 
 							// what kind of element is this?
 							switch (element) {
@@ -291,6 +156,9 @@ namespace KK5JY {
 								case DashSpace:
 									done = true;
 									break;
+								case DotSpace:
+									// only separates the elements of a character
+									break;
 								case Dot:
 									// just leave the zero
 									mask <<= 1;
@@ -302,7 +170,7 @@ namespace KK5JY {
 									mask <<= 1;
 									break;
 							}
-							if (bits >= m_MaxElements) done = true;
+							if (bits >= MorseMaxElements) done = true;
 						}
 
 						// if an entire symbol was read...
@@ -331,14 +199,68 @@ namespace KK5JY {
 					// return what we could decode
 					return result;
 				}
+
+				/// <summary>
+				/// Decode a single element, keeping the current character
+				/// between calls.  Unlike <c>Decode()</c>, this never
+				/// rescans earlier elements.
+				/// </summary>
+				/// <param name="element">The next element.</param>
+				/// <param name="buffer">Receives the decoded text, needs room for two characters.</param>
+				/// <returns>The number of characters written: the character ended by a space, and a space after a word.</returns>
+				int DecodeElement(MorseElements element, char *buffer) {
+					int result = 0;
+					bool done = false;
+					switch (element) {
+						case WordSpace:
+						case DashSpace:
+							done = true;
+							break;
+						case Dot:
+							m_Mask <<= 1;
+							m_Bits++;
+							break;
+						case Dash:
+							m_Symbol |= m_Mask;
+							m_Mask <<= 1;
+							m_Bits++;
+							break;
+						default:
+							break;
+					}
+
+					if (done || m_Bits >= MorseMaxElements) {
+						if (m_Bits) {
+							char ch = Lookup(m_Symbol, m_Bits);
+							if (ch != 0) {
+								buffer[result++] = ch;
+							}
+						}
+						ResetStream();
+					}
+
+					if (element == WordSpace) {
+						buffer[result++] = ' ';
+					}
+					return result;
+				}
+
+				/// <summary>
+				/// Drop the character in progress of <c>DecodeElement()</c>.
+				/// </summary>
+				void ResetStream() {
+					m_Symbol = 0;
+					m_Mask = 1;
+					m_Bits = 0;
+				}
 			
 				/// <summary>
 				/// Do the encoding.
 				/// </summary>
 				void Encode(char ch, std::queue<MorseElements>& queue) {
-					byte pattern;
-					byte patLen;
-					byte mask;
+					MorsePattern pattern;
+					unsigned patLen;
+					MorsePattern mask;
 					bool marked = false;
 
 					if (isspace(ch)) {
@@ -350,7 +272,7 @@ namespace KK5JY {
 						return;
 
 					mask = 1;
-					for (int j = 0; j != patLen; ++j) {
+					for (unsigned j = 0; j != patLen; ++j) {
 						if ((pattern & mask) != 0) {
 							// dash
 							if (marked)
@@ -0,0 +1,426 @@
+/*
+ *    CwEnsemble.h
+ *
+ *    Decodes the same pulses with several timing settings at once, and
+ *    picks the most plausible text per word.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __CW_ENSEMBLE_H
+#define __CW_ENSEMBLE_H
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CircularBuffer.h"
+#include "CwDecoderLogic.h"
+#include "CwTimingLogic.h"
+#include "MorseDictionary.h"
+
+using namespace KK5JY::Collections;
+using namespace KK5JY::CW;
+
+// The limits of CwTimingLogic that matter most for how a fist is read,
+// see telegraph-score
+struct TimingConfig {
+	std::string name;
+	// MaximumDotSpaceLength and MinimumWordSpace, in dots
+	float dot_space;
+	float word_space;
+	SpeedEstimators estimator;
+
+	void apply(CwTimingLogic &timing) const {
+		timing.MaximumDotSpaceLength = dot_space;
+		timing.MinimumWordSpace = word_space;
+		timing.Estimator(estimator);
+	}
+};
+
+// The default members of an ensemble: the CwTimingLogic defaults, the
+// lenient limits of the controller and something in between, each with
+// both estimators. Ordered by how well they do on their own in
+// telegraph-score, since the first is preferred until others win.
+inline std::vector<TimingConfig> default_ensemble() {
+	return {
+		{"standard+cl", 2, 4.5, EstimatorCluster},
+		{"between+cl", 3, 7, EstimatorCluster},
+		{"standard", 2, 4.5, EstimatorBoxCar},
+		{"between", 3, 7, EstimatorBoxCar},
+		{"lenient+cl", 4, 15, EstimatorCluster},
+		{"lenient", 4, 15, EstimatorBoxCar},
+	};
+}
+
+// Common words and abbreviations in amateur radio CW, for
+// ensemble_word_score()
+const char *const ENSEMBLE_WORDS[] = {
+	"CQ", "DE", "K", "KN", "SK", "AR", "BK", "R", "TU", "TNX", "TKS", "FB",
+	"OM", "YL", "UR", "RST", "5NN", "599", "579", "ES", "HR", "HW", "NAME",
+	"QTH", "WX", "RIG", "ANT", "PWR", "73", "88", "GM", "GA", "GE", "GN",
+	"DX", "TEST", "QSL", "QRZ", "QRL", "QRS", "QRQ", "QSB", "QRM", "QRN",
+	"AGN", "PSE", "BT", "CL", "CUL", "GL", "GUD", "HI", "OP", "SRI", "FER",
+	"WID", "ABT", "RPT", "THE", "AND", "IS", "IN", "TO", "OF", "IT", "MY",
+	"ON", "AT", "SO", "NO", "OK", "A", "I",
+};
+
+// Whether word looks like a callsign: a prefix of one to three
+// characters with at least one letter, a digit, and one to four letters
+inline bool is_callsign(const std::string &word) {
+	size_t digit = word.find_last_of("0123456789");
+	if (digit == std::string::npos || digit == 0 || digit > 3)
+		return false;
+	size_t suffix = word.size() - digit - 1;
+	if (suffix < 1 || suffix > 4)
+		return false;
+	bool letter = false;
+	for (size_t i = 0; i < word.size(); ++i) {
+		if (!isalnum((unsigned char)word[i]))
+			return false;
+		if (i < digit)
+			letter |= isalpha((unsigned char)word[i]) != 0;
+		else if (i > digit && !isalpha((unsigned char)word[i]))
+			return false;
+	}
+	return letter;
+}
+
+// How plausible a decoded word is. Known words and callsigns score
+// their length less one, since a single known character says little.
+// Undecodable characters cost two each, and unknown single characters
+// (usually a word split in pieces) cost one.
+inline float ensemble_word_score(const std::string &word, char error_symbol) {
+	float score = 0;
+	for (char c : word) {
+		if (c == error_symbol)
+			score -= 2;
+	}
+	if (score < 0)
+		return score;
+	for (const char *known : ENSEMBLE_WORDS) {
+		if (word == known)
+			return word.size() - 1;
+	}
+	if (is_callsign(word))
+		return word.size() - 1;
+	return word.size() == 1 ? -1 : 0;
+}
+
+// One decoder configuration in an ensemble: its own timing and decoder
+// logic, and the text it decoded since the last arbitration
+class CwEnsembleMember {
+public:
+	CwEnsembleMember(const TimingConfig &config, float wpm) : config(config) {
+		timing.RxWPM(wpm);
+		timing.RxMode(SpeedAuto);
+		config.apply(timing);
+	}
+
+	void add(const CwElement &element) {
+		raw.Add(element);
+		fed++;
+		timing.Decode(raw, classified);
+		decode();
+	}
+
+	// The transmission ended, so whatever this member made of the last
+	// space, that was the end of a word
+	void end() {
+		if (word_ended())
+			return;
+		timing.EndCharacter(classified);
+		decode();
+		char out[2];
+		text.append(out, decoder.DecodeElement(WordSpace, out));
+		done = fed;
+		last = WordSpace;
+	}
+
+	// Whether every element so far was classified, and the last one
+	// ended a character (or word)
+	bool at_boundary() const {
+		return done == fed && (last == DashSpace || last == WordSpace);
+	}
+
+	bool word_ended() const {
+		return done == fed && last == WordSpace;
+	}
+
+	const TimingConfig config;
+	CwTimingLogic timing;
+	CwDecoderLogic decoder;
+	std::string text;
+	// Times this member was picked. Read by the statistics thread as
+	// well, so atomic.
+	std::atomic<unsigned> wins{0};
+
+private:
+	// Run the classified elements through the decoder
+	void decode() {
+		char out[2 * 32];
+		int ct = 0;
+		MorseElements elements[32];
+		int count = classified.RemoveItems(elements, 32);
+		for (int i = 0; i < count; ++i)
+			ct += decoder.DecodeElement(elements[i], out + ct);
+		text.append(out, ct);
+		done += count;
+		if (count)
+			last = elements[count - 1];
+	}
+
+	StaticCircularBuffer<CwElement, 32> raw;
+	StaticCircularBuffer<MorseElements, 32> classified;
+	uint64_t fed = 0;
+	uint64_t done = 0;
+	MorseElements last = WordSpace;
+};
+
+// Runs every pulse through all members, and whenever all of them are
+// between characters and at least one of them between words, passes on
+// the text of the member that scores best, see ensemble_word_score().
+// On a tie, the member that won most so far is picked.
+// Other members then continue from there with an empty text, so their
+// segmentation of the next word does not depend on the winner.
+//
+// A segment normally ends at the first word space any member sees, so
+// the text lags by at most a word behind the single decoder. When the
+// members keep disagreeing about where characters end, a segment is
+// still cut off after MAX_SEGMENT elements once they all agree that a
+// character ended, without a word space.
+//
+// With threads, the members are spread over that many extra threads,
+// besides the calling one. add() waits until every member has the
+// element, so the text is passed on from the calling thread.
+class CwEnsemble {
+public:
+	typedef std::function<void(const char *text)> TextCallback;
+	typedef std::function<float(const std::string &word)> WordScore;
+
+	static const unsigned MAX_SEGMENT = 96;
+
+	CwEnsemble(const std::vector<TimingConfig> &configs, float wpm, unsigned threads = 0) {
+		for (const TimingConfig &c : configs)
+			members.emplace_back(new CwEnsembleMember(c, wpm));
+		threads = std::min<size_t>(threads, members.size() ? members.size() - 1 : 0);
+		groups.resize(threads + 1);
+		for (size_t i = 0; i < members.size(); ++i)
+			groups[i % groups.size()].push_back(members[i].get());
+		char error_symbol = members.empty() ? '~' : members[0]->decoder.ErrorSymbol;
+		word_score = [error_symbol](const std::string &word) {
+			return ensemble_word_score(word, error_symbol);
+		};
+		for (unsigned i = 1; i < groups.size(); ++i)
+			workers.emplace_back([this, i]() { run(i); });
+	}
+
+	~CwEnsemble() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		work.notify_all();
+		for (std::thread &t : workers)
+			t.join();
+	}
+
+	CwEnsemble(const CwEnsemble&) = delete;
+	CwEnsemble &operator=(const CwEnsemble&) = delete;
+
+	TextCallback on_text;
+
+	// Scores a decoded word, higher is more plausible
+	WordScore word_score;
+
+	// Also count the words in dictionary as known words
+	void use_dictionary(const MorseDictionary &dictionary) {
+		char error_symbol = members.empty() ? '~' : members[0]->decoder.ErrorSymbol;
+		word_score = [&dictionary, error_symbol](const std::string &word) {
+			float score = ensemble_word_score(word, error_symbol);
+			if (score <= 0 && dictionary.contains(word.c_str()))
+				score = word.size() - 1;
+			return score;
+		};
+	}
+
+	void add(const CwElement &element) {
+		if (workers.empty()) {
+			for (CwEnsembleMember *m : groups[0])
+				m->add(element);
+		} else {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				current = element;
+				generation++;
+				pending = workers.size();
+			}
+			work.notify_all();
+			for (CwEnsembleMember *m : groups[0])
+				m->add(element);
+			std::unique_lock<std::mutex> lock(mutex);
+			done.wait(lock, [this]() { return pending == 0; });
+		}
+
+		segment++;
+		if (element.Mark)
+			return;
+		bool all = true, word = false;
+		for (auto &m : members) {
+			all = all && m->at_boundary();
+			word = word || m->word_ended();
+		}
+		if (all && (word || segment >= MAX_SEGMENT))
+			arbitrate();
+	}
+
+	// The transmission ended, after the trailing space was passed to
+	// add(). Pass on the rest of the text, at most a word, and make sure
+	// it ends with a space.
+	void end() {
+		for (auto &m : members)
+			m->end();
+		arbitrate();
+		if (!spaced) {
+			spaced = true;
+			if (on_text)
+				on_text(" ");
+		}
+	}
+
+	const std::vector<std::unique_ptr<CwEnsembleMember>> &get_members() const { return members; }
+
+	// Segments decided so far
+	unsigned segments() const { return decided; }
+
+private:
+	// The members of groups[index] run on this thread
+	void run(unsigned index) {
+		uint64_t seen = 0;
+		while (true) {
+			CwElement element;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				work.wait(lock, [this, seen]() { return stopping || generation != seen; });
+				if (stopping)
+					return;
+				seen = generation;
+				element = current;
+			}
+			for (CwEnsembleMember *m : groups[index])
+				m->add(element);
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--pending == 0)
+				done.notify_one();
+		}
+	}
+
+	// The score of the text of a member. When the member did not see
+	// a word space, its last word is not complete yet: that one only
+	// costs for undecodable characters, like in ensemble_word_score().
+	float score(const CwEnsembleMember &m) const {
+		float total = 0;
+		size_t pos = 0;
+		const std::string &text = m.text;
+		while (pos < text.size()) {
+			size_t end = text.find(' ', pos);
+			if (end == std::string::npos)
+				end = text.size();
+			if (end == text.size() && !m.word_ended())
+				total -= 2 * std::count(text.begin() + pos, text.end(), m.decoder.ErrorSymbol);
+			else if (end > pos)
+				total += word_score(text.substr(pos, end - pos));
+			pos = end + 1;
+		}
+		return total;
+	}
+
+	void arbitrate() {
+		CwEnsembleMember *best = NULL;
+		float best_score = 0;
+		for (auto &m : members) {
+			// On a tie, stick with the member that won most, which
+			// probably suits this fist
+			float s = score(*m);
+			if (!best || s > best_score || (s == best_score && m->wins > best->wins)) {
+				best = m.get();
+				best_score = s;
+			}
+		}
+		// Pass on the words with single spaces, ending with one when
+		// the winner saw a word space
+		std::string text;
+		size_t pos = 0;
+		while (pos < best->text.size()) {
+			size_t end = best->text.find(' ', pos);
+			if (end == std::string::npos)
+				end = best->text.size();
+			if (end > pos) {
+				if (!text.empty())
+					text += ' ';
+				text.append(best->text, pos, end - pos);
+			}
+			pos = end + 1;
+		}
+		if (best->word_ended() && !text.empty())
+			text += ' ';
+
+		for (auto &m : members)
+			m->text.clear();
+		segment = 0;
+		if (text.empty())
+			return;
+		best->wins.fetch_add(1, std::memory_order_relaxed);
+		decided++;
+		spaced = text.back() == ' ';
+		if (on_text)
+			on_text(text.c_str());
+	}
+
+	std::vector<std::unique_ptr<CwEnsembleMember>> members;
+	// Members per thread, the first group runs on the calling thread
+	std::vector<std::vector<CwEnsembleMember*>> groups;
+	std::vector<std::thread> workers;
+
+	// Hands the current element to the workers
+	std::mutex mutex;
+	std::condition_variable work, done;
+	CwElement current;
+	uint64_t generation = 0;
+	size_t pending = 0;
+	bool stopping = false;
+
+	// Elements since the last arbitration
+	unsigned segment = 0;
+	unsigned decided = 0;
+	// Whether the text passed on last ended with a space
+	bool spaced = true;
+};
+
+#endif
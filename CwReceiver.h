@@ -0,0 +1,319 @@
+/*
+ *    CwReceiver.h
+ *
+ *    Turns key edges into decoded text, using CwTimingLogic and
+ *    CwDecoderLogic.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2014 by Matthew K. Roberts, KK5JY. All rights reserved.
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __CW_RECEIVER_H
+#define __CW_RECEIVER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <functional>
+
+#include "CircularBuffer.h"
+#include "CwBeamDecoder.h"
+#include "CwEnsemble.h"
+#include "WordCorrector.h"
+#include "CwTimingLogic.h"
+#include "CwDecoderLogic.h"
+#include "EdgeRecorder.h"
+#include "GpioBackend.h"
+#include "Histogram.h"
+
+using namespace KK5JY::Collections;
+using namespace KK5JY::CW;
+
+// Edges closer together than this (in µs) are considered contact bounce
+const uint32_t DEBOUNCE_TIME = 5000;
+
+// Apply the timing settings used by the controller. Shared with the
+// tools, so these see exactly the same behaviour.
+inline void configure_timing(CwTimingLogic &timing) {
+	// initialize WPM
+	timing.RxWPM(10);
+	timing.TxWPM(10);
+	timing.RxMode(SpeedAuto);
+	timing.TxMode(SpeedManual);
+
+	// Be a bit more lenient about the length of spaces, to
+	// facilitate inexperienced operators
+	timing.MaximumDotSpaceLength = 4;
+	timing.MinimumWordSpace = 15;
+}
+
+// The RX path: debounces key edges, converts them to pulses and runs
+// those through the timing and decoder logic. Decoded text is passed to
+// the on_text callback.
+class CwReceiver {
+public:
+	typedef std::function<void(const char *text)> TextCallback;
+	typedef std::function<void(const BeamCharacter *chars, int count)> BeamCallback;
+
+	CwReceiver(CwTimingLogic &timing, CwDecoderLogic &decoder, GpioBackend *gpio, unsigned key_pin)
+		: Timing(timing), Decoder(decoder), gpio(gpio), key_pin(key_pin) {
+	}
+
+	TextCallback on_text;
+
+	// The backend used to control the watchdog on the key pin
+	void set_gpio(GpioBackend *g) { gpio = g; }
+
+	// When set, the time between the end of the last mark and the
+	// emission of the text it completed is recorded here.
+	LatencyHistogram *char_latency = NULL;
+
+	// When set, every edge seen is recorded here, including the ones
+	// dropped by the debounce.
+	EdgeRecorder *recorder = NULL;
+
+	// When set, every pulse is also decoded by this decoder, at the
+	// dot length of the timing logic, and its text passed to
+	// on_beam_text.
+	CwBeamDecoder *beam = NULL;
+	BeamCallback on_beam_text;
+
+	// When set, every pulse is also decoded by this ensemble, which
+	// passes its text on to its own on_text.
+	CwEnsemble *ensemble = NULL;
+
+	// When set, this decodes instead of the decoder, and text is passed
+	// to on_text a (corrected) word at a time.
+	WordCorrector *corrector = NULL;
+
+	// Pulses and elements dropped because a buffer was full
+	unsigned overflows() const {
+		return CwBuffer.Overflows() + ElementBuffer.Overflows();
+	}
+
+	// Time of the last edge or timeout, in µs. The ticks wrap every 71
+	// minutes, this does not.
+	uint64_t time() const { return now; }
+
+	// Called when the key pin changes, or a timeout occurs
+	void process_edge(unsigned level, uint32_t tick) {
+		// Unwrap the tick. While active, the watchdog makes sure
+		// there is an event at least every word space, so the
+		// difference with the previous one is never ambiguous.
+		now += (uint32_t)(tick - (uint32_t)now);
+		uint64_t duration = now - prev_edge;
+		prev_edge = now;
+
+		// Debounce
+		// TODO: Improve?
+		bool bounce = duration < DEBOUNCE_TIME;
+		if (recorder)
+			recorder->record_rx(key_pin, tick, level, bounce);
+		if (bounce)
+			return;
+
+		// Eat up the first edge after some time of inactivity, and set a
+		// watchdog to detect the end of characters and inactivity after
+		// the GPIO stops changing.
+		if (!active) {
+			active = true;
+			in_space = false;
+			set_watchdog(char_timeout());
+			return;
+		}
+
+		if (level == GPIO_TIMEOUT) {
+			// The watchdog repeats every period, so it can fire
+			// several times during a long mark. Only a mark that
+			// lasts as long as a word space ends the transmission.
+			uint64_t word = word_timeout() * 1000ULL;
+			if (!in_space && duration < word) {
+				prev_edge -= duration;
+				return;
+			}
+
+			// The space after a character is too long for a dot
+			// space, so the character is complete. Emit it now,
+			// instead of waiting for the next mark or the end of
+			// the word, and rearm the watchdog for the rest of the
+			// word space.
+			if (in_space && !char_ended && duration < word) {
+				prev_edge -= duration;
+				char_ended = true;
+				Timing.EndCharacter(ElementBuffer);
+				DecodeElements();
+				set_watchdog((word - duration + 999) / 1000);
+				return;
+			}
+
+			// Some time passed without events. Disable the watchdog
+			// and generate a trailing space pulse.
+			set_watchdog(0);
+			active = false;
+			Pulse(pulse_length(duration), false);
+			// That space was as long as a word space, even when the
+			// timing logic (with an estimate that includes it) did
+			// not classify it as one
+			if (corrector) {
+				const char *text = corrector->end();
+				if (text)
+					emit(text);
+			} else if (!spaced && on_text) {
+				spaced = true;
+				on_text(" ");
+			}
+			if (ensemble)
+				ensemble->end();
+			return;
+		}
+
+		// A mark starts after a char space that ended the character
+		// early, put the watchdog back for the next one.
+		if (level == GPIO_LOW && char_ended)
+			set_watchdog(char_timeout());
+		in_space = level == GPIO_HIGH;
+		char_ended = false;
+
+		Pulse(pulse_length(duration), level == GPIO_HIGH);
+	}
+
+	//
+	//  Pulse(...) - run the decoder on a state change, pulseWidth is in µs
+	//
+	void Pulse(unsigned pulseWidth, bool state) {
+		CwElement cw;
+		cw.Mark = state; // the keyer pulls LOW, so state becomes true *after* a mark
+		cw.Length = (unsigned)pulseWidth;
+		CwBuffer.Add(cw);
+		if (state && char_latency)
+			last_mark_end = std::chrono::steady_clock::now();
+#ifdef TIMING_DEBUG
+		if (state)
+			printf("(%u) ", pulseWidth);
+		else
+			printf("%u ", pulseWidth);
+#endif
+
+		Timing.Decode(CwBuffer, ElementBuffer);
+		DecodeElements();
+
+		if (beam) {
+			BeamCharacter chars[CwBeamDecoder::MaximumOutput];
+			int ct = beam->Decode(cw, Timing.RxDotLength(), chars);
+			if (ct > 0 && on_beam_text)
+				on_beam_text(chars, ct);
+		}
+		if (ensemble)
+			ensemble->add(cw);
+	}
+
+private:
+	// Run the classified elements through the decoder (or corrector),
+	// and pass the text of the characters they complete on
+	void DecodeElements() {
+		// I/O buffer, each element completes at most one character
+		// and a space
+		char ioBuffer[2 * 32 + 1];
+		MorseElements elements[32];
+		int ct = 0;
+		int count = ElementBuffer.RemoveItems(elements, 32);
+		if (corrector) {
+			for (int i = 0; i < count; ++i) {
+				const char *text = corrector->add(elements[i]);
+				if (text)
+					emit(text);
+			}
+			return;
+		}
+		for (int i = 0; i < count; ++i)
+			ct += Decoder.DecodeElement(elements[i], ioBuffer + ct);
+
+		if (ct > 0) {
+			ioBuffer[ct] = 0;
+			emit(ioBuffer);
+		}
+	}
+
+	void emit(const char *text) {
+		spaced = text[strlen(text) - 1] == ' ';
+		if (char_latency)
+			char_latency->record_duration(std::chrono::steady_clock::now() - last_mark_end);
+		if (on_text)
+			on_text(text);
+#ifdef TIMING_DEBUG
+		printf(" --> %f\n", Timing.DotLength());
+#endif
+	}
+
+	// Watchdog timeouts in ms. A space longer than the first ends a
+	// character, one as long as the second ends the transmission.
+	uint32_t char_timeout() const {
+		return Timing.MaximumDotSpaceLength * Timing.RxDotLength() / 1000 + 1;
+	}
+
+	uint32_t word_timeout() const {
+		return Timing.MinimumWordSpace * Timing.RxDotLength() / 1000 + 1;
+	}
+
+	// Elements longer than CwElement holds only happen after a long
+	// pause, when the exact length does not matter
+	static unsigned pulse_length(uint64_t duration) {
+		return duration < UINT32_MAX ? duration : UINT32_MAX;
+	}
+
+	void set_watchdog(uint32_t timeout) {
+		if (timeout != watchdog) {
+			gpio->set_watchdog(key_pin, timeout);
+			watchdog = timeout;
+		}
+	}
+
+	// the clock restoration logic
+	CwTimingLogic &Timing;
+
+	// the decoder
+	CwDecoderLogic &Decoder;
+
+	GpioBackend *gpio;
+	unsigned key_pin;
+
+	// buffer for pulse timing data
+	StaticCircularBuffer<CwElement, 32> CwBuffer;
+
+	// buffer for decoded elements
+	StaticCircularBuffer<MorseElements, 32> ElementBuffer;
+
+	// Time of the current and previous event, see time()
+	uint64_t now = 0;
+	uint64_t prev_edge = 0;
+	bool active = false;
+	// True while the key is up
+	bool in_space = false;
+	// True when the current space already ended the character
+	bool char_ended = false;
+	// The watchdog timeout currently set
+	uint32_t watchdog = 0;
+	// Whether the text passed on last ended with a space
+	bool spaced = true;
+	std::chrono::steady_clock::time_point last_mark_end;
+};
+
+#endif
@@ -29,8 +29,11 @@
 #define __CW_TIMING_H
 
 #include "CircularBuffer.h"
+#include "CwClusterEstimator.h"
 #include "Elements.h"
 #include <float.h>
+#include <math.h>
+#include <vector>
 
 using namespace KK5JY::Collections;
 
@@ -42,10 +45,39 @@ namespace KK5JY {
 			SpeedAuto = 1
 		};
 
+		// speed estimators
+		enum SpeedEstimators {
+			EstimatorBoxCar = 0,
+			EstimatorCluster = 1
+		};
+
+		/// <summary>
+		/// The learned state of a <c>CwTimingLogic</c>, to continue where
+		/// it left off after a restart.  Lengths are in µs.
+		/// </summary>
+		struct CwTimingState {
+			float DotLength;
+			float RxDotLength;
+			float TxDotLength;
+			int SafetyGap;
+			SpeedSources RxSpeedSource;
+			SpeedSources TxSpeedSource;
+			unsigned BoxCarIndex;
+			std::vector<float> BoxCar;
+		};
+
 		/// <summary>
 		/// Translates detected elements into a logical symbol stream.
+		/// All lengths are in µs, so short elements at high speeds are
+		/// not distorted by rounding to whole ms.
 		/// </summary>
 		class CwTimingLogic {
+			public:
+				/// <summary>
+				/// The dot length at 1 WPM in µs (50 dots in PARIS, per minute).
+				/// </summary>
+				static constexpr float DotLengthAtOneWpm = 1200000;
+
 			private:
 				/// <summary>
 				/// The current average dot length.
@@ -109,6 +141,28 @@ namespace KK5JY {
 				/// </summary>
 				SpeedSources m_RxSpeedSource;
 
+				/// <summary>
+				/// The estimator used to track the dot length.
+				/// </summary>
+				SpeedEstimators m_Estimator;
+
+				/// <summary>
+				/// The cluster estimator, used when m_Estimator is EstimatorCluster.
+				/// </summary>
+				CwClusterEstimator m_Cluster;
+
+				/// <summary>
+				/// Elements of the current character, held back by the cluster
+				/// estimator until the character is complete, so they are all
+				/// classified using the latest estimate.
+				/// </summary>
+				StaticCircularBuffer<CwElement, 16> m_Pending;
+
+				/// <summary>
+				/// True when m_Pending holds a complete character.
+				/// </summary>
+				bool m_PendingComplete;
+
 			public:
 				/// <summary>
 				/// The maximum length for a dot, as a multiple of the current average dot length.
@@ -172,6 +226,10 @@ namespace KK5JY {
 					// set speed sources
 					m_TxSpeedSource = SpeedAuto;
 					m_RxSpeedSource = SpeedAuto;
+
+					// the boxcar is the default estimator
+					m_Estimator = EstimatorBoxCar;
+					m_PendingComplete = false;
 				}
 
 			public: // properties
@@ -184,7 +242,7 @@ namespace KK5JY {
 				/// Set a new boxcar length.
 				/// </summary>
 				void BoxCarLength (unsigned bcLength) {
-					int dl = m_DotLength;
+					float dl = m_DotLength;
 					AllocateBoxCar(bcLength);
 					InitializeBoxCar(dl);
 				}
@@ -194,31 +252,37 @@ namespace KK5JY {
 				/// </summary>
 				float DotLength() const { return m_DotLength; }
 				
+				/// <summary>
+				/// Return the dot length used for RX.
+				/// </summary>
+				float RxDotLength() const { return m_RxDotLength; }
+
 				/// <summary>
 				/// Estimate the current RX WPM based on the average dot length.
 				/// </summary>
-				float RxWPM() const { return 1200 / m_RxDotLength; }
+				float RxWPM() const { return DotLengthAtOneWpm / m_RxDotLength; }
 				
 				/// <summary>
 				/// Estimate the current RX WPM based on the average dot length.
 				/// </summary>
-				float TxWPM() const { return 1200 / m_TxDotLength; }
+				float TxWPM() const { return DotLengthAtOneWpm / m_TxDotLength; }
 				
 				/// <summary>
 				/// Set the RX WPM, and drop into manual RX mode.
 				/// </summary>
 				void RxWPM(int wpm) {
-					int newLength = 1200 / wpm;
+					float newLength = DotLengthAtOneWpm / wpm;
 					m_RxSpeedSource = SpeedManual;
 					m_RxDotLength = newLength;
 					InitializeBoxCar(newLength * 2); // average should be double the dot length
+					m_Cluster.Reset(newLength);
 				}
 				
 				/// <summary>
 				/// Set the TX WPM, and drop into manual TX mode.
 				/// </summary>
 				void TxWPM(int wpm) {
-					int newLength = 1200 / wpm;
+					float newLength = DotLengthAtOneWpm / wpm;
 					m_TxSpeedSource = SpeedManual;
 					m_TxDotLength = newLength;
 				}
@@ -250,39 +314,113 @@ namespace KK5JY {
 				void TxMode(SpeedSources src) {
 					m_TxSpeedSource = src;
 				}
+
+				//
+				//  Get the speed estimator.
+				//
+				SpeedEstimators Estimator() const {
+					return m_Estimator;
+				}
+
+				//
+				//  Set the speed estimator, starting it at the current dot length.
+				//
+				void Estimator(SpeedEstimators est) {
+					if (est == m_Estimator)
+						return;
+					m_Estimator = est;
+					if (est == EstimatorCluster)
+						m_Cluster.Reset(m_DotLength);
+					else
+						InitializeBoxCar(m_DotLength * 2);
+				}
 				
 			public: // methods
+				/// <summary>
+				/// Copy the learned state.  Does not allocate when
+				/// <c>state</c> already holds a boxcar of the same length.
+				/// </summary>
+				void SaveState(CwTimingState &state) const {
+					state.DotLength = m_DotLength;
+					state.RxDotLength = m_RxDotLength;
+					state.TxDotLength = m_TxDotLength;
+					state.SafetyGap = m_SafetyGap;
+					state.RxSpeedSource = m_RxSpeedSource;
+					state.TxSpeedSource = m_TxSpeedSource;
+					state.BoxCarIndex = m_BoxCarIndex;
+					state.BoxCar.assign(m_BoxCar, m_BoxCar + m_BoxCarSize);
+				}
+
+				/// <summary>
+				/// Continue from a state saved earlier.  The boxcar takes
+				/// the length of the saved one.  The cluster estimator only
+				/// keeps the dot length.
+				/// </summary>
+				/// <returns>False if the state is not valid, and was not loaded.</returns>
+				bool LoadState(const CwTimingState &state) {
+					if (state.BoxCar.empty() || state.BoxCarIndex >= state.BoxCar.size()) {
+						return false;
+					}
+					const float lengths[] = {state.DotLength, state.RxDotLength, state.TxDotLength};
+					for (float length : lengths) {
+						if (!isfinite(length) || length <= 0) {
+							return false;
+						}
+					}
+					for (float length : state.BoxCar) {
+						if (!isfinite(length) || length <= 0) {
+							return false;
+						}
+					}
+
+					if (state.BoxCar.size() != m_BoxCarSize) {
+						AllocateBoxCar(state.BoxCar.size());
+					}
+					m_BoxCarSum = 0;
+					for (unsigned i = 0; i != m_BoxCarSize; ++i) {
+						m_BoxCar[i] = state.BoxCar[i];
+						m_BoxCarSum += m_BoxCar[i];
+					}
+					m_BoxCarAverage = m_BoxCarSum / m_BoxCarSize;
+					m_BoxCarIndex = state.BoxCarIndex;
+					m_SafetyGap = state.SafetyGap;
+					m_DotLength = state.DotLength;
+					m_RxDotLength = state.RxDotLength;
+					m_TxDotLength = state.TxDotLength;
+					m_RxSpeedSource = state.RxSpeedSource;
+					m_TxSpeedSource = state.TxSpeedSource;
+					m_Cluster.Reset(m_DotLength);
+					m_Pending.Clear();
+					m_PendingComplete = false;
+					return true;
+				}
+
 				/// <summary>
 				/// Do the decoding.
 				/// </summary>
 				/// <param name="raw">The raw element data.</param>
 				/// <param name="result">A decoded element symbol stream.</param>
 				/// <returns>True if a word space was added to the result, indicating data ready to decode.</returns>
-				bool Decode(CircularBuffer<CwElement> &raw, CircularBuffer<MorseElements> &result) {
+				template <unsigned RawSize, unsigned ResultSize>
+				bool Decode(StaticCircularBuffer<CwElement, RawSize> &raw, StaticCircularBuffer<MorseElements, ResultSize> &result) {
 					bool space = false;
-					while (raw.Count() != 0 && !result.Full()) {
+
+					// finish a character held back earlier
+					if (m_PendingComplete || (m_Estimator != EstimatorCluster && m_Pending.Count() != 0)) {
+						space = Flush(result);
+					}
+
+					while (raw.Count() != 0 && !result.Full() && !m_PendingComplete) {
 						CwElement element;
 						raw.Remove(element);
 						// update the element length average
-						if (element.Mark && (element.Length > MinimumMark) && (element.Length < MaximumMark)) {
-							if (element.Length < (m_BoxCarAverage - m_SafetyGap) || element.Length > (m_BoxCarAverage + m_SafetyGap)) {
-								m_BoxCarSum -= m_BoxCar[m_BoxCarIndex];
-								m_BoxCarSum += element.Length;
-								m_BoxCar[m_BoxCarIndex] = element.Length;
-								m_BoxCarIndex = (m_BoxCarIndex + 1) % m_BoxCarSize;
-
-								//
-								//  Compute average dot length...
-								//
-								//  Since this is an average of all of the elements, the
-								//  overall average should be close to the midpoint
-								//  between dot and dash lengths.  One half of that should
-								//  be roughly the dot length.
-								//
-								m_BoxCarAverage = m_BoxCarSum / m_BoxCarSize;
-								m_DotLength = m_BoxCarAverage / 2;
-								m_SafetyGap = m_MinimumAverageDistance * m_BoxCarAverage;
+						if (m_Estimator == EstimatorCluster) {
+							if (!element.Mark || ((element.Length > MinimumMark) && (element.Length < MaximumMark))) {
+								m_Cluster.Add(element);
+								m_DotLength = m_Cluster.DotLength();
 							}
+						} else {
+							UpdateBoxCar(element);
 						}
 						if (m_RxSpeedSource == SpeedAuto) {
 							m_RxDotLength = m_DotLength;
@@ -291,36 +429,45 @@ namespace KK5JY {
 							m_TxDotLength = m_DotLength;
 						}
 
-						// now decode the specific element type
-						if (element.Mark && element.Length <= (MaximumDotLength * m_RxDotLength)) {
-							// short mark
-							result.Add(Dot);
-						} else if (!element.Mark && element.Length <= (MaximumDotSpaceLength * m_RxDotLength)) {
-							// short space
-							result.Add(DotSpace);
-						} else if (element.Length >= (MinimumWordSpace * m_RxDotLength) && !element.Mark) {
-							// word space
-							result.Add(WordSpace);
-							space = true;
-						} else {
-							// long elements
-							result.Add(element.Mark ? Dash : DashSpace);
-							if (!element.Mark)
-								space = true;
+						if (m_Estimator != EstimatorCluster) {
+							space |= Classify(element, result);
+							continue;
+						}
+
+						// hold back the elements until the character ends
+						m_Pending.Add(element);
+						if ((!element.Mark && element.Length > (MaximumDotSpaceLength * m_RxDotLength)) || m_Pending.Full()) {
+							m_PendingComplete = true;
+							space |= Flush(result);
 						}
 					}
 
 					return space;
 				}
-				
+
+				/// <summary>
+				/// End the character in progress, while the space after it
+				/// is still going on, but already too long for a dot space.
+				/// This only classifies the elements held back for the
+				/// character; the space itself should still be passed to
+				/// <c>Decode()</c> once it ends, for the speed estimate and
+				/// to detect a word space.
+				/// </summary>
+				/// <param name="result">A decoded element symbol stream.</param>
+				template <unsigned N>
+				void EndCharacter(StaticCircularBuffer<MorseElements, N> &result) {
+					Flush(result);
+					result.Add(DashSpace);
+				}
+
 				/// <summary>
 				/// Do the decoding.
 				/// </summary>
 				CwElement Encode(MorseElements el) {
-					const int dotSpace = m_TxDotLength;
-					const int dashSpace = dotSpace * 3;
-					const int charSpace = dotSpace * 3;
-					const int wordSpace = dotSpace * 5; //7; // word-space less dot-space on either end
+					const unsigned dotSpace = m_TxDotLength + 0.5f;
+					const unsigned dashSpace = dotSpace * 3;
+					const unsigned charSpace = dotSpace * 3;
+					const unsigned wordSpace = dotSpace * 5; //7; // word-space less dot-space on either end
 					CwElement cw;
 					switch (el) {
 						case Dot:
@@ -351,6 +498,75 @@ namespace KK5JY {
 				}
 
 			private:
+				/// <summary>
+				/// Update the boxcar average with a new element.
+				/// </summary>
+				void UpdateBoxCar(const CwElement &element) {
+					if (element.Mark && (element.Length > MinimumMark) && (element.Length < MaximumMark)) {
+						if (element.Length < (m_BoxCarAverage - m_SafetyGap) || element.Length > (m_BoxCarAverage + m_SafetyGap)) {
+							m_BoxCarSum -= m_BoxCar[m_BoxCarIndex];
+							m_BoxCarSum += element.Length;
+							m_BoxCar[m_BoxCarIndex] = element.Length;
+							m_BoxCarIndex = (m_BoxCarIndex + 1) % m_BoxCarSize;
+
+							//
+							//  Compute average dot length...
+							//
+							//  Since this is an average of all of the elements, the
+							//  overall average should be close to the midpoint
+							//  between dot and dash lengths.  One half of that should
+							//  be roughly the dot length.
+							//
+							m_BoxCarAverage = m_BoxCarSum / m_BoxCarSize;
+							m_DotLength = m_BoxCarAverage / 2;
+							m_SafetyGap = m_MinimumAverageDistance * m_BoxCarAverage;
+						}
+					}
+				}
+
+				/// <summary>
+				/// Classify an element using the current RX dot length.
+				/// </summary>
+				/// <returns>True if the element ends a character or word.</returns>
+				template <unsigned N>
+				bool Classify(const CwElement &element, StaticCircularBuffer<MorseElements, N> &result) {
+					// now decode the specific element type
+					if (element.Mark && element.Length <= (MaximumDotLength * m_RxDotLength)) {
+						// short mark
+						result.Add(Dot);
+					} else if (!element.Mark && element.Length <= (MaximumDotSpaceLength * m_RxDotLength)) {
+						// short space
+						result.Add(DotSpace);
+					} else if (element.Length >= (MinimumWordSpace * m_RxDotLength) && !element.Mark) {
+						// word space
+						result.Add(WordSpace);
+						return true;
+					} else {
+						// long elements
+						result.Add(element.Mark ? Dash : DashSpace);
+						if (!element.Mark)
+							return true;
+					}
+					return false;
+				}
+
+				/// <summary>
+				/// Classify the held back elements, as far as the result has room.
+				/// </summary>
+				/// <returns>True if a character or word ended.</returns>
+				template <unsigned N>
+				bool Flush(StaticCircularBuffer<MorseElements, N> &result) {
+					bool space = false;
+					while (m_Pending.Count() != 0 && !result.Full()) {
+						CwElement element;
+						m_Pending.Remove(element);
+						space |= Classify(element, result);
+					}
+					if (m_Pending.Count() == 0)
+						m_PendingComplete = false;
+					return space;
+				}
+
 				/// <summary>
 				/// Allocate the boxcar space.
 				/// </summary>
@@ -365,7 +581,7 @@ namespace KK5JY {
 				/// <summary>
 				/// Initialize the boxcar with a specific dot length
 				/// </summary>
-				void InitializeBoxCar(int dotLength) {
+				void InitializeBoxCar(float dotLength) {
 					m_BoxCarSum = 0;
 					for (unsigned i = 0; i != m_BoxCarSize; ++i) {
 						m_BoxCar[i] = dotLength;
@@ -0,0 +1,251 @@
+/*
+ *    EdgeRecorder.h
+ *
+ *    Flight recorder for key edges and TX elements, stored in a
+ *    memory-mapped ring file.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __EDGE_RECORDER_H
+#define __EDGE_RECORDER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+const char EDGE_RECORDER_MAGIC[8] = {'T', 'G', 'E', 'D', 'G', 'E', 'S', '1'};
+
+// Record types
+const uint8_t EDGE_RX = 0;
+const uint8_t EDGE_TX = 1;
+
+// Record flags
+const uint8_t EDGE_DEBOUNCED = 1;	// RX edge dropped by the debounce
+
+struct EdgeRecord {
+	// Index of this record plus one, written last. Lets readers
+	// detect slots that were never, or only partially, written.
+	std::atomic<uint64_t> seq;
+	// CLOCK_REALTIME in µs. For TX, the time the element was
+	// scheduled to start.
+	uint64_t time;
+	// RX: pigpio tick. TX: element length in µs.
+	uint32_t tick;
+	uint8_t type;
+	// RX: level (including GPIO_TIMEOUT). TX: 1 for a mark.
+	uint8_t level;
+	uint8_t flags;
+	// RX: key pin. TX: coil pin.
+	uint8_t gpio;
+};
+
+struct EdgeRecorderHeader {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t capacity;
+	// Total number of records ever reserved
+	std::atomic<uint64_t> next;
+	char reserved[40];
+};
+
+// A record as read back from a recording
+struct EdgeSample {
+	uint64_t time;
+	uint32_t tick;
+	uint8_t type;
+	uint8_t level;
+	uint8_t flags;
+	uint8_t gpio;
+};
+
+static_assert(sizeof(EdgeRecord) == 24, "EdgeRecord layout changed");
+static_assert(sizeof(EdgeRecorderHeader) == 64, "EdgeRecorderHeader layout changed");
+
+// Appends records to a fixed-size ring in a memory-mapped file. Adding a
+// record is only a few memory writes (no syscalls), and since the
+// mapping is shared, the kernel keeps the data when the process
+// crashes. When the file already exists with the same capacity,
+// recording continues where it left off, so history survives restarts.
+// Can be written from multiple threads.
+class EdgeRecorder {
+public:
+	~EdgeRecorder() {
+		close();
+	}
+
+	bool open(const char *path, uint32_t capacity) {
+		close();
+		int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+			perror(path);
+			return false;
+		}
+
+		size = sizeof(EdgeRecorderHeader) + (size_t)capacity * sizeof(EdgeRecord);
+		struct stat st;
+		bool reuse = fstat(fd, &st) == 0 && (size_t)st.st_size == size;
+		if (!reuse && ftruncate(fd, size) < 0) {
+			perror(path);
+			::close(fd);
+			return false;
+		}
+
+		void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (map == MAP_FAILED) {
+			perror(path);
+			return false;
+		}
+		header = (EdgeRecorderHeader*)map;
+		records = (EdgeRecord*)(header + 1);
+
+		if (!reuse || memcmp(header->magic, EDGE_RECORDER_MAGIC, sizeof(header->magic)) != 0 ||
+		    header->record_size != sizeof(EdgeRecord) || header->capacity != capacity) {
+			memset(map, 0, size);
+			memcpy(header->magic, EDGE_RECORDER_MAGIC, sizeof(header->magic));
+			header->record_size = sizeof(EdgeRecord);
+			header->capacity = capacity;
+		}
+
+		// To convert steady_clock times of TX elements
+		realtime_offset = now_realtime() - steady_to_us(std::chrono::steady_clock::now());
+		return true;
+	}
+
+	void close() {
+		if (header)
+			munmap(header, size);
+		header = NULL;
+		records = NULL;
+	}
+
+	bool is_open() const { return header != NULL; }
+
+	void record_rx(unsigned gpio, uint32_t tick, unsigned level, bool debounced) {
+		add(now_realtime(), tick, EDGE_RX, level, debounced ? EDGE_DEBOUNCED : 0, gpio);
+	}
+
+	void record_tx(unsigned gpio, std::chrono::steady_clock::time_point start, bool mark, uint32_t length_us) {
+		add(steady_to_us(start) + realtime_offset, length_us, EDGE_TX, mark, 0, gpio);
+	}
+
+	// Read all valid records from a recording, oldest first
+	static bool read(const char *path, std::vector<EdgeSample> &samples) {
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) {
+			perror(path);
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(EdgeRecorderHeader)) {
+			fprintf(stderr, "%s: not an edge recording\n", path);
+			::close(fd);
+			return false;
+		}
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (map == MAP_FAILED) {
+			perror(path);
+			return false;
+		}
+
+		const EdgeRecorderHeader *h = (const EdgeRecorderHeader*)map;
+		const EdgeRecord *r = (const EdgeRecord*)(h + 1);
+		bool ok = memcmp(h->magic, EDGE_RECORDER_MAGIC, sizeof(h->magic)) == 0 &&
+		          h->record_size == sizeof(EdgeRecord) &&
+		          (size_t)st.st_size == sizeof(*h) + (size_t)h->capacity * sizeof(EdgeRecord);
+		if (!ok) {
+			fprintf(stderr, "%s: not an edge recording\n", path);
+		} else {
+			uint64_t next = h->next.load(std::memory_order_acquire);
+			uint64_t first = next > h->capacity ? next - h->capacity : 0;
+			for (uint64_t i = first; i < next; ++i) {
+				const EdgeRecord &rec = r[i % h->capacity];
+				if (rec.seq.load(std::memory_order_acquire) != i + 1)
+					continue;
+				EdgeSample sample = {rec.time, rec.tick, rec.type, rec.level, rec.flags, rec.gpio};
+				// The writer may have reused the slot while it was
+				// copied, like a seqlock
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (rec.seq.load(std::memory_order_relaxed) != i + 1)
+					continue;
+				samples.push_back(sample);
+			}
+		}
+		munmap(map, st.st_size);
+		return ok;
+	}
+
+	static bool is_recording(const char *path) {
+		char magic[sizeof(EDGE_RECORDER_MAGIC)];
+		FILE *f = fopen(path, "r");
+		if (!f)
+			return false;
+		bool match = fread(magic, sizeof(magic), 1, f) == 1 &&
+		             memcmp(magic, EDGE_RECORDER_MAGIC, sizeof(magic)) == 0;
+		fclose(f);
+		return match;
+	}
+
+	static uint64_t now_realtime() {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+
+private:
+	static uint64_t steady_to_us(std::chrono::steady_clock::time_point t) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+	}
+
+	void add(uint64_t time, uint32_t tick, uint8_t type, uint8_t level, uint8_t flags, uint8_t gpio) {
+		if (!header)
+			return;
+		uint64_t index = header->next.fetch_add(1, std::memory_order_relaxed);
+		EdgeRecord &r = records[index % header->capacity];
+		// Invalidate first, so a reader never sees a mix of old and
+		// new contents as valid
+		r.seq.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		r.time = time;
+		r.tick = tick;
+		r.type = type;
+		r.level = level;
+		r.flags = flags;
+		r.gpio = gpio;
+		r.seq.store(index + 1, std::memory_order_release);
+	}
+
+	EdgeRecorderHeader *header = NULL;
+	EdgeRecord *records = NULL;
+	size_t size = 0;
+	int64_t realtime_offset = 0;
+};
+
+#endif
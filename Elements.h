@@ -35,7 +35,7 @@ namespace KK5JY {
 		/// </summary>
 		struct CwElement {
 			/// <summary>
-			/// The length of the pulse or space.
+			/// The length of the pulse or space, in µs.
 			/// </summary>
 			unsigned Length;
 
@@ -49,7 +49,7 @@ namespace KK5JY {
 			//  Default ctor
 			//
 			CwElement() {
-				Length = 0.0;
+				Length = 0;
 				Mark = false;
 			}
 			
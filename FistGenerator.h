@@ -0,0 +1,217 @@
+/*
+ *    FistGenerator.h
+ *
+ *    Turns text into the key edges a (more or less sloppy) operator
+ *    would produce, to test the RX path against.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __FIST_GENERATOR_H
+#define __FIST_GENERATOR_H
+
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "CwDecoderLogic.h"
+#include "GpioBackend.h"
+
+// From this fraction of the text on, key at another speed
+struct FistSpeedChange {
+	float at;
+	float wpm;
+};
+
+// How an operator keys. The defaults are perfect keying at 20 wpm.
+struct FistParams {
+	float wpm = 20;
+	// Farnsworth spacing: characters at wpm, but the spaces between
+	// them stretched to give this overall speed (0 is off)
+	float farnsworth_wpm = 0;
+	// Ratio of a dash to a dot
+	float dash_ratio = 3;
+	// Weighting, as a fraction of a dot added to every mark and taken
+	// from the space after it. Positive is heavy, negative light.
+	float weight = 0;
+	// Relative standard deviation of every element length
+	float jitter = 0;
+	// Standard deviation of the random walk of the (log) speed, per
+	// character, e.g. 0.02 drifts by about 2% per character
+	float drift = 0;
+	// Number of times the contact opens again after every key down,
+	// all within bounce_ms
+	unsigned bounces = 0;
+	float bounce_ms = 0;
+	std::vector<FistSpeedChange> speed_changes;
+};
+
+// A key edge, with the time in µs and the level of the key pin (which
+// is pulled low while keyed)
+struct FistEdge {
+	uint64_t time;
+	unsigned level;
+};
+
+// A character keyed, with the time (µs) its last mark ended
+struct FistCharacter {
+	char ch;
+	uint64_t end;
+};
+
+struct FistTimeline {
+	std::vector<FistEdge> edges;
+	std::vector<FistCharacter> truth;
+	// The text that was actually keyed: uppercase, only characters
+	// that have a code, and single spaces between words
+	std::string text;
+};
+
+class FistGenerator {
+public:
+	// Time of the first edge, in µs
+	static const uint64_t START_TIME = 1000000;
+
+	FistGenerator(const FistParams &params, unsigned seed)
+		: params(params), rng(seed) {
+	}
+
+	FistTimeline generate(const std::string &input) {
+		FistTimeline out;
+		std::string text = normalize(input);
+		std::normal_distribution<double> normal(0, 1);
+
+		double time = START_TIME;
+		double log_drift = 0;
+		for (size_t i = 0; i < text.size(); ++i) {
+			char ch = text[i];
+			if (ch == ' ')
+				continue;
+			double wpm = speed_at((double)i / text.size());
+			if (params.drift)
+				log_drift = std::min(0.5, std::max(-0.5, log_drift + params.drift * normal(rng)));
+			double dot = 1200 / wpm * exp(log_drift);
+			double word_dot = dot;
+			if (params.farnsworth_wpm > 0 && params.farnsworth_wpm < wpm) {
+				// The ARRL definition: the extra time per word,
+				// spread over its 19 units of character and
+				// word spaces
+				double c = wpm, s = params.farnsworth_wpm;
+				word_dot = 1000 * (60 * c - 37.2 * s) / (c * s) / 19 * exp(log_drift);
+			}
+
+			std::queue<MorseElements> elems;
+			decoder.Encode(ch, elems);
+			for (; !elems.empty(); elems.pop()) {
+				double units;
+				bool mark = false;
+				switch (elems.front()) {
+					case Dot: units = 1; mark = true; break;
+					case Dash: units = params.dash_ratio; mark = true; break;
+					case DotSpace: units = 1; break;
+					default: units = 0; break;
+				}
+				if (!units)
+					continue;
+
+				double length = units * dot + (mark ? 1 : -1) * params.weight * dot;
+				if (params.jitter)
+					length *= 1 + params.jitter * normal(rng);
+				length = std::max(length, 0.2 * units * dot);
+
+				if (mark) {
+					out.edges.push_back({(uint64_t)time, GPIO_LOW});
+					if (params.bounces)
+						add_bounces(out.edges, time, std::min(params.bounce_ms * 1000.0, length * 500));
+					time += length * 1000;
+					out.edges.push_back({(uint64_t)time, GPIO_HIGH});
+				} else {
+					time += length * 1000;
+				}
+			}
+			out.truth.push_back({ch, (uint64_t)time});
+
+			// The space after the character, which lost the weight
+			// of the last mark too
+			bool word = i + 1 < text.size() && text[i + 1] == ' ';
+			double length = (word ? 7 : 3) * word_dot - params.weight * dot;
+			if (params.jitter)
+				length *= 1 + params.jitter * normal(rng);
+			time += std::max(length, dot) * 1000;
+		}
+		out.text = text;
+		return out;
+	}
+
+	// Uppercase, drop characters without a code and collapse spaces
+	std::string normalize(const std::string &input) {
+		std::string text;
+		for (char c : input) {
+			char ch = toupper((unsigned char)c);
+			if (isspace((unsigned char)ch)) {
+				if (!text.empty() && text.back() != ' ')
+					text += ' ';
+				continue;
+			}
+			std::queue<MorseElements> elems;
+			decoder.Encode(ch, elems);
+			if (!elems.empty())
+				text += ch;
+		}
+		while (!text.empty() && text.back() == ' ')
+			text.pop_back();
+		return text;
+	}
+
+private:
+	double speed_at(double position) const {
+		double wpm = params.wpm;
+		for (const FistSpeedChange &c : params.speed_changes) {
+			if (position >= c.at)
+				wpm = c.wpm;
+		}
+		return wpm;
+	}
+
+	// Contact bounce after the key down at time: extra up and down
+	// edges within window µs, ending keyed
+	void add_bounces(std::vector<FistEdge> &edges, double time, double window) {
+		std::uniform_real_distribution<double> bounce(0, window);
+		std::vector<double> times;
+		for (unsigned i = 0; i < 2 * params.bounces; ++i)
+			times.push_back(time + bounce(rng));
+		std::sort(times.begin(), times.end());
+		for (size_t i = 0; i < times.size(); i += 2) {
+			edges.push_back({(uint64_t)times[i], GPIO_HIGH});
+			edges.push_back({(uint64_t)times[i + 1], GPIO_LOW});
+		}
+	}
+
+	FistParams params;
+	std::mt19937 rng;
+	CwDecoderLogic decoder;
+};
+
+#endif
@@ -0,0 +1,362 @@
+/*
+ *    GpioBackend.h
+ *
+ *    Interface to the GPIO operations used by the telegraph controller,
+ *    plus an in-memory simulated implementation.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __GPIO_BACKEND_H
+#define __GPIO_BACKEND_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Values for the level passed to an edge callback. These match the
+// PI_LOW, PI_HIGH and PI_TIMEOUT values used by pigpio.
+const unsigned GPIO_LOW = 0;
+const unsigned GPIO_HIGH = 1;
+const unsigned GPIO_TIMEOUT = 2;
+
+// Pin modes, matching PI_INPUT and PI_OUTPUT
+const unsigned GPIO_INPUT = 0;
+const unsigned GPIO_OUTPUT = 1;
+
+// Pull resistor settings, matching PI_PUD_OFF/DOWN/UP
+const unsigned GPIO_PULL_OFF = 0;
+const unsigned GPIO_PULL_DOWN = 1;
+const unsigned GPIO_PULL_UP = 2;
+
+// Number of GPIOs a backend needs to keep state for
+const unsigned GPIO_COUNT = 32;
+
+// Full-range values for the two kinds of PWM
+const uint32_t HW_PWM_MAX_DUTYCYCLE = 1E6;
+const uint32_t DMA_PWM_MAX_DUTYCYCLE = 256;
+
+// One step of a waveform: set the gpios in on_mask, clear those in
+// off_mask, then wait delay µs before the next step. Matches pigpio's
+// gpioPulse_t.
+struct GpioPulse {
+	uint32_t on_mask;
+	uint32_t off_mask;
+	uint32_t delay;
+};
+
+// Waveform chain commands, see wave_chain() below
+const char WAVE_CHAIN_CMD = (char)255;
+const char WAVE_CHAIN_DELAY = 2;
+// Longest delay a single chain delay command can express, in µs
+const uint32_t WAVE_CHAIN_MAX_DELAY = 65535;
+// Maximum length of a chain
+const size_t WAVE_CHAIN_MAX_LENGTH = 600;
+// Wave ids in a chain are single bytes, with 255 reserved for commands
+const int WAVE_MAX_ID = 254;
+
+// Called when an input changes level, or its watchdog times out. The
+// tick is a microsecond timestamp that wraps around every 72 minutes.
+typedef std::function<void(unsigned gpio, unsigned level, uint32_t tick)> GpioEdgeCallback;
+
+// An edge or watchdog timeout, as passed to a GpioEdgesCallback
+struct GpioEdge {
+	uint32_t tick;
+	uint8_t gpio;
+	uint8_t level;
+};
+
+// Called with edges of one gpio, oldest first
+typedef std::function<void(const GpioEdge *edges, size_t count)> GpioEdgesCallback;
+
+// All GPIO access by the controller goes through this interface, so the
+// RX and TX paths can run against either real hardware (through
+// pigpiod) or a simulation.
+class GpioBackend {
+public:
+	virtual ~GpioBackend() { }
+
+	virtual void set_mode(unsigned gpio, unsigned mode) = 0;
+	virtual void set_pull_up_down(unsigned gpio, unsigned pud) = 0;
+	virtual void write(unsigned gpio, unsigned level) = 0;
+
+	// Start hardware PWM, dutycycle is 0 - HW_PWM_MAX_DUTYCYCLE
+	virtual void hardware_pwm(unsigned gpio, unsigned freq, uint32_t dutycycle) = 0;
+
+	// Start DMA-timed PWM, dutycycle is 0 - DMA_PWM_MAX_DUTYCYCLE
+	virtual void set_pwm_dutycycle(unsigned gpio, unsigned dutycycle) = 0;
+
+	// Report a GPIO_TIMEOUT level when the gpio did not change for the
+	// given number of milliseconds. 0 disables the watchdog.
+	virtual void set_watchdog(unsigned gpio, unsigned timeout) = 0;
+
+	// Call the given function on every edge of the given gpio
+	virtual void on_edge(unsigned gpio, GpioEdgeCallback cb) = 0;
+
+	// Like on_edge, but pass on edges in batches, as many as the
+	// backend has at a time. Use either this or on_edge for a gpio,
+	// not both.
+	virtual void on_edges(unsigned gpio, GpioEdgesCallback cb) = 0;
+
+	// Create a waveform from the given pulses. Returns the wave id, or
+	// a negative value on error.
+	virtual int wave_create(const std::vector<GpioPulse> &pulses) = 0;
+
+	// Delete a waveform created by wave_create
+	virtual void wave_delete(int wave) = 0;
+
+	// Start transmitting a chain of waveforms. The chain uses pigpio's
+	// format: each byte is a wave id, except for commands starting with
+	// WAVE_CHAIN_CMD. Only the delay command (WAVE_CHAIN_CMD,
+	// WAVE_CHAIN_DELAY, low byte, high byte) must be supported.
+	virtual bool wave_chain(const std::vector<char> &chain) = 0;
+
+	// Returns true while a waveform (chain) is being transmitted
+	virtual bool wave_busy() = 0;
+
+	// Stop transmitting the current waveform (chain) right away. The
+	// outputs keep the level they have at that moment.
+	virtual void wave_tx_stop() = 0;
+};
+
+// Backend that does not touch any hardware, but records all output
+// operations with a timestamp and allows injecting input edges and
+// watchdog timeouts. Callbacks are run synchronously, from the thread
+// that injects the event, and batches are always a single edge.
+class SimulatedGpio : public GpioBackend {
+public:
+	using clock = std::chrono::steady_clock;
+
+	enum Operation {
+		OP_MODE,
+		OP_PULL,
+		OP_WRITE,
+		OP_HW_PWM,
+		OP_PWM,
+		OP_WATCHDOG,
+		OP_WAVE_WRITE,
+	};
+
+	struct Transition {
+		clock::time_point time;
+		Operation op;
+		unsigned gpio;
+		uint32_t value;
+		// Only used for OP_HW_PWM, frequency
+		uint32_t freq;
+	};
+
+	void set_mode(unsigned gpio, unsigned mode) {
+		record(OP_MODE, gpio, mode);
+	}
+
+	void set_pull_up_down(unsigned gpio, unsigned pud) {
+		record(OP_PULL, gpio, pud);
+	}
+
+	void write(unsigned gpio, unsigned level) {
+		record(OP_WRITE, gpio, level);
+	}
+
+	void hardware_pwm(unsigned gpio, unsigned freq, uint32_t dutycycle) {
+		record(OP_HW_PWM, gpio, dutycycle, freq);
+	}
+
+	void set_pwm_dutycycle(unsigned gpio, unsigned dutycycle) {
+		record(OP_PWM, gpio, dutycycle);
+	}
+
+	void set_watchdog(unsigned gpio, unsigned timeout) {
+		if (gpio >= GPIO_COUNT)
+			return;
+		record(OP_WATCHDOG, gpio, timeout);
+		std::lock_guard<std::mutex> lock(mutex);
+		watchdogs[gpio] = timeout;
+	}
+
+	void on_edge(unsigned gpio, GpioEdgeCallback cb) {
+		if (gpio < GPIO_COUNT)
+			callbacks[gpio] = cb;
+	}
+
+	void on_edges(unsigned gpio, GpioEdgesCallback cb) {
+		if (gpio < GPIO_COUNT)
+			batch_callbacks[gpio] = cb;
+	}
+
+	int wave_create(const std::vector<GpioPulse> &pulses) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t i = 0; i < waves.size(); ++i) {
+			if (waves[i].empty()) {
+				waves[i] = pulses;
+				return i;
+			}
+		}
+		if (waves.size() > (size_t)WAVE_MAX_ID)
+			return -1;
+		waves.push_back(pulses);
+		return waves.size() - 1;
+	}
+
+	void wave_delete(int wave) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (wave >= 0 && (size_t)wave < waves.size())
+			waves[wave].clear();
+	}
+
+	// Records all output changes the chain would make as OP_WAVE_WRITE
+	// transitions, timestamped with the time at which the hardware
+	// would make them.
+	bool wave_chain(const std::vector<char> &chain) {
+		std::lock_guard<std::mutex> lock(mutex);
+		clock::time_point t = clock::now();
+		for (size_t i = 0; i < chain.size(); ++i) {
+			if (chain[i] == WAVE_CHAIN_CMD) {
+				if (i + 3 >= chain.size() || chain[i + 1] != WAVE_CHAIN_DELAY)
+					return false;
+				unsigned delay = (uint8_t)chain[i + 2] | (uint8_t)chain[i + 3] << 8;
+				t += std::chrono::microseconds(delay);
+				i += 3;
+				continue;
+			}
+			unsigned wave = (uint8_t)chain[i];
+			if (wave >= waves.size() || waves[wave].empty())
+				return false;
+			for (const GpioPulse &p : waves[wave]) {
+				for (unsigned gpio = 0; gpio < GPIO_COUNT; ++gpio) {
+					if (recording && (p.on_mask & (1 << gpio)))
+						log.push_back({t, OP_WAVE_WRITE, gpio, 1, 0});
+					if (recording && (p.off_mask & (1 << gpio)))
+						log.push_back({t, OP_WAVE_WRITE, gpio, 0, 0});
+				}
+				t += std::chrono::microseconds(p.delay);
+			}
+		}
+		wave_end = t;
+		return true;
+	}
+
+	bool wave_busy() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return clock::now() < wave_end;
+	}
+
+	// Drops the recorded OP_WAVE_WRITE transitions the hardware would
+	// not make anymore
+	void wave_tx_stop() {
+		std::lock_guard<std::mutex> lock(mutex);
+		clock::time_point now = clock::now();
+		log.erase(std::remove_if(log.begin(), log.end(), [now](const Transition &t) {
+			return t.op == OP_WAVE_WRITE && t.time > now;
+		}), log.end());
+		wave_end = std::min(wave_end, now);
+	}
+
+	// Inject an edge on an input. Any pending watchdog timeouts before
+	// the given tick are delivered first.
+	void inject_edge(unsigned gpio, unsigned level, uint32_t tick) {
+		if (gpio >= GPIO_COUNT)
+			return;
+		advance(gpio, tick);
+		last_edge[gpio] = tick;
+		deliver(gpio, level, tick);
+	}
+
+	// Inject a watchdog timeout, regardless of whether a watchdog is
+	// set or the time since the last edge.
+	void inject_timeout(unsigned gpio, uint32_t tick) {
+		if (gpio >= GPIO_COUNT)
+			return;
+		last_edge[gpio] = tick;
+		deliver(gpio, GPIO_TIMEOUT, tick);
+	}
+
+	// Let simulated time pass up to the given tick, delivering any
+	// watchdog timeouts that would have fired in the meantime. Like
+	// pigpio, a watchdog keeps firing every timeout period until it
+	// is disabled.
+	void advance(unsigned gpio, uint32_t tick) {
+		if (gpio >= GPIO_COUNT)
+			return;
+		// The callbacks can set the watchdog, from this or another
+		// thread, so take it again every period
+		while (unsigned timeout = watchdog(gpio)) {
+			uint32_t period = timeout * 1000;
+			if (tick - last_edge[gpio] < period)
+				break;
+			inject_timeout(gpio, last_edge[gpio] + period);
+		}
+	}
+
+	// The current watchdog timeout for a gpio, 0 when disabled
+	unsigned watchdog(unsigned gpio) const {
+		if (gpio >= GPIO_COUNT)
+			return 0;
+		std::lock_guard<std::mutex> lock(mutex);
+		return watchdogs[gpio];
+	}
+
+	// Returns a copy of all recorded transitions
+	std::vector<Transition> transitions() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return log;
+	}
+
+	void clear_transitions() {
+		std::lock_guard<std::mutex> lock(mutex);
+		log.clear();
+	}
+
+	// Whether to record transitions at all. Disable this when running
+	// long simulations where only the RX side is of interest.
+	bool recording = true;
+
+private:
+	void deliver(unsigned gpio, unsigned level, uint32_t tick) {
+		if (callbacks[gpio])
+			callbacks[gpio](gpio, level, tick);
+		if (batch_callbacks[gpio]) {
+			GpioEdge edge = {tick, (uint8_t)gpio, (uint8_t)level};
+			batch_callbacks[gpio](&edge, 1);
+		}
+	}
+
+	void record(Operation op, unsigned gpio, uint32_t value, uint32_t freq = 0) {
+		if (!recording)
+			return;
+		Transition t = {clock::now(), op, gpio, value, freq};
+		std::lock_guard<std::mutex> lock(mutex);
+		log.push_back(t);
+	}
+
+	mutable std::mutex mutex;
+	std::vector<Transition> log;
+	std::vector<std::vector<GpioPulse>> waves;
+	clock::time_point wave_end;
+	GpioEdgeCallback callbacks[GPIO_COUNT];
+	GpioEdgesCallback batch_callbacks[GPIO_COUNT];
+	unsigned watchdogs[GPIO_COUNT] = {};
+	uint32_t last_edge[GPIO_COUNT] = {};
+};
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ *    GpioReports.h
+ *
+ *    Turns the level reports of a pigpio notification pipe into edges.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __GPIO_REPORTS_H
+#define __GPIO_REPORTS_H
+
+#include <stdint.h>
+#include <atomic>
+
+#include "GpioBackend.h"
+
+// The levels of all gpios at one point in time, as written to a pigpio
+// notification pipe. Matches pigpio's gpioReport_t.
+struct GpioReport {
+	uint16_t seqno;
+	uint16_t flags;
+	uint32_t tick;
+	uint32_t level;
+};
+
+static_assert(sizeof(GpioReport) == 12, "GpioReport must match gpioReport_t");
+
+// Reports read from a notification pipe at once at most
+const size_t NOTIFY_BATCH = 256;
+
+// Report flags, matching PI_NTFY_FLAGS_*. A watchdog report has the
+// gpio number in the low bits of the flags.
+const uint16_t GPIO_REPORT_EVENT = 1 << 7;
+const uint16_t GPIO_REPORT_ALIVE = 1 << 6;
+const uint16_t GPIO_REPORT_WATCHDOG = 1 << 5;
+const uint16_t GPIO_REPORT_GPIO = 31;
+
+// A snapshot of the counters of a GpioReportParser
+struct GpioReportStats {
+	// Calls of parse(), so edges / batches is the average batch size
+	unsigned batches = 0;
+	unsigned reports = 0;
+	unsigned edges = 0;
+	// Missing from the sequence numbers, their edges are merged into
+	// the next report
+	unsigned lost = 0;
+};
+
+// pigpio writes a report whenever one of the watched gpios changes, or a
+// watchdog fires, with the levels of all of them. This compares every
+// report with the previous levels, to find out which gpios changed.
+class GpioReportParser {
+public:
+	// levels are the levels of all gpios before the first report
+	GpioReportParser(uint32_t levels = 0) : levels(levels) { }
+
+	// Start over as if newly made with these levels. Only while no
+	// other thread parses.
+	void reset(uint32_t levels) {
+		this->levels = levels;
+		seqno = 0;
+		started = false;
+		counters.batches = 0;
+		counters.reports = 0;
+		counters.edges = 0;
+		counters.lost = 0;
+	}
+
+	// Call add(const GpioEdge &) for every edge and watchdog timeout of
+	// the gpios in the mask, in the order they happened.
+	template <typename Add>
+	void parse(const GpioReport *reports, size_t count, uint32_t mask, Add add) {
+		unsigned new_edges = 0, new_lost = 0;
+		for (size_t i = 0; i < count; ++i) {
+			const GpioReport &r = reports[i];
+			if (started)
+				new_lost += (uint16_t)(r.seqno - seqno - 1);
+			seqno = r.seqno;
+			started = true;
+
+			// Events carry no levels
+			if (r.flags & GPIO_REPORT_EVENT)
+				continue;
+
+			uint32_t changed = (r.level ^ levels) & mask;
+			levels = r.level;
+			while (changed) {
+				unsigned gpio = __builtin_ctz(changed);
+				changed &= changed - 1;
+				add(GpioEdge{r.tick, (uint8_t)gpio, (uint8_t)(r.level >> gpio & 1)});
+				new_edges++;
+			}
+
+			unsigned gpio = r.flags & GPIO_REPORT_GPIO;
+			if ((r.flags & GPIO_REPORT_WATCHDOG) && (mask & 1U << gpio)) {
+				add(GpioEdge{r.tick, (uint8_t)gpio, (uint8_t)GPIO_TIMEOUT});
+				new_edges++;
+			}
+		}
+
+		// Only the parsing thread writes the counters, so a relaxed
+		// load and store is enough and spares a locked add
+		bump(counters.batches, 1);
+		bump(counters.reports, count);
+		bump(counters.edges, new_edges);
+		bump(counters.lost, new_lost);
+	}
+
+	// Safe to call from any thread while another one parses. The
+	// counters are read one by one, so they may be a batch apart.
+	GpioReportStats get_stats() const {
+		GpioReportStats s;
+		s.batches = counters.batches.load(std::memory_order_relaxed);
+		s.reports = counters.reports.load(std::memory_order_relaxed);
+		s.edges = counters.edges.load(std::memory_order_relaxed);
+		s.lost = counters.lost.load(std::memory_order_relaxed);
+		return s;
+	}
+
+private:
+	static void bump(std::atomic<unsigned> &counter, unsigned n) {
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	uint32_t levels;
+	uint16_t seqno = 0;
+	bool started = false;
+	// See GpioReportStats
+	struct {
+		std::atomic<unsigned> batches{0};
+		std::atomic<unsigned> reports{0};
+		std::atomic<unsigned> edges{0};
+		std::atomic<unsigned> lost{0};
+	} counters;
+};
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ *    Histogram.h
+ *
+ *    Lock-free latency histogram.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __HISTOGRAM_H
+#define __HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+
+// Histogram of durations in µs, with buckets laid out like HdrHistogram:
+// every power-of-two range is split into SUB_BUCKETS linear buckets, so
+// values are recorded with a relative error below 1/SUB_BUCKETS (6%)
+// from 1 µs up to 71 minutes. Recording is a single relaxed atomic
+// increment, cheap enough to do for every event from any thread.
+class LatencyHistogram {
+public:
+	static const unsigned SUB_BITS = 4;
+	static const unsigned SUB_BUCKETS = 1 << SUB_BITS;
+	static const unsigned BUCKETS = (32 - SUB_BITS + 1) * SUB_BUCKETS;
+
+	// A copy of the counts, to compute statistics on
+	struct Snapshot {
+		uint64_t counts[BUCKETS];
+		uint64_t total;
+
+		// The value below which the given fraction of the samples lies
+		uint32_t percentile(double p) const {
+			if (!total)
+				return 0;
+			uint64_t target = p * total;
+			uint64_t seen = 0;
+			for (unsigned i = 0; i < BUCKETS; ++i) {
+				seen += counts[i];
+				if (seen > target)
+					return highest_value(i);
+			}
+			return highest_value(BUCKETS - 1);
+		}
+
+		uint32_t max() const {
+			for (unsigned i = BUCKETS; i > 0; --i) {
+				if (counts[i - 1])
+					return highest_value(i - 1);
+			}
+			return 0;
+		}
+	};
+
+	LatencyHistogram(const char *name) : name(name) {
+		for (auto &c : counts)
+			c.store(0, std::memory_order_relaxed);
+	}
+
+	const char *name;
+
+	void record(uint32_t us) {
+		counts[index(us)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	template <typename Duration>
+	void record_duration(Duration d) {
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+		if (us < 0)
+			us = 0;
+		record(us > UINT32_MAX ? UINT32_MAX : (uint32_t)us);
+	}
+
+	Snapshot snapshot() const {
+		Snapshot s;
+		s.total = 0;
+		for (unsigned i = 0; i < BUCKETS; ++i) {
+			s.counts[i] = counts[i].load(std::memory_order_relaxed);
+			s.total += s.counts[i];
+		}
+		return s;
+	}
+
+	// Bucket index for a value
+	static unsigned index(uint32_t v) {
+		if (v < SUB_BUCKETS)
+			return v;
+		unsigned e = 31 - __builtin_clz(v);
+		return (e - SUB_BITS + 1) * SUB_BUCKETS + ((v >> (e - SUB_BITS)) - SUB_BUCKETS);
+	}
+
+	// Lowest value that ends up in the given bucket
+	static uint32_t lowest_value(unsigned i) {
+		if (i < SUB_BUCKETS)
+			return i;
+		unsigned e = i / SUB_BUCKETS + SUB_BITS - 1;
+		return (uint32_t)(SUB_BUCKETS + i % SUB_BUCKETS) << (e - SUB_BITS);
+	}
+
+	// Highest value that ends up in the given bucket
+	static uint32_t highest_value(unsigned i) {
+		if (i + 1 >= BUCKETS)
+			return UINT32_MAX;
+		return lowest_value(i + 1) - 1;
+	}
+
+	// Print a one-line summary, in µs
+	void print_summary(FILE *f) const {
+		Snapshot s = snapshot();
+		fprintf(f, "%s: count=%llu p50=%u p90=%u p99=%u p999=%u max=%u\n", name,
+			(unsigned long long)s.total, s.percentile(0.5), s.percentile(0.9),
+			s.percentile(0.99), s.percentile(0.999), s.max());
+	}
+
+	// Print all non-empty buckets as "lowest highest count" lines
+	void print_buckets(FILE *f) const {
+		Snapshot s = snapshot();
+		for (unsigned i = 0; i < BUCKETS; ++i) {
+			if (s.counts[i])
+				fprintf(f, "%s %u %u %llu\n", name, lowest_value(i), highest_value(i),
+					(unsigned long long)s.counts[i]);
+		}
+	}
+
+private:
+	std::atomic<uint64_t> counts[BUCKETS];
+};
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ *
+ *
+ *    MorseCode.h
+ *
+ *    International Morse Code tables, generated at compile time.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2014 by Matthew K. Roberts, KK5JY. All rights reserved.
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __MORSE_CODE_H
+#define __MORSE_CODE_H
+
+#include <stdint.h>
+
+namespace KK5JY {
+	namespace CW {
+		/// <summary>
+		/// A Morse pattern.  Element i is stored in bit i (1 for a dash,
+		/// 0 for a dot), and bit n is set for a pattern of n elements.
+		/// This leading "sentinel" bit makes the length part of the value,
+		/// so a pattern can directly index a table.  An empty pattern is 1,
+		/// 0 is never a valid pattern.
+		/// </summary>
+		typedef uint16_t MorsePattern;
+
+		/// <summary>
+		/// The maximum number of elements in a pattern.
+		/// </summary>
+		const unsigned MorseMaxElements = 7;
+
+		/// <summary>
+		/// The number of entries in a table indexed by pattern.
+		/// </summary>
+		const unsigned MorsePatternCount = 1 << (MorseMaxElements + 1);
+
+		/// <summary>
+		/// The number of entries in a table indexed by character.
+		/// </summary>
+		const unsigned MorseCharCount = 128;
+
+		/// <summary>
+		/// A codebook entry, as written down by humans.
+		/// </summary>
+		struct MorseCodebookEntry {
+			const char *Pattern;
+			char Value;
+		};
+
+		/// <summary>
+		/// The codebook, sorted by pattern length, and roughly lexically.
+		/// </summary>
+		constexpr MorseCodebookEntry MorseCodebook[] = {
+			{ ".",       'E' },
+			{ "-",       'T' },
+
+			{ ".-",      'A' },
+			{ "..",      'I' },
+			{ "--",      'M' },
+			{ "-.",      'N' },
+
+			{ "-..",     'D' },
+			{ "--.",     'G' },
+			{ "---",     'O' },
+			{ "-.-",     'K' },
+			{ ".-.",     'R' },
+			{ "...",     'S' },
+			{ "..-",     'U' },
+			{ ".--",     'W' },
+
+			{ "-...",    'B' },
+			{ "-.-.",    'C' },
+			{ "..-.",    'F' },
+			{ "....",    'H' },
+			{ ".---",    'J' },
+			{ ".-..",    'L' },
+			{ ".--.",    'P' },
+			{ "--.-",    'Q' },
+			{ "...-",    'V' },
+			{ "-..-",    'X' },
+			{ "-.--",    'Y' },
+			{ "--..",    'Z' },
+			{ ".-.-",    '\n' },	// AA
+
+			{ "-----",   '0' },
+			{ ".----",   '1' },
+			{ "..---",   '2' },
+			{ "...--",   '3' },
+			{ "....-",   '4' },
+			{ ".....",   '5' },
+			{ "-....",   '6' },
+			{ "--...",   '7' },
+			{ "---..",   '8' },
+			{ "----.",   '9' },
+			{ "-..-.",   '/' },
+			{ ".-...",   '&' },	// AS
+			{ "-...-",   '=' },	// BT
+			{ ".-.-.",   '+' },	// AR
+			{ "-.--.",   '(' },	// KN
+
+			{ ".-.-.-",  '.' },
+			{ "--..--",  ',' },
+			{ "..--..",  '?' },
+			{ ".----.",  '\'' },
+			{ "-.-.--",  '!' },
+			{ "-.--.-",  ')' },
+			{ "---...",  ':' },
+			{ "-.-.-.",  ';' },
+			{ "-....-",  '-' },
+			{ "..--.-",  '_' },
+			{ ".-..-.",  '"' },
+			{ ".--.-.",  '@' },
+
+			{ "...-..-", '$' },
+		};
+
+		/// <summary>
+		/// The number of entries in the codebook.
+		/// </summary>
+		const unsigned MorseCodebookLength = sizeof(MorseCodebook) / sizeof(*MorseCodebook);
+
+		/// <summary>
+		/// Convert a pattern of '.' and '-' into a MorsePattern.
+		/// </summary>
+		constexpr MorsePattern MakeMorsePattern(const char *sPattern) {
+			MorsePattern pattern = 0;
+			unsigned len = 0;
+			for (; sPattern[len]; ++len) {
+				if (sPattern[len] == '-')
+					pattern |= 1 << len;
+			}
+			return pattern | (1 << len);
+		}
+
+		/// <summary>
+		/// The number of elements in a MorsePattern.
+		/// </summary>
+		constexpr unsigned MorsePatternLength(MorsePattern pattern) {
+			unsigned len = 0;
+			while (pattern > 1) {
+				pattern >>= 1;
+				++len;
+			}
+			return len;
+		}
+
+		/// <summary>
+		/// The lookup tables derived from the codebook.
+		/// </summary>
+		struct MorseTables {
+			/// <summary>
+			/// Decoded character by pattern, 0 for unknown patterns.
+			/// </summary>
+			char Decode[MorsePatternCount];
+
+			/// <summary>
+			/// Pattern by character, 0 for characters without a code.
+			/// </summary>
+			MorsePattern Encode[MorseCharCount];
+
+			/// <summary>
+			/// True for patterns that a known pattern starts with
+			/// (including the known patterns themselves, and the empty
+			/// pattern), so a decoder can drop hypotheses early.
+			/// </summary>
+			bool Prefix[MorsePatternCount];
+
+			/// <summary>
+			/// False if the codebook contains duplicate patterns or
+			/// characters, or patterns that are too long.
+			/// </summary>
+			bool Valid;
+		};
+
+		/// <summary>
+		/// Build the lookup tables from the codebook.
+		/// </summary>
+		constexpr MorseTables MakeMorseTables() {
+			MorseTables tables = {};
+			tables.Valid = true;
+			for (const MorseCodebookEntry &entry : MorseCodebook) {
+				MorsePattern pattern = MakeMorsePattern(entry.Pattern);
+				unsigned ch = (unsigned char)entry.Value;
+				if (pattern >= MorsePatternCount || ch >= MorseCharCount ||
+				    tables.Decode[pattern] != 0 || tables.Encode[ch] != 0) {
+					tables.Valid = false;
+					continue;
+				}
+				tables.Decode[pattern] = entry.Value;
+				tables.Encode[ch] = pattern;
+				unsigned len = MorsePatternLength(pattern);
+				for (unsigned n = 0; n <= len; ++n)
+					tables.Prefix[(pattern & ((1 << n) - 1)) | (1 << n)] = true;
+			}
+			return tables;
+		}
+
+		/// <summary>
+		/// The lookup tables, computed at compile time.
+		/// </summary>
+		constexpr MorseTables MorseCode = MakeMorseTables();
+
+		static_assert(MorseCode.Valid, "Invalid Morse codebook");
+	}
+}
+
+#endif
@@ -0,0 +1,486 @@
+/*
+ *    MorseDictionary.h
+ *
+ *    A dictionary of words, stored as a trie of their Morse elements,
+ *    that finds the words closest to what was received.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __MORSE_DICTIONARY_H
+#define __MORSE_DICTIONARY_H
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "MorseCode.h"
+
+using namespace KK5JY::CW;
+
+const char MORSE_DICTIONARY_MAGIC[8] = {'T', 'G', 'D', 'I', 'C', 'T', '0', '1'};
+
+// A word is keyed by its elements: '.' and '-' for the marks and ' '
+// between characters. Keys longer than this are not looked up.
+const unsigned MORSE_KEY_MAX = 64;
+
+// No word ends at a node with this word
+const uint32_t MORSE_NO_WORD = UINT32_MAX;
+
+// A trie node. Its children (for the symbols in children_mask) are
+// stored next to each other, starting at first_child.
+struct MorseDictionaryNode {
+	uint32_t children;	// first_child << 3 | children_mask
+	uint32_t word;		// index of the word ending here, or MORSE_NO_WORD
+};
+
+// A compiled dictionary file: the header, the nodes (the root first,
+// then the children of every node in depth-first order), the offset of every word in the text, and the words as
+// NUL-terminated strings. Native byte order, so only for use on the
+// machine (or at least the architecture) that compiled it.
+struct MorseDictionaryHeader {
+	char magic[8];
+	uint32_t nodes;
+	uint32_t words;
+	uint32_t text_size;
+	uint32_t reserved;
+};
+
+static_assert(sizeof(MorseDictionaryNode) == 8, "MorseDictionaryNode layout changed");
+static_assert(sizeof(MorseDictionaryHeader) == 24, "MorseDictionaryHeader layout changed");
+
+// The best matches of MorseDictionary::nearest()
+struct MorseMatch {
+	// The closest word, NULL when none is within the distance
+	const char *word = NULL;
+	unsigned distance = 0;
+	// Number of words at that distance
+	unsigned count = 0;
+	// Nodes visited
+	unsigned visits = 0;
+};
+
+// Words (common words, Q-codes, prosigns, callsigns) keyed by their
+// Morse elements. Prosigns are written as their letters between angle
+// brackets, e.g. <SK>, which are keyed without character spaces.
+//
+// The nodes are stored in a flat array, the same in memory as in a
+// compiled file, so a large dictionary (of callsigns) can be mapped in
+// instead of being read and built on every start.
+class MorseDictionary {
+public:
+	MorseDictionary() {}
+
+	~MorseDictionary() {
+		if (map)
+			munmap(map, map_size);
+	}
+
+	MorseDictionary(const MorseDictionary&) = delete;
+	MorseDictionary &operator=(const MorseDictionary&) = delete;
+
+	// Make the key of word, returns false when it has characters
+	// without a code
+	static bool make_key(const char *word, std::string &key) {
+		key.clear();
+		bool prosign = false, start = false;
+		for (const char *p = word; *p; ++p) {
+			if (*p == '<' && !prosign) {
+				prosign = true;
+				start = true;
+				continue;
+			}
+			if (*p == '>' && prosign) {
+				prosign = false;
+				continue;
+			}
+			unsigned index = (unsigned char)toupper((unsigned char)*p);
+			if (index >= MorseCharCount || MorseCode.Encode[index] == 0)
+				return false;
+			MorsePattern pattern = MorseCode.Encode[index];
+			if (!key.empty() && (!prosign || start))
+				key += ' ';
+			start = false;
+			for (unsigned i = 0, len = MorsePatternLength(pattern); i < len; ++i)
+				key += (pattern >> i) & 1 ? '-' : '.';
+		}
+		return !prosign && !key.empty();
+	}
+
+	// Build from words, the first spelling of every key is kept.
+	// Returns the number of words that had no key.
+	unsigned build(const std::vector<std::string> &list) {
+		// A trie with pointers first, then laid out in the order
+		// nearest() goes through it
+		struct BuildNode {
+			uint32_t child[3] = {0, 0, 0};
+			uint32_t word = MORSE_NO_WORD;
+		};
+		std::vector<BuildNode> trie(1);
+		std::vector<const std::string*> spellings;
+		unsigned skipped = 0;
+		std::string key;
+		for (const std::string &w : list) {
+			if (!make_key(w.c_str(), key)) {
+				skipped++;
+				continue;
+			}
+			uint32_t node = 0;
+			for (char c : key) {
+				unsigned sym = symbol(c);
+				if (!trie[node].child[sym]) {
+					trie[node].child[sym] = trie.size();
+					trie.emplace_back();
+				}
+				node = trie[node].child[sym];
+			}
+			if (trie[node].word == MORSE_NO_WORD) {
+				trie[node].word = spellings.size();
+				spellings.push_back(&w);
+			}
+		}
+
+		own_nodes.clear();
+		own_offsets.clear();
+		own_text.clear();
+		// The build node at every index, and the indices still to
+		// lay out the children of, depth first
+		std::vector<uint32_t> order(1, 0);
+		std::vector<uint32_t> todo(1, 0);
+		own_nodes.resize(trie.size());
+		while (!todo.empty()) {
+			uint32_t i = todo.back();
+			todo.pop_back();
+			const BuildNode &b = trie[order[i]];
+			uint32_t mask = 0, first = order.size();
+			for (unsigned sym = 0; sym < 3; ++sym) {
+				if (b.child[sym]) {
+					mask |= 1 << sym;
+					order.push_back(b.child[sym]);
+				}
+			}
+			for (uint32_t c = order.size(); c > first; --c)
+				todo.push_back(c - 1);
+			own_nodes[i].children = first << 3 | mask;
+			own_nodes[i].word = b.word;
+		}
+		for (const std::string *s : spellings) {
+			own_offsets.push_back(own_text.size());
+			for (char c : *s)
+				own_text += toupper((unsigned char)c);
+			own_text += '\0';
+		}
+		use(own_nodes.data(), own_nodes.size(), own_offsets.data(), own_offsets.size(),
+		    own_text.data(), own_text.size());
+		return skipped;
+	}
+
+	// Read words from a text file, whitespace separated, ignoring
+	// everything after a #
+	static bool read_words(const char *path, std::vector<std::string> &list) {
+		FILE *f = fopen(path, "r");
+		if (!f) {
+			perror(path);
+			return false;
+		}
+		char line[256];
+		while (fgets(line, sizeof(line), f)) {
+			char *hash = strchr(line, '#');
+			if (hash)
+				*hash = '\0';
+			char *save, *word = strtok_r(line, " \t\r\n", &save);
+			for (; word; word = strtok_r(NULL, " \t\r\n", &save))
+				list.push_back(word);
+		}
+		fclose(f);
+		return true;
+	}
+
+	// Load a compiled dictionary (mapped in) or a word list (built)
+	bool load(const char *path) {
+		if (is_compiled(path))
+			return map_file(path);
+		std::vector<std::string> list;
+		if (!read_words(path, list))
+			return false;
+		unsigned skipped = build(list);
+		if (skipped)
+			fprintf(stderr, "%s: skipped %u words with characters without a code\n", path, skipped);
+		return true;
+	}
+
+	bool save(const char *path) const {
+		MorseDictionaryHeader h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, MORSE_DICTIONARY_MAGIC, sizeof(h.magic));
+		h.nodes = node_count;
+		h.words = word_count;
+		h.text_size = text_size;
+		FILE *f = fopen(path, "w");
+		if (!f) {
+			perror(path);
+			return false;
+		}
+		bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+		          fwrite(nodes, sizeof(*nodes), node_count, f) == node_count &&
+		          fwrite(offsets, sizeof(*offsets), word_count, f) == word_count &&
+		          fwrite(text, 1, text_size, f) == text_size;
+		if (fclose(f) != 0)
+			ok = false;
+		if (!ok)
+			perror(path);
+		return ok;
+	}
+
+	static bool is_compiled(const char *path) {
+		char magic[sizeof(MORSE_DICTIONARY_MAGIC)];
+		FILE *f = fopen(path, "r");
+		if (!f)
+			return false;
+		bool match = fread(magic, sizeof(magic), 1, f) == 1 &&
+		             memcmp(magic, MORSE_DICTIONARY_MAGIC, sizeof(magic)) == 0;
+		fclose(f);
+		return match;
+	}
+
+	size_t size() const { return word_count; }
+	size_t node_size() const { return node_count; }
+
+	bool contains(const char *word) const {
+		std::string key;
+		return make_key(word, key) && find(key.data(), key.size());
+	}
+
+	// The word with exactly this key, or NULL
+	const char *find(const char *key, size_t len) const {
+		if (!node_count)
+			return NULL;
+		uint32_t node = 0;
+		for (size_t i = 0; i < len; ++i) {
+			if (!child(node, symbol(key[i]), node))
+				return NULL;
+		}
+		return word_at(node);
+	}
+
+	// Find the words closest to key, by the edit distance between the
+	// keys: a dot or dash that was added, lost or mistaken for the other,
+	// and a character space that was added or lost, all count as one.
+	// Only words within max_distance are considered, and at most budget
+	// nodes are visited, to bound the time taken. Returns false when
+	// the budget ran out, match then has the best word found so far.
+	bool nearest(const char *key, size_t len, unsigned max_distance, unsigned budget,
+	             MorseMatch &match) const {
+		match = MorseMatch();
+		if (!node_count || len > MORSE_KEY_MAX)
+			return false;
+		// One row of the edit distance table per depth in the trie
+		uint8_t rows[MORSE_KEY_MAX + 2][MORSE_KEY_MAX + 1];
+		for (size_t j = 0; j <= len; ++j)
+			rows[0][j] = j;
+		Search s = {key, len, max_distance, budget, rows, match};
+		return visit(s, 0, 0);
+	}
+
+private:
+	struct Search {
+		const char *key;
+		size_t len;
+		unsigned max_distance;
+		unsigned budget;
+		uint8_t (*rows)[MORSE_KEY_MAX + 1];
+		MorseMatch &match;
+	};
+
+	// Children of a node are in this order
+	static unsigned symbol(char c) {
+		return c == '.' ? 0 : c == '-' ? 1 : 2;
+	}
+
+	bool child(uint32_t node, unsigned sym, uint32_t &out) const {
+		uint32_t children = nodes[node].children;
+		uint32_t mask = children & 7;
+		if (!(mask & (1 << sym)))
+			return false;
+		out = (children >> 3) + __builtin_popcount(mask & ((1 << sym) - 1));
+		return true;
+	}
+
+	const char *word_at(uint32_t node) const {
+		uint32_t w = nodes[node].word;
+		return w == MORSE_NO_WORD ? NULL : text + offsets[w];
+	}
+
+	// Depth-first through the trie, keeping the row of the edit
+	// distance table for the path so far, and skipping subtrees that
+	// cannot get within the distance anymore. Only the band of the row
+	// within max_distance of the diagonal can be close enough, so only
+	// that is computed, with the cells just outside it set too high.
+	bool visit(Search &s, uint32_t node, unsigned depth) const {
+		if (++s.match.visits > s.budget)
+			return false;
+		const uint8_t *prev = s.rows[depth];
+		if (s.len <= depth + s.max_distance && depth <= s.len + s.max_distance &&
+		    prev[s.len] <= s.max_distance) {
+			const char *word = word_at(node);
+			if (word) {
+				if (!s.match.word || prev[s.len] < s.match.distance) {
+					s.match.word = word;
+					s.match.distance = prev[s.len];
+					s.match.count = 1;
+					// Only look for words as close from now on
+					s.max_distance = s.match.distance;
+				} else if (prev[s.len] == s.match.distance) {
+					s.match.count++;
+				}
+			}
+		}
+		if (depth > MORSE_KEY_MAX)
+			return true;
+
+		uint32_t children = nodes[node].children;
+		uint32_t next = children >> 3;
+		for (unsigned sym = 0; sym < 3; ++sym) {
+			if (!(children & (1 << sym)))
+				continue;
+			uint8_t *row = s.rows[depth + 1];
+			size_t i = depth + 1;
+			size_t lo = i > s.max_distance ? i - s.max_distance : 1;
+			size_t hi = std::min<size_t>(s.len, i + s.max_distance);
+			uint8_t too_far = s.max_distance + 1;
+			row[0] = i;
+			if (lo > 1)
+				row[lo - 1] = too_far;
+			uint8_t lowest = row[0];
+			for (size_t j = lo; j <= hi; ++j) {
+				unsigned cost = prev[j - 1] + (symbol(s.key[j - 1]) != sym);
+				cost = std::min<unsigned>(cost, prev[j] + 1);
+				cost = std::min<unsigned>(cost, row[j - 1] + 1);
+				row[j] = cost;
+				lowest = std::min<uint8_t>(lowest, cost);
+			}
+			if (hi < s.len)
+				row[hi + 1] = too_far;
+			if (lowest <= s.max_distance && !visit(s, next, depth + 1))
+				return false;
+			next++;
+		}
+		return true;
+	}
+
+	void use(const MorseDictionaryNode *n, size_t nc, const uint32_t *o, size_t wc, const char *t, size_t ts) {
+		nodes = n;
+		node_count = nc;
+		offsets = o;
+		word_count = wc;
+		text = t;
+		text_size = ts;
+	}
+
+	bool map_file(const char *path) {
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) {
+			perror(path);
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(MorseDictionaryHeader)) {
+			fprintf(stderr, "%s: not a compiled dictionary\n", path);
+			::close(fd);
+			return false;
+		}
+		void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (m == MAP_FAILED) {
+			perror(path);
+			return false;
+		}
+
+		const MorseDictionaryHeader *h = (const MorseDictionaryHeader*)m;
+		size_t expected = sizeof(*h) + (size_t)h->nodes * sizeof(MorseDictionaryNode) +
+		                  (size_t)h->words * sizeof(uint32_t) + h->text_size;
+		if (h->nodes == 0 || (size_t)st.st_size != expected) {
+			fprintf(stderr, "%s: not a compiled dictionary\n", path);
+			munmap(m, st.st_size);
+			return false;
+		}
+		const MorseDictionaryNode *n = (const MorseDictionaryNode*)(h + 1);
+		const uint32_t *o = (const uint32_t*)(n + h->nodes);
+		const char *t = (const char*)(o + h->words);
+		if (!consistent(n, h->nodes, o, h->words, t, h->text_size)) {
+			fprintf(stderr, "%s: not a compiled dictionary\n", path);
+			munmap(m, st.st_size);
+			return false;
+		}
+		if (map)
+			munmap(map, map_size);
+		map = m;
+		map_size = st.st_size;
+		use(n, h->nodes, o, h->words, t, h->text_size);
+		return true;
+	}
+
+	// Whether all indices point inside the arrays and every word ends,
+	// so a damaged file cannot make lookups read outside the mapping.
+	// Children must come after their parent (as build() lays them out),
+	// which also rules out loops.
+	static bool consistent(const MorseDictionaryNode *n, size_t nc, const uint32_t *o, size_t wc,
+	                       const char *t, size_t ts) {
+		for (size_t i = 0; i < nc; ++i) {
+			uint32_t mask = n[i].children & 7;
+			uint32_t first = n[i].children >> 3;
+			if (mask && (first <= i || first + __builtin_popcount(mask) > nc))
+				return false;
+			if (n[i].word != MORSE_NO_WORD && n[i].word >= wc)
+				return false;
+		}
+		for (size_t w = 0; w < wc; ++w) {
+			if (o[w] >= ts)
+				return false;
+		}
+		return wc == 0 || t[ts - 1] == '\0';
+	}
+
+	const MorseDictionaryNode *nodes = NULL;
+	size_t node_count = 0;
+	const uint32_t *offsets = NULL;
+	size_t word_count = 0;
+	const char *text = NULL;
+	size_t text_size = 0;
+
+	// Storage of a built dictionary
+	std::vector<MorseDictionaryNode> own_nodes;
+	std::vector<uint32_t> own_offsets;
+	std::string own_text;
+
+	// Mapping of a compiled one
+	void *map = NULL;
+	size_t map_size = 0;
+};
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ *    PigpiodGpio.h
+ *
+ *    GPIO backend that talks to a running pigpiod daemon.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __PIGPIOD_GPIO_H
+#define __PIGPIOD_GPIO_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pigpiod_if2.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "GpioBackend.h"
+#include "GpioReports.h"
+
+class PigpiodGpio : public GpioBackend {
+public:
+	// Connect to the pigpiod on localhost
+	PigpiodGpio() {
+		pi = pigpio_start(NULL, NULL);
+	}
+
+	~PigpiodGpio() {
+		// Closing the notification closes the pipe, which stops the
+		// reader
+		if (notify_handle >= 0) {
+			::notify_close(pi, notify_handle);
+			notify_reader.join();
+		}
+		if (pi >= 0)
+			pigpio_stop(pi);
+	}
+
+	bool connected() const { return pi >= 0; }
+
+	// The pigpiod_if2 handle, for operations not covered by the
+	// interface
+	int handle() const { return pi; }
+
+	void set_mode(unsigned gpio, unsigned mode) {
+		::set_mode(pi, gpio, mode);
+	}
+
+	void set_pull_up_down(unsigned gpio, unsigned pud) {
+		::set_pull_up_down(pi, gpio, pud);
+	}
+
+	void write(unsigned gpio, unsigned level) {
+		gpio_write(pi, gpio, level);
+	}
+
+	void hardware_pwm(unsigned gpio, unsigned freq, uint32_t dutycycle) {
+		hardware_PWM(pi, gpio, freq, dutycycle);
+	}
+
+	void set_pwm_dutycycle(unsigned gpio, unsigned dutycycle) {
+		set_PWM_dutycycle(pi, gpio, dutycycle);
+	}
+
+	void set_watchdog(unsigned gpio, unsigned timeout) {
+		::set_watchdog(pi, gpio, timeout);
+	}
+
+	// Note that pigpiod_if2 runs callbacks on its own background
+	// thread.
+	void on_edge(unsigned gpio, GpioEdgeCallback cb) {
+		if (gpio >= GPIO_COUNT)
+			return;
+		bool registered = (bool)callbacks[gpio];
+		callbacks[gpio] = cb;
+		if (!registered)
+			callback_ex(pi, gpio, EITHER_EDGE, edge_trampoline, this);
+	}
+
+	// Edges are read from a notification pipe, on a thread of its own.
+	// One read returns all reports pigpiod has written since the last
+	// one, so during a burst of edges (contact bounce) the callback is
+	// called once for many of them. When no notification can be
+	// opened, this falls back to on_edge(), with batches of one edge.
+	void on_edges(unsigned gpio, GpioEdgesCallback cb) {
+		if (gpio >= GPIO_COUNT)
+			return;
+		if (notify_handle < 0 && !start_notify()) {
+			on_edge(gpio, [cb](unsigned gpio, unsigned level, uint32_t tick) {
+				GpioEdge edge = {tick, (uint8_t)gpio, (uint8_t)level};
+				cb(&edge, 1);
+			});
+			return;
+		}
+		batch_callbacks[gpio] = cb;
+		notify_bits.store(notify_bits.load() | 1U << gpio, std::memory_order_release);
+		::notify_begin(pi, notify_handle, notify_bits.load());
+	}
+
+	// Counters of the notification reader, safe to read while it runs
+	GpioReportStats notify_stats() const { return parser.get_stats(); }
+
+	// Whether edges are read from a notification pipe
+	bool notifying() const { return notify_handle >= 0; }
+
+	int wave_create(const std::vector<GpioPulse> &pulses) {
+		std::vector<gpioPulse_t> p(pulses.size());
+		for (size_t i = 0; i < pulses.size(); ++i)
+			p[i] = {pulses[i].on_mask, pulses[i].off_mask, pulses[i].delay};
+
+		wave_add_new(pi);
+		if (wave_add_generic(pi, p.size(), p.data()) < 0)
+			return -1;
+		int id = ::wave_create(pi);
+		if (id > WAVE_MAX_ID) {
+			::wave_delete(pi, id);
+			return -1;
+		}
+		return id;
+	}
+
+	void wave_delete(int wave) {
+		::wave_delete(pi, wave);
+	}
+
+	bool wave_chain(const std::vector<char> &chain) {
+		return ::wave_chain(pi, (char*)chain.data(), chain.size()) == 0;
+	}
+
+	bool wave_busy() {
+		return wave_tx_busy(pi) == 1;
+	}
+
+	void wave_tx_stop() {
+		::wave_tx_stop(pi);
+	}
+
+private:
+	static void edge_trampoline(int pi, unsigned gpio, unsigned level, uint32_t tick, void *user) {
+		PigpiodGpio *self = (PigpiodGpio*)user;
+		if (gpio < GPIO_COUNT && self->callbacks[gpio])
+			self->callbacks[gpio](gpio, level, tick);
+	}
+
+	bool start_notify() {
+		int handle = ::notify_open(pi);
+		if (handle < 0) {
+			fprintf(stderr, "Failed to open a pigpio notification: %s\n", pigpio_error(handle));
+			return false;
+		}
+		// pigpiod creates the pipe, so this only works on the same
+		// machine
+		std::string path = "/dev/pigpio" + std::to_string(handle);
+		notify_fd = open(path.c_str(), O_RDONLY);
+		if (notify_fd < 0) {
+			perror(path.c_str());
+			::notify_close(pi, handle);
+			return false;
+		}
+		notify_handle = handle;
+		parser.reset(read_bank_1(pi));
+		notify_reader = std::thread([this]() { process_notify(); });
+		return true;
+	}
+
+	// Reads the notification pipe until it is closed, and passes on the
+	// edges of every read at once
+	void process_notify() {
+		GpioReport reports[NOTIFY_BATCH];
+		size_t bytes = 0;
+		while (true) {
+			ssize_t n = read(notify_fd, (char*)reports + bytes, sizeof(reports) - bytes);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				perror("Failed to read the pigpio notification pipe");
+			if (n <= 0)
+				break;
+
+			// pigpiod writes whole reports, but keep any partial
+			// one for the next read anyway
+			bytes += n;
+			size_t count = bytes / sizeof(GpioReport);
+			uint32_t mask = notify_bits.load(std::memory_order_acquire);
+			parser.parse(reports, count, mask, [this](const GpioEdge &edge) {
+				batches[edge.gpio].push_back(edge);
+			});
+			bytes -= count * sizeof(GpioReport);
+			memmove(reports, reports + count, bytes);
+
+			for (unsigned gpio = 0; gpio < GPIO_COUNT; ++gpio) {
+				if (batches[gpio].empty())
+					continue;
+				batch_callbacks[gpio](batches[gpio].data(), batches[gpio].size());
+				batches[gpio].clear();
+			}
+		}
+		close(notify_fd);
+	}
+
+	int pi = -1;
+	GpioEdgeCallback callbacks[GPIO_COUNT];
+
+	// The notification pipe, see on_edges()
+	int notify_handle = -1;
+	int notify_fd = -1;
+	std::atomic<uint32_t> notify_bits{0};
+	std::thread notify_reader;
+	GpioReportParser parser;
+	GpioEdgesCallback batch_callbacks[GPIO_COUNT];
+	// Only used by the reader, keep their storage between reads
+	std::vector<GpioEdge> batches[GPIO_COUNT];
+};
+
+#endif
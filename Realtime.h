@@ -0,0 +1,125 @@
+/*
+ *    Realtime.h
+ *
+ *    Helpers to run a thread with real-time scheduling, and to sleep
+ *    until precise deadlines.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __REALTIME_H
+#define __REALTIME_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <chrono>
+
+// With -x, the controller's TX threads run at this SCHED_FIFO priority.
+// This is below the threaded interrupt handlers (50), so GPIO and network
+// interrupts still get through.
+const int TX_PRIORITY = 40;
+
+// How long before a deadline sleep_until_deadline() should wake up and
+// spin. Enough to cover the wakeup latency of a real-time thread.
+const auto REALTIME_SPIN = std::chrono::microseconds(200);
+
+// Stack that make_thread_realtime() touches, so the first deep call on
+// the thread does not page fault
+const size_t REALTIME_STACK_PREFAULT = 64 * 1024;
+
+// Sleep until deadline, which is a std::chrono::steady_clock time. That
+// clock is CLOCK_MONOTONIC, so this uses clock_nanosleep with an absolute
+// time: unlike a relative sleep, being woken late or preempted before
+// sleeping does not push the deadline back. Waking from a sleep takes
+// tens of µs though (more without real-time priority), so this sleeps
+// until spin before the deadline and busy-waits the rest.
+inline void sleep_until_deadline(std::chrono::steady_clock::time_point deadline,
+                                 std::chrono::nanoseconds spin) {
+	using namespace std::chrono;
+	auto wake = duration_cast<nanoseconds>((deadline - spin).time_since_epoch()).count();
+	if (wake > 0) {
+		timespec ts;
+		ts.tv_sec = wake / 1000000000;
+		ts.tv_nsec = wake % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			/* nothing */;
+	}
+	while (steady_clock::now() < deadline)
+		/* spin */;
+}
+
+// Run the calling thread with SCHED_FIFO at the given priority and,
+// when cpu is not negative, bound to that cpu. Prints why and returns
+// false when either fails (usually for lack of privileges).
+inline bool make_thread_realtime(int priority, int cpu, const char *label) {
+	bool ok = true;
+	if (cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (err) {
+			fprintf(stderr, "%sFailed to bind to cpu %d: %s\n", label, cpu, strerror(err));
+			ok = false;
+		}
+	}
+
+	sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+	int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (err) {
+		fprintf(stderr, "%sFailed to set real-time priority: %s\n", label, strerror(err));
+		ok = false;
+	}
+
+	volatile char stack[REALTIME_STACK_PREFAULT];
+	for (size_t i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+	return ok;
+}
+
+// Lock all memory of the process, now and in the future, so real-time
+// threads never wait for a page to be read back in. What is mapped now
+// is read in right away. Where supported, later mappings are only locked
+// as they are touched, or every thread stack would take up its full
+// (default 8MiB) size.
+inline bool lock_memory() {
+	int flags = MCL_CURRENT | MCL_FUTURE;
+#ifdef MCL_ONFAULT
+	if (mlockall(MCL_CURRENT) < 0) {
+		perror("mlockall");
+		return false;
+	}
+	flags |= MCL_ONFAULT;
+#endif
+	if (mlockall(flags) < 0) {
+		perror("mlockall");
+		return false;
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,285 @@
+/*
+ *    RedisPublisher.h
+ *
+ *    Asynchronous, pipelined Redis PUBLISH using hiredis and libev.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __REDIS_PUBLISHER_H
+#define __REDIS_PUBLISHER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include <hiredis/adapters/libev.h>
+
+#include "Histogram.h"
+
+// Reconnect delays, in seconds
+const double REDIS_MIN_BACKOFF = 0.1;
+const double REDIS_MAX_BACKOFF = 5.0;
+
+// Publishes messages to Redis from a background thread running a libev
+// loop. publish() only appends to a bounded queue, so it never blocks on
+// the network. Queued messages are sent as soon as possible, with
+// multiple PUBLISH commands in flight at the same time. When the
+// connection fails, it is retried with exponential backoff and messages
+// that were not acknowledged are sent again.
+class RedisPublisher {
+public:
+	RedisPublisher(const char *host, int port, size_t max_queue = 256, size_t max_in_flight = 32)
+		: host(host), port(port), max_queue(max_queue), max_in_flight(max_in_flight) {
+	}
+
+	// Start the background thread and connect
+	void start() {
+		loop = ev_loop_new(EVFLAG_AUTO);
+
+		ev_async_init(&wakeup, on_wakeup);
+		wakeup.data = this;
+		ev_async_start(loop, &wakeup);
+
+		ev_timer_init(&reconnect_timer, on_reconnect_timer, 0, 0);
+		reconnect_timer.data = this;
+
+		std::thread t([this]() {
+			connect();
+			ev_run(loop, 0);
+		});
+		t.detach();
+	}
+
+	// Queue a message for publishing, can be called from any thread.
+	// Returns false when the queue is full and the message was dropped.
+	bool publish(const std::string &channel, const std::string &message) {
+		return command({"PUBLISH", channel, message});
+	}
+
+	// Queue an arbitrary command, e.g. to store statistics. Like
+	// publish(), this never blocks.
+	bool command(std::vector<std::string> argv) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (queue.size() >= max_queue) {
+				dropped++;
+				if (!overflowing)
+					fprintf(stderr, "Redis publish queue full, dropping messages\n");
+				overflowing = true;
+				return false;
+			}
+			overflowing = false;
+			queue.push_back({std::move(argv), std::chrono::steady_clock::now()});
+			queued = queue.size();
+		}
+		ev_async_send(loop, &wakeup);
+		return true;
+	}
+
+	// Number of messages waiting to be sent
+	size_t queue_depth() const { return queued; }
+
+	// Number of messages sent, but not yet acknowledged
+	size_t in_flight_count() const { return in_flight_depth; }
+
+	// Number of messages dropped because the queue was full
+	uint64_t dropped_count() const { return dropped; }
+
+	// Number of messages (or commands) acknowledged by Redis
+	uint64_t published_count() const { return published; }
+
+	// Number of times the connection was lost
+	uint64_t disconnect_count() const { return disconnects; }
+
+	// When set, the time between queueing a command and Redis
+	// acknowledging it is recorded here.
+	LatencyHistogram *ack_latency = NULL;
+
+private:
+	struct Message {
+		std::vector<std::string> argv;
+		std::chrono::steady_clock::time_point queued_at;
+	};
+
+	// The below all run on the publisher thread
+
+	void connect() {
+		ctx = redisAsyncConnect(host.c_str(), port);
+		if (!ctx || ctx->err) {
+			fprintf(stderr, "Redis connect failed: %s\n", ctx ? ctx->errstr : "out of memory");
+			if (ctx)
+				redisAsyncFree(ctx);
+			ctx = NULL;
+			schedule_reconnect();
+			return;
+		}
+		ctx->data = this;
+		redisLibevAttach(loop, ctx);
+		redisAsyncSetConnectCallback(ctx, on_connect);
+		redisAsyncSetDisconnectCallback(ctx, on_disconnect);
+	}
+
+	void schedule_reconnect() {
+		ev_timer_set(&reconnect_timer, backoff, 0);
+		ev_timer_start(loop, &reconnect_timer);
+		backoff = std::min(backoff * 2, REDIS_MAX_BACKOFF);
+	}
+
+	// Move messages that were sent but never acknowledged back to the
+	// front of the queue, preserving their order. When that overfills
+	// the queue, the oldest messages are dropped.
+	void requeue_in_flight() {
+		std::lock_guard<std::mutex> lock(mutex);
+		while (!in_flight.empty()) {
+			queue.push_front(in_flight.back());
+			in_flight.pop_back();
+		}
+		while (queue.size() > max_queue) {
+			queue.pop_front();
+			dropped++;
+			if (!overflowing)
+				fprintf(stderr, "Redis publish queue full, dropping messages\n");
+			overflowing = true;
+		}
+		queued = queue.size();
+		in_flight_depth = 0;
+	}
+
+	// Send as many queued messages as allowed. hiredis buffers the
+	// commands and writes them out together once the socket becomes
+	// writable, so these end up pipelined.
+	void flush() {
+		if (!connected)
+			return;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		while (!queue.empty() && in_flight.size() < max_in_flight) {
+			Message &m = queue.front();
+			std::vector<const char*> argv;
+			std::vector<size_t> argvlen;
+			for (const std::string &arg : m.argv) {
+				argv.push_back(arg.data());
+				argvlen.push_back(arg.size());
+			}
+			redisAsyncCommandArgv(ctx, on_reply, NULL, argv.size(), argv.data(), argvlen.data());
+			in_flight.push_back(std::move(m));
+			queue.pop_front();
+		}
+		queued = queue.size();
+		in_flight_depth = in_flight.size();
+	}
+
+	static void on_wakeup(struct ev_loop *loop, ev_async *w, int revents) {
+		((RedisPublisher*)w->data)->flush();
+	}
+
+	static void on_reconnect_timer(struct ev_loop *loop, ev_timer *w, int revents) {
+		((RedisPublisher*)w->data)->connect();
+	}
+
+	static void on_connect(const redisAsyncContext *c, int status) {
+		RedisPublisher *self = (RedisPublisher*)c->data;
+		if (status != REDIS_OK) {
+			// hiredis frees the context after this callback
+			fprintf(stderr, "Redis connect failed: %s\n", c->errstr);
+			self->ctx = NULL;
+			self->schedule_reconnect();
+			return;
+		}
+		self->connected = true;
+		self->backoff = REDIS_MIN_BACKOFF;
+		self->flush();
+	}
+
+	static void on_disconnect(const redisAsyncContext *c, int status) {
+		RedisPublisher *self = (RedisPublisher*)c->data;
+		fprintf(stderr, "Redis publish connection lost: %s\n", status == REDIS_OK ? "closed" : c->errstr);
+		self->ctx = NULL;
+		self->connected = false;
+		self->disconnects++;
+		self->requeue_in_flight();
+		self->schedule_reconnect();
+	}
+
+	static void on_reply(redisAsyncContext *c, void *r, void *privdata) {
+		RedisPublisher *self = (RedisPublisher*)c->data;
+		// A NULL reply means the connection is going away, the
+		// disconnect callback requeues the message.
+		if (!r)
+			return;
+
+		std::chrono::steady_clock::time_point queued_at;
+		{
+			std::lock_guard<std::mutex> lock(self->mutex);
+			if (self->in_flight.empty())
+				return;
+			queued_at = self->in_flight.front().queued_at;
+			self->in_flight.pop_front();
+			self->in_flight_depth = self->in_flight.size();
+		}
+
+		redisReply *reply = (redisReply*)r;
+		if (reply->type == REDIS_REPLY_ERROR)
+			fprintf(stderr, "Redis command failed: %s\n", reply->str);
+		else
+			self->published++;
+
+		if (self->ack_latency)
+			self->ack_latency->record_duration(std::chrono::steady_clock::now() - queued_at);
+
+		self->flush();
+	}
+
+	std::string host;
+	int port;
+	size_t max_queue;
+	size_t max_in_flight;
+
+	struct ev_loop *loop = NULL;
+	ev_async wakeup;
+	ev_timer reconnect_timer;
+	redisAsyncContext *ctx = NULL;
+	bool connected = false;
+	double backoff = REDIS_MIN_BACKOFF;
+
+	// Protects queue, in_flight and overflowing
+	std::mutex mutex;
+	std::deque<Message> queue;
+	std::deque<Message> in_flight;
+	bool overflowing = false;
+
+	std::atomic<size_t> queued{0};
+	std::atomic<size_t> in_flight_depth{0};
+	std::atomic<uint64_t> dropped{0};
+	std::atomic<uint64_t> published{0};
+	std::atomic<uint64_t> disconnects{0};
+};
+
+#endif
@@ -0,0 +1,43 @@
+/*
+ *    SimdTypes.h
+ *
+ *    Vector types for the audio code.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __SIMD_TYPES_H
+#define __SIMD_TYPES_H
+
+#include <stdint.h>
+
+// Eight floats (or samples), processed as one vector using the GCC vector
+// extensions. This compiles to SSE/AVX or NEON, depending on the target,
+// and to plain scalar code where there is no SIMD. The reduced alignment
+// allows loads and stores at any sample offset.
+typedef float float8 __attribute__((vector_size(32), aligned(4)));
+typedef int16_t short8 __attribute__((vector_size(16), aligned(2)));
+
+// Sum of the lanes
+inline float sum_lanes(float8 v) {
+	return ((v[0] + v[1]) + (v[2] + v[3])) + ((v[4] + v[5]) + (v[6] + v[7]));
+}
+
+#endif
@@ -0,0 +1,522 @@
+/*
+ *    Skimmer.h
+ *
+ *    Finds and decodes all CW signals in a wide audio passband.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __SKIMMER_H
+#define __SKIMMER_H
+
+#include <stdint.h>
+#include <time.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Channelizer.h"
+#include "CwReceiver.h"
+#include "ToneDetector.h"
+
+// CPU time used by the calling thread, in seconds
+inline double thread_cpu_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Starting or stopping the decoding of a signal, at a given frame
+struct SkimmerEvent {
+	uint64_t frame;
+	unsigned signal;
+	unsigned worker;
+	unsigned bin;
+	float noise;
+	bool start;
+};
+
+// The bin levels of a run of frames, handed to all workers at once
+struct SkimmerBatch {
+	uint64_t first_frame = 0;
+	unsigned frames = 0;
+	// frames * bins levels, frame by frame
+	std::vector<float> levels;
+	std::vector<SkimmerEvent> events;
+};
+
+class SkimmerSignal;
+
+// What the workers need to know, fixed once the skimmer is started
+struct SkimmerSettings {
+	typedef std::function<void(const SkimmerSignal &signal, const char *text)> TextCallback;
+
+	unsigned sample_rate;
+	unsigned hop;
+	unsigned first_bin;
+	unsigned bins;
+	float bin_hz;
+	unsigned wpm;
+	bool use_cluster;
+	TextCallback on_text;
+};
+
+// One signal, decoded from the level of its bin, just like
+// telegraph-listen decodes the level of a ToneDetector.
+class SkimmerSignal {
+public:
+	// Only levels this far above the noise at the start (as amplitude,
+	// 4 is 12dB) can be marks, so noise is not decoded once the signal
+	// is gone
+	static constexpr float SQUELCH_SNR = 4;
+
+	SkimmerSignal(const SkimmerSettings &settings, const SkimmerEvent &start)
+		: id(start.signal), bin(start.bin), freq((settings.first_bin + start.bin) * settings.bin_hz),
+		  first_frame(start.frame), frame(start.frame),
+		  receiver(timing, decoder, NULL, 0), slicer(settings.sample_rate, settings.hop),
+		  settings(settings) {
+		timing.RxWPM(settings.wpm);
+		timing.RxMode(SpeedAuto);
+		if (settings.use_cluster)
+			timing.Estimator(EstimatorCluster);
+
+		receiver.on_text = [this](const char *text) {
+			if (this->settings.on_text)
+				this->settings.on_text(*this, text);
+		};
+		slicer.seed(start.noise);
+		slicer.set_floor(start.noise * SQUELCH_SNR);
+		slicer.on_pulse = [this](bool mark, unsigned length) {
+			receiver.Pulse(length, mark);
+			slicer.set_idle(idle_space());
+		};
+		slicer.set_idle(idle_space());
+	}
+
+	// Decode what is left, like at the end of a transmission
+	void finish() {
+		slicer.flush();
+		receiver.Pulse(idle_space(), false);
+	}
+
+	// Time of the frame being processed, in seconds from the start
+	double time() const {
+		return (double)frame * settings.hop / settings.sample_rate;
+	}
+
+	const unsigned id;
+	const unsigned bin;
+	// Center frequency of the bin, in Hz
+	const float freq;
+	const uint64_t first_frame;
+	uint64_t stop_frame = UINT64_MAX;
+	uint64_t frame;
+
+	CwTimingLogic timing;
+	CwDecoderLogic decoder;
+	CwReceiver receiver;
+	EnvelopeSlicer slicer;
+
+private:
+	// A space this long ends the transmission, see EnvelopeSlicer
+	unsigned idle_space() const {
+		return 2 * timing.MinimumWordSpace * timing.RxDotLength();
+	}
+
+	const SkimmerSettings &settings;
+};
+
+// A thread decoding some of the signals. Every worker gets every batch,
+// and picks out the bins of its own signals.
+class SkimmerWorker {
+public:
+	// Batches queued before push() blocks
+	static const size_t MAX_QUEUED = 4;
+
+	SkimmerWorker(const SkimmerSettings &settings, unsigned index)
+		: settings(settings), index(index) {
+	}
+
+	void start() {
+		thread = std::thread([this]() { run(); });
+	}
+
+	// Queue a batch, waits while the worker is too far behind. NULL
+	// stops the worker.
+	void push(std::shared_ptr<const SkimmerBatch> batch) {
+		std::unique_lock<std::mutex> lock(mutex);
+		space.wait(lock, [this]() { return queue.size() < MAX_QUEUED; });
+		queue.push_back(std::move(batch));
+		ready.notify_one();
+	}
+
+	// Stop after the queued batches
+	void join() {
+		push(NULL);
+		thread.join();
+	}
+
+	// CPU time spent decoding, and the number of frames decoded (summed
+	// over signals). Only valid after join().
+	double cpu_time() const { return cpu; }
+	uint64_t signal_frames() const { return decoded_frames; }
+
+private:
+	void run() {
+		while (true) {
+			std::shared_ptr<const SkimmerBatch> batch;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				ready.wait(lock, [this]() { return !queue.empty(); });
+				batch = std::move(queue.front());
+				queue.pop_front();
+				space.notify_one();
+			}
+			if (!batch)
+				break;
+			double before = thread_cpu_time();
+			process(*batch);
+			cpu += thread_cpu_time() - before;
+		}
+	}
+
+	void process(const SkimmerBatch &batch) {
+		for (const SkimmerEvent &e : batch.events) {
+			if (e.worker != index)
+				continue;
+			if (e.start) {
+				signals.emplace_back(new SkimmerSignal(settings, e));
+			} else {
+				for (auto &s : signals) {
+					if (s->id == e.signal)
+						s->stop_frame = e.frame;
+				}
+			}
+		}
+
+		// One signal at a time, so its decoder state stays in cache
+		uint64_t end = batch.first_frame + batch.frames;
+		for (auto &s : signals) {
+			uint64_t from = std::max(s->first_frame, batch.first_frame);
+			uint64_t to = std::min(s->stop_frame, end);
+			const float *levels = batch.levels.data() + s->bin;
+			for (uint64_t f = from; f < to; ++f) {
+				s->frame = f;
+				s->slicer.update(levels[(f - batch.first_frame) * settings.bins]);
+			}
+			if (to > from)
+				decoded_frames += to - from;
+			if (s->stop_frame <= end)
+				s->finish();
+		}
+
+		signals.erase(std::remove_if(signals.begin(), signals.end(),
+			[end](const std::unique_ptr<SkimmerSignal> &s) { return s->stop_frame <= end; }),
+			signals.end());
+	}
+
+	const SkimmerSettings &settings;
+	unsigned index;
+	std::thread thread;
+
+	// Protects queue
+	std::mutex mutex;
+	std::condition_variable ready, space;
+	std::deque<std::shared_ptr<const SkimmerBatch>> queue;
+
+	// Only used by the worker thread
+	std::vector<std::unique_ptr<SkimmerSignal>> signals;
+	double cpu = 0;
+	uint64_t decoded_frames = 0;
+};
+
+// Splits the passband into bins with a Channelizer, watches every bin
+// for a signal, and decodes each signal found with its own timing and
+// decoder logic. The decoders are spread over a pool of worker threads,
+// which get the bin levels in batches of BATCH_MS. Text is passed to
+// on_text as it is decoded, from the worker threads, so that must be
+// thread-safe.
+//
+// A bin has a signal when its level stays START_SNR above its average
+// for START_MS, and it is the strongest bin around. The average follows
+// the noise, but not the signal. It starts from the median of all bins,
+// so a signal that is already on at the start is still found. Decoding
+// stops after STOP_MS without the level getting that high again.
+class Skimmer {
+public:
+	typedef SkimmerSettings::TextCallback TextCallback;
+
+	// Signal detection, see above. Levels are amplitudes, so a
+	// START_SNR of 6 is about 15dB.
+	static constexpr float START_SNR = 6;
+	static constexpr float START_MS = 20;
+	static constexpr float STOP_MS = 10000;
+	static constexpr float NOISE_MS = 2000;
+	// Signals are at least this many bins apart
+	static const unsigned MIN_SPACING = 3;
+	// The window sidelobes of a strong signal show up as weak local
+	// maxima this many bins away, with at most LEAKAGE its level
+	static const unsigned LEAKAGE_BINS = 8;
+	static constexpr float LEAKAGE = 0.03;
+	// Frames are handed to the workers in batches this long, which
+	// adds up to this much latency
+	static constexpr float BATCH_MS = 1000;
+
+	// Skim [low_hz, high_hz], with bins of (at most) bin_hz, every
+	// hop_ms, using the given number of worker threads
+	Skimmer(unsigned sample_rate, float low_hz, float high_hz, unsigned workers,
+	        float bin_hz = 50, float hop_ms = 4)
+		: channelizer(fft_size(sample_rate, bin_hz, hop_ms), frame_hop(sample_rate, hop_ms),
+		              first_bin(sample_rate, bin_hz, hop_ms, low_hz),
+		              bins(sample_rate, bin_hz, hop_ms, low_hz, high_hz)),
+		  worker_count(std::max(workers, 1U)) {
+		unsigned size = fft_size(sample_rate, bin_hz, hop_ms);
+		settings.sample_rate = sample_rate;
+		settings.hop = frame_hop(sample_rate, hop_ms);
+		settings.first_bin = first_bin(sample_rate, bin_hz, hop_ms, low_hz);
+		settings.bins = bins(sample_rate, bin_hz, hop_ms, low_hz, high_hz);
+		settings.bin_hz = (float)sample_rate / size;
+
+		float frame_ms = settings.hop * 1000.0 / sample_rate;
+		start_frames = std::max(1.0f, ceilf(START_MS / frame_ms));
+		stop_frames = STOP_MS / frame_ms;
+		batch_frames = std::max(1.0f, BATCH_MS / frame_ms);
+		noise_rate = std::min(1.0f, frame_ms / NOISE_MS);
+
+		noise.resize(settings.bins);
+		run.resize(settings.bins);
+		last_above.resize(settings.bins);
+		owner.resize(settings.bins, NONE);
+		load.resize(worker_count);
+		channelizer.on_frame = [this](const float *levels) { frame(levels); };
+		new_batch();
+	}
+
+	// Settings of the decoders, set these before start()
+	unsigned wpm = 20;
+	bool use_cluster = false;
+	TextCallback on_text;
+
+	void start() {
+		settings.wpm = wpm;
+		settings.use_cluster = use_cluster;
+		settings.on_text = on_text;
+		for (unsigned i = 0; i < worker_count; ++i) {
+			workers.emplace_back(new SkimmerWorker(settings, i));
+			workers.back()->start();
+		}
+	}
+
+	void process(const int16_t *samples, size_t count) {
+		double before = thread_cpu_time();
+		channelizer.process(samples, count);
+		cpu += thread_cpu_time() - before;
+	}
+
+	// Decode what is left of all signals, and stop the workers
+	void finish() {
+		for (unsigned b = 0; b < settings.bins; ++b) {
+			if (owner[b] != NONE)
+				stop(b);
+		}
+		dispatch();
+		for (auto &w : workers)
+			w->join();
+	}
+
+	// Bin layout
+	float bin_hz() const { return settings.bin_hz; }
+	unsigned bin_count() const { return settings.bins; }
+
+	// Statistics
+	uint64_t signals_started() const { return next_id; }
+	unsigned signals_max() const { return max_active; }
+	// CPU time of the channelizer and detection, and (after finish())
+	// of the decoders
+	double channelizer_cpu() const { return cpu; }
+	double decoder_cpu() const {
+		double total = 0;
+		for (auto &w : workers)
+			total += w->cpu_time();
+		return total;
+	}
+	// Seconds of signal decoded, summed over signals (after finish())
+	double signal_seconds() const {
+		uint64_t frames = 0;
+		for (auto &w : workers)
+			frames += w->signal_frames();
+		return (double)frames * settings.hop / settings.sample_rate;
+	}
+
+private:
+	enum : unsigned { NONE = UINT32_MAX };
+
+	// The channelizer cannot hop over samples it never transformed, so
+	// with wide bins, the FFT grows to at least a hop (and the bins get
+	// narrower than asked)
+	static unsigned fft_size(unsigned rate, float bin_hz, float hop_ms) {
+		unsigned size = 16;
+		while (rate / size > bin_hz || size < frame_hop(rate, hop_ms))
+			size *= 2;
+		return size;
+	}
+
+	static unsigned frame_hop(unsigned rate, float hop_ms) {
+		return std::max(1U, (unsigned)(rate * hop_ms / 1000 + 0.5));
+	}
+
+	// Bin 0 (DC) and the bin at half the rate are never used
+	static unsigned first_bin(unsigned rate, float bin_hz, float hop_ms, float low_hz) {
+		float bin = (float)rate / fft_size(rate, bin_hz, hop_ms);
+		return std::max(1U, (unsigned)(low_hz / bin));
+	}
+
+	static unsigned bins(unsigned rate, float bin_hz, float hop_ms, float low_hz, float high_hz) {
+		unsigned size = fft_size(rate, bin_hz, hop_ms);
+		float bin = (float)rate / size;
+		unsigned last = std::min(size / 2 - 1, (unsigned)ceilf(high_hz / bin));
+		unsigned first = first_bin(rate, bin_hz, hop_ms, low_hz);
+		return last >= first ? last - first + 1 : 1;
+	}
+
+	void frame(const float *levels) {
+		uint64_t f = frames++;
+		unsigned n = settings.bins;
+		std::copy(levels, levels + n, batch->levels.begin() + batch->frames * n);
+		batch->frames++;
+
+		if (f == 0) {
+			std::vector<float> sorted(levels, levels + n);
+			std::nth_element(sorted.begin(), sorted.begin() + n / 2, sorted.end());
+			std::fill(noise.begin(), noise.end(), sorted[n / 2]);
+		}
+
+		for (unsigned b = 0; b < n; ++b) {
+			float m = levels[b];
+			bool above = m > noise[b] * START_SNR;
+			if (above) {
+				run[b]++;
+				last_above[b] = f;
+			} else {
+				run[b] = 0;
+				noise[b] += (m - noise[b]) * noise_rate;
+			}
+		}
+
+		for (unsigned b = 0; b < n; ++b) {
+			if (owner[b] != NONE && f - last_above[b] > stop_frames)
+				stop(b);
+			else if (run[b] >= start_frames && owner[b] == NONE && is_signal(levels, b))
+				start(b, f + 1 - run[b]);
+		}
+
+		if (batch->frames == batch_frames)
+			dispatch();
+	}
+
+	// Whether bin b looks like a new signal
+	bool is_signal(const float *levels, unsigned b) const {
+		unsigned n = settings.bins;
+		float m = levels[b];
+		unsigned lo = b >= LEAKAGE_BINS ? b - LEAKAGE_BINS : 0;
+		unsigned hi = b + LEAKAGE_BINS < n ? b + LEAKAGE_BINS : n - 1;
+		for (unsigned i = lo; i <= hi; ++i) {
+			unsigned distance = i > b ? i - b : b - i;
+			if (distance == 1 && levels[i] > m)
+				return false;
+			if (distance < MIN_SPACING && owner[i] != NONE)
+				return false;
+			if (levels[i] * LEAKAGE > m)
+				return false;
+		}
+		return true;
+	}
+
+	// Start decoding bin b, on the least busy worker. It starts a frame
+	// before the level got high, to catch the start of the mark.
+	void start(unsigned b, uint64_t from) {
+		unsigned w = std::min_element(load.begin(), load.end()) - load.begin();
+		uint64_t frame = std::max(from > 0 ? from - 1 : 0, batch->first_frame);
+		owner[b] = next_id++;
+		worker_of[owner[b]] = w;
+		load[w]++;
+		batch->events.push_back({frame, owner[b], w, b, noise[b], true});
+		active++;
+		max_active = std::max(max_active, active);
+	}
+
+	void stop(unsigned b) {
+		unsigned w = worker_of[owner[b]];
+		batch->events.push_back({frames, owner[b], w, b, 0, false});
+		worker_of.erase(owner[b]);
+		load[w]--;
+		owner[b] = NONE;
+		active--;
+	}
+
+	// Hand the current batch to the workers, and start a new one
+	void dispatch() {
+		std::shared_ptr<const SkimmerBatch> done(std::move(batch));
+		for (auto &w : workers)
+			w->push(done);
+		new_batch();
+	}
+
+	void new_batch() {
+		batch.reset(new SkimmerBatch());
+		batch->first_frame = frames;
+		batch->levels.resize(batch_frames * settings.bins);
+	}
+
+	SkimmerSettings settings;
+	Channelizer channelizer;
+	unsigned worker_count;
+	std::vector<std::unique_ptr<SkimmerWorker>> workers;
+
+	unsigned start_frames, stop_frames, batch_frames;
+	float noise_rate;
+
+	// Per bin: the noise average, the number of frames the level has
+	// been above START_SNR, the last frame it was, and the signal in
+	// it (or NONE)
+	std::vector<float> noise;
+	std::vector<unsigned> run;
+	std::vector<uint64_t> last_above;
+	std::vector<unsigned> owner;
+
+	// Worker of each active signal, and the number of signals per worker
+	std::map<unsigned, unsigned> worker_of;
+	std::vector<unsigned> load;
+	unsigned active = 0;
+	unsigned max_active = 0;
+	unsigned next_id = 0;
+
+	std::unique_ptr<SkimmerBatch> batch;
+	uint64_t frames = 0;
+	double cpu = 0;
+};
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ *
+ *
+ *    SpscRing.h
+ *
+ *    Lock-free single-producer, single-consumer ring buffer.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __SPSC_RING_H
+#define __SPSC_RING_H
+
+#include <atomic>
+
+namespace KK5JY {
+	namespace Collections {
+		/// <summary>
+		/// Ring buffer that can be written by one thread and read by
+		/// another without locking.  Push and Pop are wait-free.
+		/// </summary>
+		/// <remarks>
+		/// Size must be a power of two.  The producer only writes m_Head
+		/// and the consumer only writes m_Tail, so they never contend on
+		/// anything but the cache lines holding those indices.
+		/// </remarks>
+		template <typename T, unsigned Size>
+		class SpscRing {
+			static_assert(Size != 0 && (Size & (Size - 1)) == 0, "Size must be a power of two");
+
+			private:
+				/// <summary>
+				/// The data storage.
+				/// </summary>
+				T m_Data[Size];
+
+				/// <summary>
+				/// The number of items ever pushed, only written by the producer.
+				/// </summary>
+				alignas(64) std::atomic<unsigned> m_Head;
+
+				/// <summary>
+				/// The highest number of items ever in the ring, only written by the producer.
+				/// </summary>
+				std::atomic<unsigned> m_HighWater;
+
+				/// <summary>
+				/// The number of items dropped because the ring was full, only written by the producer.
+				/// </summary>
+				std::atomic<unsigned> m_Overflows;
+
+				/// <summary>
+				/// The number of items ever popped, only written by the consumer.
+				/// </summary>
+				alignas(64) std::atomic<unsigned> m_Tail;
+
+			public:
+				SpscRing() : m_Head(0), m_HighWater(0), m_Overflows(0), m_Tail(0) { }
+
+				/// <summary>
+				/// The maximum number of items in the ring.
+				/// </summary>
+				static constexpr unsigned Capacity() { return Size; }
+
+				/// <summary>
+				/// The number of items currently in the ring.  Only exact
+				/// when called from the producer or consumer thread.
+				/// </summary>
+				unsigned Count() const {
+					return m_Head.load(std::memory_order_acquire) - m_Tail.load(std::memory_order_acquire);
+				}
+
+				/// <summary>
+				/// The highest number of items that was ever in the ring.
+				/// </summary>
+				unsigned HighWater() const {
+					return m_HighWater.load(std::memory_order_relaxed);
+				}
+
+				/// <summary>
+				/// The number of items that could not be pushed because the ring was full.
+				/// </summary>
+				unsigned Overflows() const {
+					return m_Overflows.load(std::memory_order_relaxed);
+				}
+
+				/// <summary>
+				/// Add an item.  Must only be called from the producer thread.
+				/// </summary>
+				/// <returns>False if the ring was full and the item was dropped.</returns>
+				bool Push(const T &item) {
+					unsigned head = m_Head.load(std::memory_order_relaxed);
+					unsigned used = head - m_Tail.load(std::memory_order_acquire);
+					if (used == Size) {
+						m_Overflows.store(m_Overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+						return false;
+					}
+
+					m_Data[head & (Size - 1)] = item;
+					m_Head.store(head + 1, std::memory_order_release);
+
+					if (used + 1 > m_HighWater.load(std::memory_order_relaxed))
+						m_HighWater.store(used + 1, std::memory_order_relaxed);
+					return true;
+				}
+
+				/// <summary>
+				/// Remove the oldest item.  Must only be called from the consumer thread.
+				/// </summary>
+				/// <returns>False if the ring was empty.</returns>
+				bool Pop(T &result) {
+					unsigned tail = m_Tail.load(std::memory_order_relaxed);
+					if (tail == m_Head.load(std::memory_order_acquire))
+						return false;
+
+					result = m_Data[tail & (Size - 1)];
+					m_Tail.store(tail + 1, std::memory_order_release);
+					return true;
+				}
+		};
+	}
+}
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ *    StationConfig.h
+ *
+ *    Pins and topics of the telegraph sets (stations) served by one
+ *    controller.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __STATION_CONFIG_H
+#define __STATION_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "GpioBackend.h"
+
+// Marks an optional pin as not connected
+const int PIN_NONE = -1;
+
+// The defaults are the pins and topics of the original single-station
+// controller, so a configuration without any settings matches it.
+struct StationConfig {
+	std::string name = "default";
+	int key_pin = 17;
+	int coil_pin = 16;
+	int speaker_pin = 18;		// must support hardware PWM
+	unsigned tone_freq = 700;
+	int stepper_enable_pin = 26;
+	int stepper_dir_pin = 6;
+	int stepper_step_pin = 13;	// must support hardware PWM
+	std::string publish_topic = "toSL";
+	std::string subscribe_topic = "toPlayers";
+};
+
+// Read stations from a file, with one section per station:
+//
+//   [name]
+//   key_pin = 17
+//   publish_topic = toSL
+//
+// Settings not given keep their default. Stepper pins can be "none".
+// Lines starting with # are comments. Returns false (after printing why)
+// when the file is invalid.
+inline bool read_station_config(const char *path, std::vector<StationConfig> &stations) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+
+	auto fail = [&](unsigned lineno, const char *msg) {
+		fprintf(stderr, "%s:%u: %s\n", path, lineno, msg);
+		fclose(f);
+		return false;
+	};
+
+	char line[256];
+	unsigned lineno = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		// Strip whitespace on both ends
+		char *p = line;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		char *end = p + strlen(p);
+		while (end > p && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'))
+			*--end = '\0';
+		if (*p == '#' || *p == '\0')
+			continue;
+
+		if (*p == '[') {
+			if (end[-1] != ']' || end - p < 3)
+				return fail(lineno, "invalid section header");
+			StationConfig station;
+			station.name = std::string(p + 1, end - 1);
+			stations.push_back(station);
+			continue;
+		}
+
+		char *eq = strchr(p, '=');
+		if (!eq)
+			return fail(lineno, "expected key = value");
+		if (stations.empty())
+			return fail(lineno, "setting outside of a [station] section");
+		char *key_end = eq;
+		while (key_end > p && (key_end[-1] == ' ' || key_end[-1] == '\t'))
+			key_end--;
+		std::string key(p, key_end);
+		char *value = eq + 1;
+		while (*value == ' ' || *value == '\t')
+			value++;
+
+		StationConfig &s = stations.back();
+		if (key == "publish_topic" || key == "subscribe_topic") {
+			if (!*value)
+				return fail(lineno, "empty topic");
+			(key == "publish_topic" ? s.publish_topic : s.subscribe_topic) = value;
+			continue;
+		}
+
+		int number;
+		char *num_end;
+		if (strcmp(value, "none") == 0) {
+			number = PIN_NONE;
+		} else {
+			number = strtol(value, &num_end, 10);
+			if (!*value || *num_end || number < 0)
+				return fail(lineno, "invalid number");
+		}
+
+		bool optional = false;
+		int *pin = NULL;
+		if (key == "key_pin") {
+			pin = &s.key_pin;
+		} else if (key == "coil_pin") {
+			pin = &s.coil_pin;
+		} else if (key == "speaker_pin") {
+			pin = &s.speaker_pin;
+		} else if (key == "stepper_enable_pin") {
+			pin = &s.stepper_enable_pin;
+			optional = true;
+		} else if (key == "stepper_dir_pin") {
+			pin = &s.stepper_dir_pin;
+			optional = true;
+		} else if (key == "stepper_step_pin") {
+			pin = &s.stepper_step_pin;
+			optional = true;
+		} else if (key == "tone_freq") {
+			if (number <= 0)
+				return fail(lineno, "invalid frequency");
+			s.tone_freq = number;
+			continue;
+		} else {
+			return fail(lineno, "unknown setting");
+		}
+
+		if ((number == PIN_NONE && !optional) || number >= (int)GPIO_COUNT)
+			return fail(lineno, "invalid pin");
+		*pin = number;
+	}
+	fclose(f);
+
+	if (stations.empty()) {
+		fprintf(stderr, "%s: no stations configured\n", path);
+		return false;
+	}
+
+	// Stations must not share inputs, outputs that are switched
+	// separately, or topics. The stepper step pin is only ever set to a
+	// fixed PWM, so stations can share that.
+	for (size_t i = 0; i < stations.size(); ++i) {
+		for (size_t j = 0; j < i; ++j) {
+			const StationConfig &a = stations[i], &b = stations[j];
+			const char *conflict = NULL;
+			if (a.name == b.name)
+				conflict = "name";
+			else if (a.key_pin == b.key_pin)
+				conflict = "key_pin";
+			else if (a.coil_pin == b.coil_pin)
+				conflict = "coil_pin";
+			else if (a.speaker_pin == b.speaker_pin)
+				conflict = "speaker_pin";
+			else if (a.stepper_enable_pin != PIN_NONE && a.stepper_enable_pin == b.stepper_enable_pin)
+				conflict = "stepper_enable_pin";
+			else if (a.publish_topic == b.publish_topic)
+				conflict = "publish_topic";
+			else if (a.subscribe_topic == b.subscribe_topic)
+				conflict = "subscribe_topic";
+			if (conflict) {
+				fprintf(stderr, "%s: stations %s and %s have the same %s\n", path,
+					b.name.c_str(), a.name.c_str(), conflict);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ *    TimingState.h
+ *
+ *    Stores the learned timing state of each station in a file, so a
+ *    restarted controller decodes at the right speed from the first edge.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __TIMING_STATE_H
+#define __TIMING_STATE_H
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+
+#include "CwTimingLogic.h"
+
+using namespace KK5JY::CW;
+
+// The file has one section per station, named after it. Lengths are in
+// ms, while CwTimingState has them in µs:
+//
+//   [default]
+//   dot_length = 62.5
+//   rx_dot_length = 62.5
+//   tx_dot_length = 120
+//   safety_gap = 43.75
+//   rx_source = auto
+//   tx_source = manual
+//   boxcar_index = 3
+//   boxcar = 60 182 65 ...
+typedef std::map<std::string, CwTimingState> TimingStates;
+
+// Write the states to path. The file is written under a temporary name
+// and then renamed, so a crash halfway never leaves a partial file.
+inline bool write_timing_state(const char *path, const TimingStates &states) {
+	std::string tmp = std::string(path) + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (!f) {
+		perror(tmp.c_str());
+		return false;
+	}
+
+	for (auto &entry : states) {
+		const CwTimingState &s = entry.second;
+		fprintf(f, "[%s]\n", entry.first.c_str());
+		fprintf(f, "dot_length = %.9g\n", s.DotLength / 1000);
+		fprintf(f, "rx_dot_length = %.9g\n", s.RxDotLength / 1000);
+		fprintf(f, "tx_dot_length = %.9g\n", s.TxDotLength / 1000);
+		fprintf(f, "safety_gap = %.9g\n", s.SafetyGap / 1000.0);
+		fprintf(f, "rx_source = %s\n", s.RxSpeedSource == SpeedAuto ? "auto" : "manual");
+		fprintf(f, "tx_source = %s\n", s.TxSpeedSource == SpeedAuto ? "auto" : "manual");
+		fprintf(f, "boxcar_index = %u\n", s.BoxCarIndex);
+		fprintf(f, "boxcar =");
+		for (float length : s.BoxCar)
+			fprintf(f, " %.9g", length / 1000);
+		fprintf(f, "\n\n");
+	}
+
+	bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok || rename(tmp.c_str(), path) < 0) {
+		perror(tmp.c_str());
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Read the states written by write_timing_state(). Returns false (after
+// printing why) when the file is missing or invalid. Stations with
+// missing settings are left out.
+inline bool read_timing_state(const char *path, TimingStates &states) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		// No state yet is normal on the first start
+		if (errno != ENOENT)
+			perror(path);
+		return false;
+	}
+
+	// Bits of the settings seen for the current station
+	const unsigned ALL_SETTINGS = (1 << 8) - 1;
+	std::map<std::string, unsigned> seen;
+	std::string station;
+	bool ok = true;
+	char line[1024];
+	while (ok && fgets(line, sizeof(line), f)) {
+		char *end = line + strlen(line);
+		while (end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' '))
+			*--end = '\0';
+		if (line[0] == '\0')
+			continue;
+
+		if (line[0] == '[') {
+			if (end[-1] != ']' || end - line < 3) {
+				ok = false;
+				break;
+			}
+			station = std::string(line + 1, end - 1);
+			states[station] = CwTimingState();
+			seen[station] = 0;
+			continue;
+		}
+
+		char *eq = strstr(line, " = ");
+		if (!eq || station.empty()) {
+			ok = false;
+			break;
+		}
+		*eq = '\0';
+		const char *key = line;
+		char *value = eq + 3;
+		char *num_end;
+		CwTimingState &s = states[station];
+		unsigned bit;
+
+		if (strcmp(key, "dot_length") == 0) {
+			s.DotLength = strtof(value, &num_end) * 1000;
+			bit = 0;
+		} else if (strcmp(key, "rx_dot_length") == 0) {
+			s.RxDotLength = strtof(value, &num_end) * 1000;
+			bit = 1;
+		} else if (strcmp(key, "tx_dot_length") == 0) {
+			s.TxDotLength = strtof(value, &num_end) * 1000;
+			bit = 2;
+		} else if (strcmp(key, "safety_gap") == 0) {
+			s.SafetyGap = lroundf(strtof(value, &num_end) * 1000);
+			bit = 3;
+		} else if (strcmp(key, "rx_source") == 0 || strcmp(key, "tx_source") == 0) {
+			SpeedSources &source = key[0] == 'r' ? s.RxSpeedSource : s.TxSpeedSource;
+			source = strcmp(value, "auto") == 0 ? SpeedAuto : SpeedManual;
+			ok = source == SpeedAuto || strcmp(value, "manual") == 0;
+			num_end = value + strlen(value);
+			bit = key[0] == 'r' ? 4 : 5;
+		} else if (strcmp(key, "boxcar_index") == 0) {
+			s.BoxCarIndex = strtoul(value, &num_end, 10);
+			bit = 6;
+		} else if (strcmp(key, "boxcar") == 0) {
+			s.BoxCar.clear();
+			num_end = value;
+			while (*num_end) {
+				char *p = num_end;
+				s.BoxCar.push_back(strtof(p, &num_end) * 1000);
+				if (num_end == p)
+					break;
+			}
+			bit = 7;
+		} else {
+			ok = false;
+			break;
+		}
+		if (*num_end != '\0' || num_end == value)
+			ok = false;
+		seen[station] |= 1 << bit;
+	}
+	fclose(f);
+
+	if (!ok) {
+		fprintf(stderr, "%s: invalid timing state\n", path);
+		states.clear();
+		return false;
+	}
+
+	for (auto &entry : seen) {
+		if (entry.second != ALL_SETTINGS)
+			states.erase(entry.first);
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,303 @@
+/*
+ *    ToneDetector.h
+ *
+ *    Detects a CW tone in PCM audio, and turns it into mark and space
+ *    pulses for the RX path.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __TONE_DETECTOR_H
+#define __TONE_DETECTOR_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "SimdTypes.h"
+
+// Turns a series of tone levels, measured every block_size samples, into
+// mark and space pulses. The level is compared against an adaptive
+// threshold between the tracked noise floor and signal peak, with
+// hysteresis. State changes shorter than min_blocks are ignored, like
+// the debounce on the key pin. The edge is placed where the level
+// crosses halfway, interpolated between the block centers around it, so
+// marks and spaces are not biased by the block length or the keying
+// edges. Every completed mark or space is passed to on_pulse, with its
+// length in µs, rounded from the first block, so errors do not add up.
+class EnvelopeSlicer {
+public:
+	typedef std::function<void(bool mark, unsigned length_us)> PulseCallback;
+
+	// Minimum peak to noise ratio (as amplitude) to detect marks at all
+	static constexpr float MIN_SNR = 2;
+	// Thresholds, as a fraction of the way from noise to peak
+	static constexpr float MARK_THRESHOLD = 0.55;
+	static constexpr float SPACE_THRESHOLD = 0.35;
+	// Time constants of the peak and noise trackers
+	static constexpr float PEAK_DECAY_MS = 3000;
+	static constexpr float NOISE_RISE_MS = 3000;
+	static constexpr float NOISE_FALL_MS = 10;
+
+	EnvelopeSlicer(unsigned sample_rate, size_t block_size, float min_ms = 8)
+		: sample_rate(sample_rate), block_size(block_size) {
+		float block_ms = block_size * 1000.0 / sample_rate;
+		min_blocks = std::max(1.0f, ceilf(min_ms / block_ms));
+		peak_decay = block_ms / PEAK_DECAY_MS;
+		noise_rise = block_ms / NOISE_RISE_MS;
+		noise_fall = std::min(1.0f, block_ms / NOISE_FALL_MS);
+		history.resize(min_blocks + 2);
+	}
+
+	PulseCallback on_pulse;
+
+	// Start the trackers from this noise level, instead of from the
+	// first block. Call before the first update().
+	void seed(float noise_level) {
+		peak = noise = noise_level;
+		seeded = true;
+	}
+
+	// Levels below this never start a mark, however quiet the noise
+	// gets. This keeps noise from being decoded when the signal is gone.
+	void set_floor(float level) {
+		floor = level;
+	}
+
+	// A space longer than this (in µs, 0 is never) ends the
+	// transmission: the space is passed on, and the silence after it is
+	// skipped like the silence before the first mark. This is what the
+	// watchdog on the key pin does.
+	void set_idle(unsigned us) {
+		idle_blocks = (uint64_t)us * sample_rate / 1000000 / block_size;
+	}
+
+	// Process the level of the next block
+	void update(float m) {
+		last_level = m;
+		history[blocks % history.size()] = m;
+		if (blocks == 0 && !seeded)
+			peak = noise = m;
+		if (m > peak)
+			peak = m;
+		else
+			peak += (m - peak) * peak_decay;
+		if (m < noise)
+			noise += (m - noise) * noise_fall;
+		else
+			noise += (m - noise) * noise_rise;
+
+		bool detected = mark;
+		float range = peak - noise;
+		if (peak < noise * MIN_SNR || (!mark && m < floor))
+			detected = false;
+		else if (m > noise + MARK_THRESHOLD * range)
+			detected = true;
+		else if (m < noise + SPACE_THRESHOLD * range)
+			detected = false;
+
+		// A change counts from its first block, once it lasted long
+		// enough
+		if (detected == mark) {
+			change_blocks = 0;
+		} else if (++change_blocks >= min_blocks) {
+			uint64_t start = crossing(blocks + 1 - change_blocks, noise + 0.5f * range);
+			// Leading silence is no element
+			if (started)
+				emit(start);
+			started = true;
+			edge = start;
+			mark = detected;
+			change_blocks = 0;
+		}
+		blocks++;
+
+		if (started && !mark && idle_blocks && blocks * block_size - edge > idle_blocks * block_size) {
+			emit(blocks * block_size);
+			started = false;
+		}
+	}
+
+	// Pass on the element in progress, up to the last block seen
+	void flush() {
+		if (started)
+			emit(blocks * block_size);
+	}
+
+	// The last level, and the tracked peak and noise floor
+	float level() const { return last_level; }
+	float peak_level() const { return peak; }
+	float noise_level() const { return noise; }
+
+	// Whether a mark is in progress
+	bool marking() const { return mark; }
+
+private:
+	// The sample where the level crosses threshold, between the centers
+	// of the block before the first changed block and that block
+	uint64_t crossing(uint64_t changed, float threshold) {
+		if (changed == 0)
+			return 0;
+		float before = history[(changed - 1) % history.size()];
+		float after = history[changed % history.size()];
+		float frac = 0.5f;
+		if (after != before)
+			frac = std::min(std::max((threshold - before) / (after - before), 0.0f), 1.0f);
+		return (changed - 1) * block_size + block_size / 2 + (uint64_t)(frac * block_size);
+	}
+
+	// Pass on the element from the last edge up to sample end
+	void emit(uint64_t end) {
+		uint64_t from_us = (edge * 1000000 + sample_rate / 2) / sample_rate;
+		uint64_t to_us = (end * 1000000 + sample_rate / 2) / sample_rate;
+		if (to_us > from_us && on_pulse)
+			on_pulse(mark, to_us - from_us);
+		edge = end;
+	}
+
+	unsigned sample_rate;
+	size_t block_size;
+	unsigned min_blocks;
+	uint64_t idle_blocks = 0;
+	float peak_decay, noise_rise, noise_fall;
+
+	float last_level = 0;
+	float peak = 0;
+	float noise = 0;
+	float floor = 0;
+	bool seeded = false;
+	bool mark = false;
+	bool started = false;
+	unsigned change_blocks = 0;
+	// Levels of the last few blocks, indexed by block number
+	std::vector<float> history;
+	// Blocks seen so far, and the sample where the current element
+	// started
+	uint64_t blocks = 0;
+	uint64_t edge = 0;
+};
+
+// Measures the level of one frequency in blocks of a few ms, by mixing
+// the audio down with a complex oscillator at that frequency and summing
+// each block (a single-bin DFT, like Goertzel). The mixing runs eight
+// samples at a time, with the same rotating phasors as ToneRenderer. The
+// levels go through an EnvelopeSlicer, which passes the pulses to
+// on_pulse.
+class ToneDetector {
+public:
+	typedef EnvelopeSlicer::PulseCallback PulseCallback;
+
+	ToneDetector(unsigned sample_rate, float freq, float block_ms = 4, float min_ms = 8)
+		: block_size(block_samples(sample_rate, block_ms)),
+		  slicer(sample_rate, block_size, min_ms) {
+		double omega = 2 * M_PI * freq / sample_rate;
+		for (unsigned k = 0; k < 8; ++k) {
+			re[k] = cos(omega * k);
+			im[k] = -sin(omega * k);
+		}
+		step_re = cos(8 * omega);
+		step_im = -sin(8 * omega);
+		pending.reserve(block_size);
+		slicer.on_pulse = [this](bool mark, unsigned length_us) {
+			if (on_pulse)
+				on_pulse(mark, length_us);
+		};
+	}
+
+	// The slicer calls back into this object
+	ToneDetector(const ToneDetector&) = delete;
+	ToneDetector &operator=(const ToneDetector&) = delete;
+
+	PulseCallback on_pulse;
+
+	void process(const int16_t *samples, size_t count) {
+		// Complete a block left over from the previous call
+		if (!pending.empty()) {
+			size_t n = std::min(count, block_size - pending.size());
+			pending.insert(pending.end(), samples, samples + n);
+			samples += n;
+			count -= n;
+			if (pending.size() < block_size)
+				return;
+			slicer.update(measure(pending.data()));
+			pending.clear();
+		}
+
+		for (; count >= block_size; samples += block_size, count -= block_size)
+			slicer.update(measure(samples));
+		pending.assign(samples, samples + count);
+	}
+
+	// Pass on the element in progress, up to the end of the audio seen
+	void flush() {
+		slicer.flush();
+	}
+
+	// The last measured level, and the tracked peak and noise floor,
+	// relative to full scale
+	float level() const { return slicer.level(); }
+	float peak_level() const { return slicer.peak_level(); }
+	float noise_level() const { return slicer.noise_level(); }
+
+private:
+	// Blocks are a multiple of the vector size
+	static size_t block_samples(unsigned sample_rate, float block_ms) {
+		size_t n = (size_t)(sample_rate * block_ms / 1000 / 8 + 0.5) * 8;
+		return std::max(n, (size_t)8);
+	}
+
+	// The tone amplitude in one block, relative to full scale
+	float measure(const int16_t *x) {
+		float8 acc_re = {}, acc_im = {};
+		for (unsigned i = 0; i < block_size; i += 8) {
+			short8 s;
+			memcpy(&s, x + i, sizeof(s));
+			float8 v = __builtin_convertvector(s, float8);
+			acc_re += v * re;
+			acc_im += v * im;
+			float8 next_re = re * step_re - im * step_im;
+			im = re * step_im + im * step_re;
+			re = next_re;
+		}
+		// Keep the phasors on the unit circle, rounding errors would
+		// otherwise slowly change the gain
+		float8 gain = 1.5f - 0.5f * (re * re + im * im);
+		re *= gain;
+		im *= gain;
+
+		float i = sum_lanes(acc_re), q = sum_lanes(acc_im);
+		return 2 * sqrtf(i * i + q * q) / (block_size * 32768.0f);
+	}
+
+	size_t block_size;
+	EnvelopeSlicer slicer;
+
+	// The oscillator, see ToneRenderer
+	float8 re, im;
+	float step_re, step_im;
+
+	// Samples of an incomplete block
+	std::vector<int16_t> pending;
+};
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ *    ToneRenderer.h
+ *
+ *    Renders TX elements to 16-bit PCM audio, with shaped keying.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __TONE_RENDERER_H
+#define __TONE_RENDERER_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "Elements.h"
+#include "SimdTypes.h"
+
+using namespace KK5JY::CW;
+
+// Turns a sequence of elements (as produced by CwTimingLogic::Encode) into
+// a sine tone, keyed with raised-cosine edges. Hard keying a tone gives
+// clicks, which the edges avoid. Each edge takes rise_ms and is centered
+// on the element boundary, so the envelope crosses half amplitude
+// exactly where the mark starts and ends. The whole output is delayed by
+// half an edge for that; the fall of a mark spills into the following
+// space.
+//
+// The oscillator runs eight samples at a time: each vector lane is a
+// phasor that is rotated by eight samples' worth of phase per step, so
+// the inner loop is only multiplies and adds.
+class ToneRenderer {
+public:
+	ToneRenderer(unsigned sample_rate, float freq, float rise_ms = 5, float amplitude = 0.8)
+		: sample_rate(sample_rate), amplitude(std::min(std::max(amplitude, 0.0f), 1.0f)) {
+		omega = 2 * M_PI * freq / sample_rate;
+		unsigned rise = rise_ms * sample_rate / 1000;
+		edge.resize(rise);
+		for (unsigned i = 0; i < rise; ++i)
+			edge[i] = 0.5 - 0.5 * cos(M_PI * (i + 0.5) / rise);
+	}
+
+	// Append the samples of one element to out. Element boundaries are
+	// rounded to samples from the total time, so rounding errors do not
+	// add up over long renders.
+	void render(const CwElement &e, std::vector<int16_t> &out) {
+		elapsed_us += e.Length;
+		uint64_t end = (elapsed_us * sample_rate + 500000) / 1000000;
+		size_t count = end - position;
+		size_t start = out.size();
+		out.resize(start + count);
+		int16_t *o = out.data() + start;
+		if (e.Mark && count) {
+			render_mark(o, count);
+		} else {
+			memset(o, 0, count * sizeof(int16_t));
+			size_t n = std::min(count, tail.size());
+			memcpy(o, tail.data(), n * sizeof(int16_t));
+			tail.erase(tail.begin(), tail.begin() + n);
+		}
+		position = end;
+	}
+
+	// Append what is left of the last mark, call after the last element
+	void finish(std::vector<int16_t> &out) {
+		out.insert(out.end(), tail.begin(), tail.end());
+		position += tail.size();
+		tail.clear();
+	}
+
+	// Total number of samples rendered
+	uint64_t samples() const { return position; }
+
+	unsigned rate() const { return sample_rate; }
+
+private:
+	// Render a mark of count samples, followed by its falling edge
+	// into tail
+	void render_mark(int16_t *out, size_t count) {
+		// Shorten the edges of marks that are too short for them
+		size_t rise = std::min(edge.size(), count);
+		size_t total = count + rise;
+		size_t blocks = (total + 7) / 8;
+		tone.resize(blocks * 8);
+
+		// Start the phasors at the phase of the first sample, so the
+		// tone stays coherent across marks
+		float8 re, im;
+		for (unsigned k = 0; k < 8; ++k) {
+			double phase = fmod(omega * (position + k), 2 * M_PI);
+			re[k] = cos(phase);
+			im[k] = sin(phase);
+		}
+		const float step_re = cos(8 * omega);
+		const float step_im = sin(8 * omega);
+
+		float *t = tone.data();
+		for (size_t b = 0; b < blocks; ++b) {
+			memcpy(t + b * 8, &im, sizeof(im));
+			float8 next_re = re * step_re - im * step_im;
+			im = re * step_im + im * step_re;
+			re = next_re;
+			// Keep the phasors on the unit circle, rounding errors
+			// would otherwise slowly change the amplitude
+			if ((b & 1023) == 1023) {
+				float8 gain = 1.5f - 0.5f * (re * re + im * im);
+				re *= gain;
+				im *= gain;
+			}
+		}
+
+		// Shape the edges
+		if (rise == edge.size()) {
+			for (size_t i = 0; i < rise; ++i) {
+				t[i] *= edge[i];
+				t[total - 1 - i] *= edge[i];
+			}
+		} else {
+			for (size_t i = 0; i < rise; ++i) {
+				float g = 0.5 - 0.5 * cos(M_PI * (i + 0.5) / rise);
+				t[i] *= g;
+				t[total - 1 - i] *= g;
+			}
+		}
+
+		// Scale and convert, eight samples at a time. A mark never
+		// follows a mark, so whatever is left of the previous tail
+		// is silence.
+		tail.resize(rise);
+		const float scale = amplitude * 32767;
+		size_t i = 0;
+		for (; i + 8 <= total; i += 8) {
+			float8 v;
+			memcpy(&v, t + i, sizeof(v));
+			short8 s = __builtin_convertvector(v * scale, short8);
+			store(out, count, i, s);
+		}
+		for (; i < total; ++i) {
+			int16_t v = t[i] * scale;
+			if (i < count)
+				out[i] = v;
+			else
+				tail[i - count] = v;
+		}
+	}
+
+	// Store eight samples at offset i of the mark, the part beyond
+	// count goes into the tail
+	void store(int16_t *out, size_t count, size_t i, const short8 &s) {
+		if (i + 8 <= count) {
+			memcpy(out + i, &s, sizeof(s));
+		} else if (i >= count) {
+			memcpy(tail.data() + (i - count), &s, sizeof(s));
+		} else {
+			size_t n = count - i;
+			memcpy(out + i, &s, n * sizeof(int16_t));
+			memcpy(tail.data(), (const int16_t*)&s + n, (8 - n) * sizeof(int16_t));
+		}
+	}
+
+	unsigned sample_rate;
+	float amplitude;
+	double omega;
+	// Gain of the rising edge, the falling edge is its mirror
+	std::vector<float> edge;
+	// Scratch buffer for the tone of one mark
+	std::vector<float> tone;
+	// The falling edge of the last mark, still to be output
+	std::vector<int16_t> tail;
+	uint64_t elapsed_us = 0;
+	uint64_t position = 0;
+};
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ *    TxQueue.h
+ *
+ *    Queue of messages waiting to be transmitted.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __TX_QUEUE_H
+#define __TX_QUEUE_H
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+
+// Message priorities, higher is sent first
+const int TX_PRIORITY_NORMAL = 0;
+const int TX_PRIORITY_HIGH = 1;
+
+struct TxMessage {
+	uint64_t id;
+	int priority;
+	std::string text;
+	std::chrono::steady_clock::time_point queued;
+};
+
+struct TxQueueStats {
+	// Messages currently waiting
+	size_t depth;
+	// Highest number of messages ever waiting
+	size_t max_depth;
+	uint64_t queued;
+	uint64_t cancelled;
+	// Time the last message popped spent waiting, and the maximum
+	std::chrono::steady_clock::duration last_wait;
+	std::chrono::steady_clock::duration max_wait;
+};
+
+// Thread-safe queue of messages to send, ordered by priority and then
+// by arrival. The message being sent (the one last popped) can be
+// cancelled too, the sender is expected to check cancelled() regularly.
+class TxQueue {
+public:
+	using clock = std::chrono::steady_clock;
+
+	// Add a message, returns its id
+	uint64_t push(const std::string &text, int priority = TX_PRIORITY_NORMAL) {
+		std::lock_guard<std::mutex> lock(mutex);
+		TxMessage msg = {next_id++, priority, text, clock::now()};
+
+		// Insert after all messages with the same or higher priority
+		auto it = queue.begin();
+		while (it != queue.end() && it->priority >= priority)
+			++it;
+		queue.insert(it, msg);
+
+		stats.queued++;
+		stats.depth = queue.size();
+		if (stats.depth > stats.max_depth)
+			stats.max_depth = stats.depth;
+		ready.notify_one();
+		return msg.id;
+	}
+
+	// Wait for the next message, up to the given timeout. Returns false
+	// when no message arrived in time.
+	bool pop(TxMessage &msg, clock::duration timeout) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!ready.wait_for(lock, timeout, [this]() { return !queue.empty(); }))
+			return false;
+		msg = queue.front();
+		queue.pop_front();
+
+		current = msg.id;
+		current_text = msg.text;
+		current_cancelled = false;
+		stats.depth = queue.size();
+		stats.last_wait = clock::now() - msg.queued;
+		if (stats.last_wait > stats.max_wait)
+			stats.max_wait = stats.last_wait;
+		return true;
+	}
+
+	// Wait for the next message, without a timeout
+	bool pop(TxMessage &msg) {
+		return pop(msg, std::chrono::hours(24 * 365));
+	}
+
+	// Cancel all messages with the given text, or all messages when
+	// text is empty. This includes the message being sent. Returns the
+	// number of messages cancelled.
+	size_t cancel(const std::string &text = "") {
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t count = 0;
+		for (auto it = queue.begin(); it != queue.end();) {
+			if (text.empty() || it->text == text) {
+				it = queue.erase(it);
+				count++;
+			} else {
+				++it;
+			}
+		}
+		if (current && !current_cancelled && (text.empty() || current_text == text)) {
+			current_cancelled = true;
+			count++;
+		}
+		stats.cancelled += count;
+		stats.depth = queue.size();
+		return count;
+	}
+
+	// Returns true when the message with the given id was cancelled
+	// while being sent.
+	bool cancelled(uint64_t id) {
+		std::lock_guard<std::mutex> lock(mutex);
+		return id == current && current_cancelled;
+	}
+
+	// Mark the message being sent as done, so cancel() no longer
+	// counts it.
+	void done(uint64_t id) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (id == current)
+			current = 0;
+	}
+
+	size_t depth() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return queue.size();
+	}
+
+	TxQueueStats get_stats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return stats;
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::deque<TxMessage> queue;
+	uint64_t next_id = 1;
+
+	// The message being sent, 0 when none
+	uint64_t current = 0;
+	std::string current_text;
+	bool current_cancelled = false;
+
+	TxQueueStats stats = {};
+};
+
+#endif
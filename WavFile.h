@@ -0,0 +1,238 @@
+/*
+ *    WavFile.h
+ *
+ *    Reads and writes 16-bit PCM WAV files, also from and to pipes.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __WAV_FILE_H
+#define __WAV_FILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// Streams samples into a WAV file. The sizes in the header are only
+// known at the end, so they are filled in by close() when the output is
+// seekable. When writing to a pipe, they are set to the maximum, which
+// most tools take as "until the end of the stream".
+class WavWriter {
+public:
+	~WavWriter() {
+		close();
+	}
+
+	// Open path for writing, "-" is stdout
+	bool open(const char *path, unsigned sample_rate) {
+		close();
+		if (strcmp(path, "-") == 0) {
+			f = stdout;
+		} else {
+			f = fopen(path, "wb");
+			if (!f) {
+				perror(path);
+				return false;
+			}
+		}
+		data_bytes = 0;
+		return write_header(sample_rate, UINT32_MAX);
+	}
+
+	bool write(const int16_t *samples, size_t count) {
+		if (!f)
+			return false;
+		// WAV is little-endian, like every platform this runs on
+		data_bytes += count * sizeof(*samples);
+		return fwrite(samples, sizeof(*samples), count, f) == count;
+	}
+
+	// Fill in the sizes when possible, and close the file
+	bool close() {
+		if (!f)
+			return true;
+		bool ok = true;
+		if (fseek(f, 0, SEEK_SET) == 0)
+			ok = write_header(sample_rate, data_bytes > UINT32_MAX - 36 ? UINT32_MAX - 36 : data_bytes);
+		if (fflush(f) != 0)
+			ok = false;
+		if (f != stdout && fclose(f) != 0)
+			ok = false;
+		f = NULL;
+		return ok;
+	}
+
+	uint64_t samples() const { return data_bytes / sizeof(int16_t); }
+
+private:
+	bool write_header(unsigned rate, uint32_t data_size) {
+		sample_rate = rate;
+		uint8_t h[44];
+		memcpy(h, "RIFF", 4);
+		put32(h + 4, data_size == UINT32_MAX ? UINT32_MAX : data_size + 36);
+		memcpy(h + 8, "WAVEfmt ", 8);
+		put32(h + 16, 16);		// fmt chunk size
+		put16(h + 20, 1);		// PCM
+		put16(h + 22, 1);		// mono
+		put32(h + 24, rate);
+		put32(h + 28, rate * 2);	// bytes per second
+		put16(h + 32, 2);		// bytes per frame
+		put16(h + 34, 16);		// bits per sample
+		memcpy(h + 36, "data", 4);
+		put32(h + 40, data_size);
+		return fwrite(h, sizeof(h), 1, f) == 1;
+	}
+
+	static void put16(uint8_t *p, uint16_t v) {
+		p[0] = v;
+		p[1] = v >> 8;
+	}
+
+	static void put32(uint8_t *p, uint32_t v) {
+		put16(p, v);
+		put16(p + 2, v >> 16);
+	}
+
+	FILE *f = NULL;
+	unsigned sample_rate = 0;
+	uint64_t data_bytes = 0;
+};
+
+// Streams samples from a 16-bit PCM WAV file. Only reads forward, so
+// it also works on pipes. Of multi-channel files, only the first channel
+// is returned.
+class WavReader {
+public:
+	~WavReader() {
+		close();
+	}
+
+	// Open path for reading, "-" is stdin. Returns false (after
+	// printing why) if it is not a supported WAV file.
+	bool open(const char *path) {
+		close();
+		if (strcmp(path, "-") == 0) {
+			f = stdin;
+		} else {
+			f = fopen(path, "rb");
+			if (!f) {
+				perror(path);
+				return false;
+			}
+		}
+
+		uint8_t h[12];
+		if (fread(h, sizeof(h), 1, f) != 1 || memcmp(h, "RIFF", 4) != 0 || memcmp(h + 8, "WAVE", 4) != 0)
+			return fail(path, "not a WAV file");
+
+		// Skip chunks until the data, the format must come first
+		bool have_format = false;
+		while (true) {
+			uint8_t c[8];
+			if (fread(c, sizeof(c), 1, f) != 1)
+				return fail(path, "no data chunk");
+			uint32_t size = get32(c + 4);
+			if (memcmp(c, "data", 4) == 0) {
+				if (!have_format)
+					return fail(path, "data before format");
+				// Streams written by WavWriter have the maximum
+				// size, read those until the end
+				remaining = size == UINT32_MAX ? UINT64_MAX : size;
+				return true;
+			}
+
+			if (memcmp(c, "fmt ", 4) == 0 && size >= 16) {
+				uint8_t fmt[16];
+				if (fread(fmt, sizeof(fmt), 1, f) != 1)
+					return fail(path, "truncated format");
+				size -= sizeof(fmt);
+				// 1 is PCM, 0xfffe is WAVE_FORMAT_EXTENSIBLE,
+				// whose sub-format is assumed to be PCM
+				uint16_t format = get16(fmt);
+				channels = get16(fmt + 2);
+				sample_rate = get32(fmt + 4);
+				uint16_t bits = get16(fmt + 14);
+				if ((format != 1 && format != 0xfffe) || bits != 16 || channels == 0)
+					return fail(path, "only 16-bit PCM is supported");
+				have_format = true;
+			}
+
+			// Skip the (rest of the) chunk, which is padded to an
+			// even size
+			for (uint32_t i = 0; i < size + (size & 1); ++i) {
+				if (getc(f) == EOF)
+					return fail(path, "truncated chunk");
+			}
+		}
+	}
+
+	// Read up to count samples, returns how many were read, 0 at the end
+	size_t read(int16_t *samples, size_t count) {
+		if (!f)
+			return 0;
+		// A file that ends before the size in its header is taken
+		// as the end of the data, not an error
+		uint64_t frames = remaining / (2 * channels);
+		if (count > frames)
+			count = frames;
+		if (channels == 1) {
+			count = fread(samples, sizeof(*samples), count, f);
+		} else {
+			buffer.resize(count * channels);
+			count = fread(buffer.data(), sizeof(int16_t) * channels, count, f);
+			for (size_t i = 0; i < count; ++i)
+				samples[i] = buffer[i * channels];
+		}
+		remaining -= count * 2 * channels;
+		return count;
+	}
+
+	void close() {
+		if (f && f != stdin)
+			fclose(f);
+		f = NULL;
+	}
+
+	unsigned rate() const { return sample_rate; }
+
+private:
+	bool fail(const char *path, const char *msg) {
+		fprintf(stderr, "%s: %s\n", path, msg);
+		close();
+		return false;
+	}
+
+	static uint16_t get16(const uint8_t *p) {
+		return p[0] | p[1] << 8;
+	}
+
+	static uint32_t get32(const uint8_t *p) {
+		return get16(p) | (uint32_t)get16(p + 2) << 16;
+	}
+
+	FILE *f = NULL;
+	unsigned sample_rate = 0;
+	unsigned channels = 0;
+	uint64_t remaining = 0;
+	std::vector<int16_t> buffer;
+};
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ *    WaveTx.h
+ *
+ *    Hardware-timed transmission of CW elements using DMA waveforms.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __WAVE_TX_H
+#define __WAVE_TX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "Elements.h"
+#include "GpioBackend.h"
+
+using namespace KK5JY::CW;
+
+// How often WaveTx checks for a cancel while a chain plays
+const auto WAVE_CANCEL_POLL = std::chrono::milliseconds(10);
+
+// Transmits a sequence of elements by letting the GPIO backend play
+// them as waveforms, instead of switching outputs from software. Each
+// distinct mark length is compiled into a waveform once. It generates
+// both the tone on the speaker and a PWM signal on the coil. A message
+// is then a chain that plays those waves separated by delays. Element
+// timing is as accurate as the DMA hardware, and the only CPU time
+// needed is for building the chain.
+//
+// Because the tone and coil PWM are generated by the waveform, the
+// speaker and coil pins must be plain outputs (not running PWM) while
+// transmitting.
+class WaveTx {
+public:
+	WaveTx(GpioBackend *gpio, unsigned coil_pin, unsigned speaker_pin, unsigned tone_freq, float coil_duty)
+		: gpio(gpio), coil_pin(coil_pin), speaker_pin(speaker_pin),
+		  coil_mask(1 << coil_pin), speaker_mask(1 << speaker_pin),
+		  tone_freq(tone_freq), coil_duty(coil_duty) {
+	}
+
+	~WaveTx() {
+		clear_cache();
+	}
+
+	// Transmit the given elements (with lengths in µs), returns when
+	// the hardware is done. When given, cancelled is checked every
+	// WAVE_CANCEL_POLL while the hardware plays, and when it returns true,
+	// the chain is stopped halfway, with the coil and speaker off.
+	bool send(const std::vector<CwElement> &elements, std::function<bool()> cancelled = nullptr) {
+		// Make sure all needed waves exist before starting, since
+		// waves cannot be created while a chain is running. If that
+		// fails, waveform memory is probably full, so throw away
+		// the cached waves and try again.
+		std::set<uint32_t> lengths;
+		for (const CwElement &e : elements) {
+			if (e.Mark)
+				lengths.insert(e.Length);
+		}
+		if (marks.size() + lengths.size() > MAX_CACHED_MARKS || !create_marks(lengths)) {
+			clear_cache();
+			if (!create_marks(lengths)) {
+				fprintf(stderr, "Failed to create TX waveforms\n");
+				return false;
+			}
+		}
+
+		std::vector<char> chain;
+		uint32_t chain_duration = 0;
+		uint32_t delay = 0;
+		for (const CwElement &e : elements) {
+			if (!e.Mark) {
+				delay += e.Length;
+				continue;
+			}
+
+			// Split the chain when it gets too long, but only
+			// before a mark. The time needed to start the next
+			// chain then only makes the preceding space a bit
+			// longer.
+			size_t needed = 1 + 4 * (delay / WAVE_CHAIN_MAX_DELAY + 1);
+			if (chain.size() + needed > WAVE_CHAIN_MAX_LENGTH) {
+				if (!play(chain, chain_duration, cancelled))
+					return false;
+				if (cancelled && cancelled())
+					return true;
+				chain.clear();
+				chain_duration = 0;
+			}
+			chain_duration += add_delay(chain, delay);
+			delay = 0;
+
+			chain.push_back(marks[e.Length]);
+			chain_duration += e.Length;
+		}
+
+		// A trailing space can be long (a word space), so it might
+		// need a chain of its own as well
+		if (chain.size() + 4 * (delay / WAVE_CHAIN_MAX_DELAY + 1) > WAVE_CHAIN_MAX_LENGTH) {
+			if (!play(chain, chain_duration, cancelled))
+				return false;
+			if (cancelled && cancelled())
+				return true;
+			chain.clear();
+			chain_duration = 0;
+		}
+		chain_duration += add_delay(chain, delay);
+		return play(chain, chain_duration, cancelled);
+	}
+
+private:
+	// Maximum number of distinct mark waves to keep around. Normally,
+	// there are only two (dot and dash), but more when the TX speed
+	// is set automatically.
+	static const size_t MAX_CACHED_MARKS = 8;
+
+	// Append delay commands to the chain, returns the total delay
+	uint32_t add_delay(std::vector<char> &chain, uint32_t delay) {
+		uint32_t total = delay;
+		while (delay) {
+			uint32_t d = std::min(delay, WAVE_CHAIN_MAX_DELAY);
+			chain.push_back(WAVE_CHAIN_CMD);
+			chain.push_back(WAVE_CHAIN_DELAY);
+			chain.push_back(d & 0xff);
+			chain.push_back(d >> 8);
+			delay -= d;
+		}
+		return total;
+	}
+
+	// Start the chain and wait for it to complete, or stop it when
+	// cancelled. Sleeps for most of the expected duration, so only the
+	// last bit needs polling the hardware.
+	bool play(const std::vector<char> &chain, uint32_t duration, const std::function<bool()> &cancelled) {
+		using clock = std::chrono::steady_clock;
+		if (chain.empty())
+			return true;
+		if (!gpio->wave_chain(chain)) {
+			fprintf(stderr, "Failed to start waveform chain\n");
+			return false;
+		}
+		const auto margin = std::chrono::microseconds(2000);
+		clock::time_point end = clock::now() + std::chrono::microseconds(duration) - margin;
+		while (true) {
+			if (cancelled && cancelled()) {
+				// Stopping leaves the outputs as they are
+				gpio->wave_tx_stop();
+				gpio->write(coil_pin, 0);
+				gpio->write(speaker_pin, 0);
+				return true;
+			}
+			clock::time_point now = clock::now();
+			if (now < end) {
+				std::this_thread::sleep_for(std::min<clock::duration>(end - now, WAVE_CANCEL_POLL));
+			} else if (gpio->wave_busy()) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			} else {
+				return true;
+			}
+		}
+	}
+
+	// Make sure a wave exists for each of the given mark lengths (µs)
+	bool create_marks(const std::set<uint32_t> &lengths) {
+		for (uint32_t length : lengths) {
+			if (marks.count(length))
+				continue;
+			int id = gpio->wave_create(compile_mark(length));
+			if (id < 0)
+				return false;
+			marks[length] = id;
+		}
+		return true;
+	}
+
+	void clear_cache() {
+		for (auto &m : marks)
+			gpio->wave_delete(m.second);
+		marks.clear();
+	}
+
+	// Generate the pulses for a mark: a square wave tone on the
+	// speaker, and the coil switched on for coil_duty of every half
+	// tone period. Half period boundaries are computed from the start
+	// of the mark, so rounding does not accumulate.
+	std::vector<GpioPulse> compile_mark(uint32_t length) {
+		std::vector<GpioPulse> pulses;
+		uint32_t half_period = 1000000 / (2 * tone_freq);
+		uint32_t on_time = half_period * coil_duty;
+		bool speaker_high = false;
+		uint32_t t = 0;
+		for (uint64_t k = 1; t < length; ++k) {
+			uint32_t next = std::min<uint64_t>(k * 1000000 / (2 * tone_freq), length);
+			uint32_t on = std::min(on_time, next - t);
+
+			speaker_high = !speaker_high;
+			GpioPulse p = {coil_mask, 0, on};
+			if (speaker_high)
+				p.on_mask |= speaker_mask;
+			else
+				p.off_mask |= speaker_mask;
+			pulses.push_back(p);
+
+			if (next - t > on)
+				pulses.push_back({0, coil_mask, next - t - on});
+			t = next;
+		}
+		pulses.push_back({0, coil_mask | speaker_mask, 0});
+		return pulses;
+	}
+
+	GpioBackend *gpio;
+	unsigned coil_pin;
+	unsigned speaker_pin;
+	uint32_t coil_mask;
+	uint32_t speaker_mask;
+	unsigned tone_freq;
+	float coil_duty;
+
+	// Mark length (µs) to wave id
+	std::map<uint32_t, int> marks;
+};
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ *    WordCorrector.h
+ *
+ *    Decodes classified elements a word at a time, and replaces words
+ *    that are not in a dictionary by the closest one that is.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ */
+
+#ifndef __WORD_CORRECTOR_H
+#define __WORD_CORRECTOR_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+#include "CwDecoderLogic.h"
+#include "Elements.h"
+#include "MorseDictionary.h"
+
+using namespace KK5JY::CW;
+
+// Words of more characters are passed on as they are, in pieces
+const unsigned CORRECTOR_WORD_MAX = 24;
+
+// Trie nodes visited per word at most. A node takes about 0.1 µs in a
+// dictionary of half a million callsigns (mostly waiting for memory),
+// so this keeps a correction around a ms at worst, while a typical one
+// visits a few hundred nodes (see telegraph-bench dict).
+const unsigned CORRECTOR_BUDGET = 10000;
+
+// A snapshot of the counters of a WordCorrector
+struct WordCorrectorStats {
+	unsigned words = 0;
+	// In the dictionary as received
+	unsigned exact = 0;
+	unsigned corrected = 0;
+	// Not corrected, because several words were equally close
+	unsigned ambiguous = 0;
+	// Not corrected, because the search took too long
+	unsigned over_budget = 0;
+};
+
+// Sits between the timing logic and the text output, in place of
+// CwDecoderLogic::DecodeElement(). Text is held back until the word
+// ends, then passed on, or replaced by the only dictionary word within
+// max_distance() of what was received. The distance is counted in Morse
+// elements (see MorseDictionary::nearest()), so a character split in
+// two or two run together, or a dot taken for a dash, is one step away
+// from the intended word, no matter how different the letters look.
+class WordCorrector {
+public:
+	WordCorrector(const MorseDictionary &dictionary) : dictionary(dictionary) {
+		word.reserve(CORRECTOR_WORD_MAX + 1);
+		out.reserve(256);
+	}
+
+	// Nodes visited per word at most
+	unsigned budget = CORRECTOR_BUDGET;
+
+	// Pass on the next element. Returns the text to pass on: NULL until
+	// the word ends (or gets too long), then the (corrected) word with
+	// a space.
+	const char *add(MorseElements element) {
+		char chars[2];
+		int n = decoder.DecodeElement(element, chars);
+		switch (element) {
+			case Dot:
+			case Dash:
+				// Past MORSE_KEY_MAX, key_len only marks the key as
+				// too long
+				if (key_len < MORSE_KEY_MAX)
+					key[key_len] = element == Dot ? '.' : '-';
+				if (key_len <= MORSE_KEY_MAX)
+					key_len++;
+				break;
+			case DashSpace:
+				if (key_len && key_len < MORSE_KEY_MAX && key[key_len - 1] != ' ')
+					key[key_len++] = ' ';
+				break;
+			default:
+				break;
+		}
+		for (int i = 0; i < n; ++i) {
+			if (chars[i] != ' ')
+				word += chars[i];
+		}
+
+		if (element == WordSpace)
+			return end_word();
+
+		// Too long to correct, pass on what there is so far
+		if (word.size() >= CORRECTOR_WORD_MAX) {
+			out = word;
+			word.clear();
+			key_len = MORSE_KEY_MAX + 1;
+			return out.c_str();
+		}
+		return NULL;
+	}
+
+	// The transmission ended, pass on the word in progress
+	const char *end() {
+		return add(WordSpace);
+	}
+
+	// Largest edit distance corrected for a key of this many elements
+	// and character spaces. Short words have too many neighbours to
+	// pick one, and would hardly be recognizable with two of their
+	// elements changed.
+	static unsigned max_distance(size_t key_len) {
+		return key_len < 8 ? 0 : key_len < 16 ? 1 : 2;
+	}
+
+	// Safe to call from any thread while another one adds elements
+	WordCorrectorStats get_stats() const {
+		WordCorrectorStats s;
+		s.words = counters.words.load(std::memory_order_relaxed);
+		s.exact = counters.exact.load(std::memory_order_relaxed);
+		s.corrected = counters.corrected.load(std::memory_order_relaxed);
+		s.ambiguous = counters.ambiguous.load(std::memory_order_relaxed);
+		s.over_budget = counters.over_budget.load(std::memory_order_relaxed);
+		return s;
+	}
+
+private:
+	const char *end_word() {
+		if (key_len && key_len <= MORSE_KEY_MAX && key[key_len - 1] == ' ')
+			key_len--;
+		out.clear();
+		if (key_len && key_len <= MORSE_KEY_MAX) {
+			counters.words.fetch_add(1, std::memory_order_relaxed);
+			correct();
+		} else {
+			out = word;
+		}
+		word.clear();
+		key_len = 0;
+		if (out.empty())
+			return NULL;
+		out += ' ';
+		return out.c_str();
+	}
+
+	// Put the word, or its correction, in out
+	void correct() {
+		const char *exact = dictionary.find(key, key_len);
+		if (exact) {
+			counters.exact.fetch_add(1, std::memory_order_relaxed);
+			// Prosigns without a character come out as the error
+			// symbol otherwise
+			out = exact;
+			return;
+		}
+		out = word;
+		unsigned distance = max_distance(key_len);
+		if (!distance)
+			return;
+		MorseMatch match;
+		if (!dictionary.nearest(key, key_len, distance, budget, match)) {
+			counters.over_budget.fetch_add(1, std::memory_order_relaxed);
+		} else if (match.word && match.count == 1) {
+			counters.corrected.fetch_add(1, std::memory_order_relaxed);
+			out = match.word;
+		} else if (match.count > 1) {
+			counters.ambiguous.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	const MorseDictionary &dictionary;
+	CwDecoderLogic decoder;
+
+	// The word so far, as decoded and as key
+	std::string word;
+	char key[MORSE_KEY_MAX];
+	size_t key_len = 0;
+
+	std::string out;
+	// See WordCorrectorStats
+	struct {
+		std::atomic<unsigned> words{0};
+		std::atomic<unsigned> exact{0};
+		std::atomic<unsigned> corrected{0};
+		std::atomic<unsigned> ambiguous{0};
+		std::atomic<unsigned> over_budget{0};
+	} counters;
+};
+
+#endif
@@ -0,0 +1,979 @@
+/*
+ *    Benchmarks for the RX decoding logic, using generated keying.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ * lock: an operator keys some text at one speed, pauses, and then
+ * another operator continues at another speed. For each speed estimator,
+ * this reports how many elements (and how much time) after the change it
+ * takes before the estimated dot length stays within LOCK_TOLERANCE of
+ * the real one, and the character error rate of the text after the
+ * change.
+ *
+ * beam: character error rate and CPU time per element of the normal
+ * decoder and of the beam decoder at several beam widths, for keying
+ * with increasing amounts of jitter. Both get the right dot length, so
+ * only the decisions differ.
+ *
+ * micro: time per operation of the building blocks on their own:
+ * CwTimingLogic::Decode on generated keying, CwDecoderLogic Decode,
+ * DecodeElement and Encode on every character, the operations of both
+ * circular buffers, and CwReceiver::Pulse end to end. Every result is
+ * printed as one JSON object per line, for comparing before and after a
+ * change with a script:
+ *
+ *   {"benchmark": "timing.decode", "ns_per_op": 41.2, "min_ns_per_op": 40.8,
+ *    "max_ns_per_op": 43.0, "ops": 2480000, "reps": 5}
+ *
+ * ns_per_op is the median over the repetitions.
+ *
+ * tx: how late the edges of a continuous TX timeline are, sleeping with
+ * std::this_thread::sleep_until (like the controller by default) and
+ * with sleep_until_deadline at real-time priority (like the controller
+ * with -x), on an otherwise idle system and with a busy thread on every
+ * CPU. Real-time priority needs privileges, without them the deadline
+ * sleeper runs at normal priority and says so.
+ *
+ * ensemble: character error rate, wall time and CPU time per element of
+ * the default CwEnsemble, with its members spread over increasing
+ * numbers of extra threads, and the p99 of the time add() takes. The
+ * extra threads only pay off when there are CPUs left for them.
+ *
+ * dict: builds a dictionary of DICT_CALLSIGNS random callsigns plus
+ * dictionary.txt (when found), compiles it to a file and maps it back in,
+ * and times exact lookups and corrections of words with one and two
+ * random element errors, as the WordCorrector does them: lookups per
+ * second, the p99 and worst time, how often the search ran out of its
+ * budget and how often the intended word came out. It then feeds a
+ * WordCorrector runs of marks longer than any key, and checks that the
+ * word after each one is still corrected.
+ *
+ * acquire: RX edges of a clean and a bouncing key, written in real time
+ * as pigpio notification reports to a pipe, the reports of every
+ * ACQUIRE_WRITE_PERIOD at once, and passed from a reader thread to a
+ * decoder thread like the controller does: with a ring push and
+ * semaphore post per edge (as from the pigpiod_if2 callback) and per
+ * read of the pipe (-p). Reports the CPU time of the reader and decoder
+ * per edge, how often the decoder thread woke up to decode and how
+ * often it woke up to find nothing left. Takes a few seconds per run.
+ *
+ * Pass benchmark names to run only those.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <semaphore.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CwBeamDecoder.h"
+#include "CwReceiver.h"
+#include "FistGenerator.h"
+#include "GpioReports.h"
+#include "SpscRing.h"
+#include "Realtime.h"
+
+// Relative standard deviation of generated element lengths, for lock
+const double JITTER = 0.1;
+
+// Maximum relative error of a locked dot length estimate
+const double LOCK_TOLERANCE = 0.2;
+
+// Pause between the transmissions, in dots. The controller's watchdog
+// ends a transmission after this.
+const double PAUSE = 15;
+
+const unsigned TRIALS = 50;
+
+// Every microbenchmark runs MICRO_REPS times, each for at least
+// MICRO_MIN_TIME seconds
+const unsigned MICRO_REPS = 5;
+const double MICRO_MIN_TIME = 0.1;
+
+// Every tx run schedules an edge every TX_ELEMENT for TX_TIME, at the
+// priority the controller uses with -x (TX_PRIORITY)
+const auto TX_TIME = std::chrono::seconds(1);
+const auto TX_ELEMENT = std::chrono::milliseconds(2);
+
+// Size of the dictionary for dict, and the words looked up in it
+const unsigned DICT_CALLSIGNS = 500000;
+const unsigned DICT_QUERIES = 20000;
+
+// For acquire, a bouncing key contact bounces ACQUIRE_BOUNCES times,
+// ACQUIRE_BOUNCE_TIME µs apart on average, on every press and release
+const unsigned ACQUIRE_BOUNCES = 8;
+const uint32_t ACQUIRE_BOUNCE_TIME = 150;
+const unsigned ACQUIRE_KEY_PIN = 17;
+const auto ACQUIRE_WRITE_PERIOD = std::chrono::milliseconds(1);
+
+// Generate the elements for keying text at the given dot length (µs),
+// with the standard 1:3:7 spacing and the given jitter (relative
+// standard deviation) on every element. This is FistGenerator's keying,
+// as elements instead of edges. A space at the end of the text adds a
+// word space, to end the last word.
+std::vector<CwElement> key_text(const std::string &text, double dot, double jitter_sd, std::mt19937 &rng) {
+	FistParams params;
+	params.wpm = CwTimingLogic::DotLengthAtOneWpm / dot;
+	params.jitter = jitter_sd;
+	FistGenerator fist(params, rng());
+	FistTimeline timeline = fist.generate(text);
+
+	std::vector<CwElement> elements;
+	for (size_t i = 0; i + 1 < timeline.edges.size(); ++i) {
+		CwElement e;
+		e.Mark = timeline.edges[i].level == GPIO_LOW;
+		e.Length = timeline.edges[i + 1].time - timeline.edges[i].time;
+		elements.push_back(e);
+	}
+	if (!text.empty() && text.back() == ' ') {
+		std::normal_distribution<double> jitter(1.0, jitter_sd);
+		CwElement e;
+		e.Mark = false;
+		e.Length = std::max(1.0, 7 * dot * jitter(rng));
+		elements.push_back(e);
+	}
+	return elements;
+}
+
+// Levenshtein distance
+unsigned edit_distance(const std::string &a, const std::string &b) {
+	std::vector<unsigned> row(b.size() + 1);
+	for (size_t j = 0; j <= b.size(); ++j)
+		row[j] = j;
+	for (size_t i = 1; i <= a.size(); ++i) {
+		unsigned diag = row[0];
+		row[0] = i;
+		for (size_t j = 1; j <= b.size(); ++j) {
+			unsigned next = std::min({row[j] + 1, row[j - 1] + 1, diag + (a[i - 1] != b[j - 1])});
+			diag = row[j];
+			row[j] = next;
+		}
+	}
+	return row[b.size()];
+}
+
+// Trim spaces on both ends
+std::string trim(const std::string &s) {
+	size_t start = s.find_first_not_of(' ');
+	if (start == std::string::npos)
+		return "";
+	return s.substr(start, s.find_last_not_of(' ') - start + 1);
+}
+
+struct LockResult {
+	// Elements and ms after the speed change until locked, elements
+	// is -1 when it never locked
+	int elements;
+	double ms;
+	double cer;
+};
+
+LockResult run_lock(SpeedEstimators estimator, unsigned wpm_from, unsigned wpm_to,
+                    const std::string &text, unsigned seed) {
+	std::mt19937 rng(seed);
+	double dot_from = CwTimingLogic::DotLengthAtOneWpm / wpm_from;
+	double dot_to = CwTimingLogic::DotLengthAtOneWpm / wpm_to;
+
+	// The generated keying has standard spacing, so this uses the
+	// default timing limits rather than the lenient ones of the
+	// controller.
+	CwTimingLogic timing;
+	CwDecoderLogic decoder;
+	timing.RxWPM(wpm_from);
+	timing.RxMode(SpeedAuto);
+	timing.Estimator(estimator);
+	CwReceiver receiver(timing, decoder, NULL, 0);
+	std::string decoded;
+	receiver.on_text = [&decoded](const char *t) { decoded += t; };
+
+	// Warm up at the first speed, then pause
+	for (const CwElement &e : key_text("CQ CQ DE PARIS PARIS ", dot_from, JITTER, rng))
+		receiver.Pulse(e.Length, e.Mark);
+	receiver.Pulse(PAUSE * dot_from, false);
+	decoded.clear();
+
+	std::vector<CwElement> elements = key_text(text + " ", dot_to, JITTER, rng);
+	LockResult result = {-1, 0, 0};
+	double elapsed = 0;
+	for (size_t i = 0; i < elements.size(); ++i) {
+		receiver.Pulse(elements[i].Length, elements[i].Mark);
+		elapsed += elements[i].Length;
+		if (fabs(timing.DotLength() / dot_to - 1) > LOCK_TOLERANCE) {
+			result.elements = -1;
+		} else if (result.elements < 0) {
+			result.elements = i + 1;
+			result.ms = elapsed / 1000;
+		}
+	}
+	receiver.Pulse(PAUSE * dot_to, false);
+
+	result.cer = (double)edit_distance(trim(decoded), text) / text.size();
+	return result;
+}
+
+void bench_lock() {
+	struct Case {
+		unsigned from, to;
+		const char *text;
+	};
+	const Case cases[] = {
+		{10, 20, "THE QUICK BROWN FOX"},
+		{20, 10, "THE QUICK BROWN FOX"},
+		{12, 25, "PARIS PARIS"},
+		{25, 12, "PARIS PARIS"},
+		{15, 15, "PARIS PARIS"},
+		// Runs of only dots, or only dashes
+		{10, 20, "HI HIS 5 SEES"},
+		{20, 10, "HI HIS 5 SEES"},
+		{10, 20, "TOM MOM 0 OTTO"},
+		{20, 10, "TOM MOM 0 OTTO"},
+	};
+	const struct {
+		SpeedEstimators estimator;
+		const char *name;
+	} estimators[] = {
+		{EstimatorBoxCar, "boxcar"},
+		{EstimatorCluster, "cluster"},
+	};
+
+	printf("Time to lock (median of %u trials, %.0f%% jitter, within %.0f%%)\n",
+	       TRIALS, JITTER * 100, LOCK_TOLERANCE * 100);
+	printf("%-8s %-9s %-16s %9s %9s %8s %7s\n", "wpm", "estimator", "text", "elements", "ms", "unlocked", "cer");
+	for (const Case &c : cases) {
+		for (auto &est : estimators) {
+			std::vector<int> elements;
+			std::vector<double> ms;
+			unsigned unlocked = 0;
+			double cer = 0;
+			for (unsigned trial = 0; trial < TRIALS; ++trial) {
+				LockResult r = run_lock(est.estimator, c.from, c.to, c.text, trial);
+				cer += r.cer;
+				if (r.elements < 0) {
+					unlocked++;
+					continue;
+				}
+				elements.push_back(r.elements);
+				ms.push_back(r.ms);
+			}
+			char wpm[16];
+			snprintf(wpm, sizeof(wpm), "%u->%u", c.from, c.to);
+			printf("%-8s %-9s %-16s ", wpm, est.name, c.text);
+			if (elements.empty()) {
+				printf("%9s %9s ", "-", "-");
+			} else {
+				std::sort(elements.begin(), elements.end());
+				std::sort(ms.begin(), ms.end());
+				printf("%9d %9.0f ", elements[elements.size() / 2], ms[ms.size() / 2]);
+			}
+			printf("%8u %6.1f%%\n", unlocked, cer / TRIALS * 100);
+		}
+	}
+}
+
+// Decode with the normal decoder, returns the text
+std::string decode_normal(const std::vector<CwElement> &elements, unsigned wpm, double &ns) {
+	using clock = std::chrono::steady_clock;
+	CwTimingLogic timing;
+	CwDecoderLogic decoder;
+	timing.RxWPM(wpm);
+	CwReceiver receiver(timing, decoder, NULL, 0);
+	std::string decoded;
+	receiver.on_text = [&decoded](const char *t) { decoded += t; };
+
+	clock::time_point start = clock::now();
+	for (const CwElement &e : elements)
+		receiver.Pulse(e.Length, e.Mark);
+	ns = std::chrono::duration<double, std::nano>(clock::now() - start).count() / elements.size();
+	return decoded;
+}
+
+// Decode with the beam decoder, returns the text
+std::string decode_beam(const std::vector<CwElement> &elements, unsigned wpm, unsigned width,
+                        double &ns, double &p99_ns) {
+	using clock = std::chrono::steady_clock;
+	CwBeamDecoder beam(width);
+	std::string decoded;
+	BeamCharacter out[CwBeamDecoder::MaximumOutput];
+	float dot = CwTimingLogic::DotLengthAtOneWpm / wpm;
+
+	std::vector<double> times;
+	times.reserve(elements.size());
+	clock::time_point start = clock::now();
+	for (const CwElement &e : elements) {
+		clock::time_point before = clock::now();
+		int n = beam.Decode(e, dot, out);
+		times.push_back(std::chrono::duration<double, std::nano>(clock::now() - before).count());
+		for (int i = 0; i < n; ++i)
+			decoded += out[i].Value;
+	}
+	ns = std::chrono::duration<double, std::nano>(clock::now() - start).count() / elements.size();
+	std::sort(times.begin(), times.end());
+	p99_ns = times[times.size() * 99 / 100];
+	return decoded;
+}
+
+void bench_beam() {
+	const unsigned wpm = 20;
+	const double jitters[] = {0.1, 0.2, 0.3};
+	const unsigned widths[] = {4, 8, 16, 32};
+	std::string text;
+	for (unsigned i = 0; i < 20; ++i)
+		text += "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG 0123456789 CQ DE PA3ABC K ";
+	text = trim(text);
+
+	printf("Beam decoder (%u wpm, %zu characters)\n", wpm, text.size());
+	printf("%-7s %-8s %7s %9s %9s\n", "jitter", "decoder", "cer", "ns/elem", "p99 ns");
+	for (double jitter : jitters) {
+		std::mt19937 rng(1);
+		std::vector<CwElement> elements = key_text(text + " ", CwTimingLogic::DotLengthAtOneWpm / wpm, jitter, rng);
+		double ns, p99_ns;
+		std::string normal = trim(decode_normal(elements, wpm, ns));
+		printf("%-7.0f %-8s %6.1f%% %9.0f %9s\n", jitter * 100, "normal",
+		       100.0 * edit_distance(normal, text) / text.size(), ns, "-");
+		for (unsigned width : widths) {
+			std::string beam = trim(decode_beam(elements, wpm, width, ns, p99_ns));
+			char name[16];
+			snprintf(name, sizeof(name), "beam%u", width);
+			printf("%-7.0f %-8s %6.1f%% %9.0f %9.0f\n", jitter * 100, name,
+			       100.0 * edit_distance(beam, text) / text.size(), ns, p99_ns);
+		}
+	}
+}
+
+// Results of the microbenchmarks end up here, so the compiler cannot
+// leave out the work
+volatile uint64_t sink;
+
+// Call run() until MICRO_MIN_TIME has passed, MICRO_REPS times, and
+// print the time per operation. Every call of run() does ops operations.
+template <typename F>
+void micro(const char *name, size_t ops, F run) {
+	using clock = std::chrono::steady_clock;
+	std::vector<double> ns;
+	uint64_t total = 0;
+	for (unsigned rep = 0; rep < MICRO_REPS; ++rep) {
+		uint64_t count = 0;
+		double elapsed;
+		clock::time_point start = clock::now();
+		do {
+			run();
+			count += ops;
+			elapsed = std::chrono::duration<double>(clock::now() - start).count();
+		} while (elapsed < MICRO_MIN_TIME);
+		ns.push_back(elapsed * 1e9 / count);
+		total += count;
+	}
+	std::sort(ns.begin(), ns.end());
+	printf("{\"benchmark\": \"%s\", \"ns_per_op\": %.2f, \"min_ns_per_op\": %.2f, "
+	       "\"max_ns_per_op\": %.2f, \"ops\": %llu, \"reps\": %u}\n",
+	       name, ns[ns.size() / 2], ns.front(), ns.back(), (unsigned long long)total, MICRO_REPS);
+	fflush(stdout);
+}
+
+template <typename Buffer>
+void micro_buffer(const char *kind, Buffer &buffer) {
+	const int FILL = 16;
+	const int OPS = 1024;
+	char name[64];
+	CwElement e;
+	e.Mark = true;
+
+	// Add and remove, with the buffer half full
+	buffer.Clear();
+	for (int i = 0; i < FILL; ++i)
+		buffer.Add(e);
+	snprintf(name, sizeof(name), "%s.add_remove", kind);
+	micro(name, OPS, [&]() {
+		CwElement out;
+		uint64_t sum = 0;
+		for (int i = 0; i < OPS; ++i) {
+			e.Length = i;
+			buffer.Add(e);
+			buffer.Remove(out);
+			sum += out.Length;
+		}
+		sink = sum;
+	});
+
+	// Read every item, like the decoder scanning a character
+	snprintf(name, sizeof(name), "%s.item_at", kind);
+	micro(name, OPS * FILL, [&]() {
+		uint64_t sum = 0;
+		for (int i = 0; i < OPS; ++i) {
+			for (int j = 0; j < FILL; ++j)
+				sum += buffer.ItemAt(j).Length;
+		}
+		sink = sum;
+	});
+
+	// Fill up and drop a character's worth at a time
+	snprintf(name, sizeof(name), "%s.remove_items", kind);
+	micro(name, OPS, [&]() {
+		uint64_t sum = 0;
+		for (int i = 0; i < OPS; i += 4) {
+			for (int j = 0; j < 4; ++j)
+				buffer.Add(e);
+			sum += buffer.RemoveItems(4);
+		}
+		sink = sum;
+	});
+}
+
+void bench_micro() {
+	const unsigned wpm = 20;
+	std::string text;
+	for (unsigned i = 0; i < 20; ++i)
+		text += "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG 0123456789 CQ DE PA3ABC K ";
+	std::mt19937 rng(1);
+	std::vector<CwElement> elements = key_text(text, CwTimingLogic::DotLengthAtOneWpm / wpm, JITTER, rng);
+
+	// Every character the decoder knows, with its elements
+	CwDecoderLogic decoder;
+	std::string chars;
+	std::vector<MorseElements> encoded;
+	for (int ch = 33; ch < 127; ++ch) {
+		std::queue<MorseElements> elems;
+		decoder.Encode(ch, elems);
+		if (elems.empty())
+			continue;
+		chars += ch;
+		for (; !elems.empty(); elems.pop())
+			encoded.push_back(elems.front());
+	}
+
+	const struct {
+		SpeedEstimators estimator;
+		const char *name;
+	} estimators[] = {
+		{EstimatorBoxCar, "timing.decode"},
+		{EstimatorCluster, "timing.decode_cluster"},
+	};
+	for (auto &est : estimators) {
+		CwTimingLogic timing;
+		timing.RxWPM(wpm);
+		timing.RxMode(SpeedAuto);
+		timing.Estimator(est.estimator);
+		StaticCircularBuffer<CwElement, 32> raw;
+		StaticCircularBuffer<MorseElements, 32> result;
+		micro(est.name, elements.size(), [&]() {
+			uint64_t count = 0;
+			for (const CwElement &e : elements) {
+				raw.Add(e);
+				timing.Decode(raw, result);
+				count += result.RemoveItems(32);
+			}
+			sink = count;
+		});
+	}
+
+	StaticCircularBuffer<MorseElements, 32> rx;
+	micro("decoder.decode", chars.size(), [&]() {
+		char out[8];
+		uint64_t count = 0;
+		for (size_t i = 0; i < encoded.size(); ) {
+			// One character at a time, like the RX path delivers them
+			size_t end = std::find(encoded.begin() + i, encoded.end(), DashSpace) - encoded.begin() + 1;
+			rx.AddItems(&encoded[i], end - i);
+			count += decoder.Decode(rx, out, sizeof(out));
+			i = end;
+		}
+		sink = count;
+	});
+
+	micro("decoder.decode_element", chars.size(), [&]() {
+		char out[2];
+		uint64_t count = 0;
+		for (MorseElements e : encoded)
+			count += decoder.DecodeElement(e, out);
+		sink = count;
+	});
+
+	micro("decoder.encode", chars.size(), [&]() {
+		std::queue<MorseElements> elems;
+		uint64_t count = 0;
+		for (char ch : chars) {
+			decoder.Encode(ch, elems);
+			count += elems.size();
+			elems = std::queue<MorseElements>();
+		}
+		sink = count;
+	});
+
+	CircularBuffer<CwElement> dynamic(32);
+	micro_buffer("buffer", dynamic);
+	StaticCircularBuffer<CwElement, 32> fixed;
+	micro_buffer("static_buffer", fixed);
+
+	CwTimingLogic timing;
+	timing.RxWPM(wpm);
+	timing.RxMode(SpeedAuto);
+	CwReceiver receiver(timing, decoder, NULL, 0);
+	uint64_t decoded = 0;
+	receiver.on_text = [&decoded](const char *t) { decoded += strlen(t); };
+	micro("receiver.pulse", elements.size(), [&]() {
+		for (const CwElement &e : elements)
+			receiver.Pulse(e.Length, e.Mark);
+		sink = decoded;
+	});
+}
+
+void bench_ensemble() {
+	using clock = std::chrono::steady_clock;
+	const unsigned wpm = 20;
+	std::string text;
+	for (unsigned i = 0; i < 20; ++i)
+		text += "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG 0123456789 CQ DE PA3ABC K ";
+	text = trim(text);
+	std::mt19937 rng(1);
+	std::vector<CwElement> elements = key_text(text + " ", CwTimingLogic::DotLengthAtOneWpm / wpm, JITTER, rng);
+
+	size_t members = default_ensemble().size();
+	printf("Ensemble of %zu decoders (%u wpm, %zu elements, %u CPUs)\n", members, wpm,
+	       elements.size(), std::thread::hardware_concurrency());
+	printf("%-8s %7s %9s %9s %9s\n", "threads", "cer", "ns/elem", "cpu ns", "p99 ns");
+	for (unsigned threads : {0U, 1U, 2U, (unsigned)members - 1}) {
+		CwEnsemble ensemble(default_ensemble(), wpm, threads);
+		std::string decoded;
+		ensemble.on_text = [&decoded](const char *t) { decoded += t; };
+
+		std::vector<double> times;
+		times.reserve(elements.size());
+		timespec cpu_start, cpu_end;
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+		clock::time_point start = clock::now();
+		for (const CwElement &e : elements) {
+			clock::time_point before = clock::now();
+			ensemble.add(e);
+			times.push_back(std::chrono::duration<double, std::nano>(clock::now() - before).count());
+		}
+		ensemble.end();
+		double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count() / elements.size();
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+		double cpu_ns = ((cpu_end.tv_sec - cpu_start.tv_sec) * 1e9 + (cpu_end.tv_nsec - cpu_start.tv_nsec)) / elements.size();
+		std::sort(times.begin(), times.end());
+		printf("%-8u %6.1f%% %9.0f %9.0f %9.0f\n", threads,
+		       100.0 * edit_distance(trim(decoded), text) / text.size(), ns, cpu_ns,
+		       times[times.size() * 99 / 100]);
+	}
+}
+
+// A random callsign: a prefix of one or two letters (or a digit and a
+// letter), a digit and one to three letters
+std::string random_callsign(std::mt19937 &rng) {
+	std::uniform_int_distribution<int> letter('A', 'Z'), digit('0', '9'), coin(0, 1), len(1, 3);
+	std::string call;
+	if (coin(rng)) {
+		call += letter(rng);
+		call += letter(rng);
+	} else {
+		call += coin(rng) ? (char)digit(rng) : (char)letter(rng);
+		call += letter(rng);
+	}
+	call += digit(rng);
+	for (int i = len(rng); i > 0; --i)
+		call += letter(rng);
+	return call;
+}
+
+// Make errors random changes to the elements of key: a dot for a dash
+// or the other way around, a lost or added element or character space
+std::string damage_key(std::string key, unsigned errors, std::mt19937 &rng) {
+	for (unsigned i = 0; i < errors; ++i) {
+		std::uniform_int_distribution<size_t> pos(0, key.size() - 1);
+		size_t p = pos(rng);
+		switch (std::uniform_int_distribution<int>(0, 2)(rng)) {
+			case 0:
+				if (key[p] != ' ')
+					key[p] = key[p] == '.' ? '-' : '.';
+				else
+					key.erase(p, 1);
+				break;
+			case 1:
+				key.erase(p, 1);
+				break;
+			default:
+				key.insert(p, 1, key[p] == ' ' ? '.' : ' ');
+				break;
+		}
+	}
+	return key;
+}
+
+void bench_dict() {
+	using clock = std::chrono::steady_clock;
+	std::mt19937 rng(1);
+	std::vector<std::string> list;
+	MorseDictionary::read_words("dictionary.txt", list);
+	for (unsigned i = 0; i < DICT_CALLSIGNS; ++i)
+		list.push_back(random_callsign(rng));
+
+	clock::time_point start = clock::now();
+	MorseDictionary built;
+	built.build(list);
+	double build_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+	char path[] = "/tmp/telegraph-bench-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return;
+	}
+	close(fd);
+	built.save(path);
+	MorseDictionary dictionary;
+	start = clock::now();
+	bool loaded = dictionary.load(path);
+	double load_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+	struct stat st;
+	stat(path, &st);
+	unlink(path);
+	if (!loaded)
+		return;
+	printf("Dictionary of %zu words, %zu nodes, %.1f MiB: built in %.0f ms, mapped in %.2f ms\n",
+	       dictionary.size(), dictionary.node_size(), st.st_size / 1048576.0, build_ms, load_ms);
+
+	std::vector<std::string> keys;
+	std::uniform_int_distribution<size_t> pick(0, list.size() - 1);
+	std::vector<size_t> picked;
+	for (unsigned i = 0; i < DICT_QUERIES; ++i) {
+		std::string key;
+		size_t w = pick(rng);
+		if (MorseDictionary::make_key(list[w].c_str(), key)) {
+			keys.push_back(key);
+			picked.push_back(w);
+		}
+	}
+
+	printf("%-8s %12s %9s %9s %9s %8s %8s\n", "errors", "lookups/s", "p99 us", "max us", "nodes", "budget", "right");
+	for (unsigned errors = 0; errors <= 2; ++errors) {
+		std::vector<double> times;
+		unsigned over_budget = 0, right = 0;
+		uint64_t visits = 0;
+		clock::time_point all = clock::now();
+		for (size_t i = 0; i < keys.size(); ++i) {
+			std::string key = damage_key(keys[i], errors, rng);
+			clock::time_point before = clock::now();
+			const char *word = dictionary.find(key.data(), key.size());
+			MorseMatch match;
+			if (!word) {
+				unsigned distance = WordCorrector::max_distance(key.size());
+				if (!dictionary.nearest(key.data(), key.size(), distance, CORRECTOR_BUDGET, match))
+					over_budget++;
+				else if (match.count == 1)
+					word = match.word;
+				visits += match.visits;
+			}
+			times.push_back(std::chrono::duration<double, std::micro>(clock::now() - before).count());
+			right += word && strcasecmp(word, list[picked[i]].c_str()) == 0;
+		}
+		double seconds = std::chrono::duration<double>(clock::now() - all).count();
+		std::sort(times.begin(), times.end());
+		printf("%-8u %12.0f %9.1f %9.1f %9.0f %7.1f%% %7.1f%%\n", errors, keys.size() / seconds,
+		       times[times.size() * 99 / 100], times.back(), (double)visits / keys.size(),
+		       100.0 * over_budget / keys.size(), 100.0 * right / keys.size());
+	}
+
+	// Garbled keying: runs of marks longer than any key, each followed
+	// by a word that must still be corrected. Run this under ASan or
+	// UBSan after changing WordCorrector.
+	WordCorrector corrector(dictionary);
+	CwDecoderLogic encoder;
+	std::uniform_int_distribution<unsigned> run_length(MORSE_KEY_MAX, 4 * MORSE_KEY_MAX);
+	std::uniform_int_distribution<int> coin(0, 1);
+	unsigned runs = 1000, corrected = 0;
+	uint64_t elements = 0;
+	clock::time_point garbled = clock::now();
+	for (unsigned i = 0; i < runs; ++i) {
+		for (unsigned n = run_length(rng); n > 0; --n, ++elements) {
+			corrector.add(coin(rng) ? Dot : Dash);
+			corrector.add(DotSpace);
+		}
+		corrector.add(WordSpace);
+
+		// THANMS, one element from THANKS
+		std::string out;
+		for (char ch : std::string("THANMS")) {
+			std::queue<MorseElements> elems;
+			encoder.Encode(ch, elems);
+			for (; !elems.empty(); elems.pop()) {
+				const char *text = corrector.add(elems.front());
+				if (text)
+					out += text;
+			}
+		}
+		const char *text = corrector.end();
+		if (text)
+			out += text;
+		corrected += out == "THANKS ";
+	}
+	double ns = std::chrono::duration<double, std::nano>(clock::now() - garbled).count() / elements;
+	printf("Garbled runs of %u-%u marks: %.0f ns per element, %u/%u following words corrected%s\n",
+	       MORSE_KEY_MAX, 4 * MORSE_KEY_MAX, ns, corrected, runs, corrected == runs ? "" : " FAILED");
+}
+
+// Runs the edges of one tx run on a new thread, returns how late each
+// one was in µs
+std::vector<double> tx_lateness(bool realtime, bool &got_realtime) {
+	std::vector<double> late;
+	std::thread t([&]() {
+		got_realtime = realtime && make_thread_realtime(TX_PRIORITY, 0, "");
+		using clock = std::chrono::steady_clock;
+		clock::time_point next = clock::now();
+		clock::time_point end = next + TX_TIME;
+		while (next < end) {
+			next += TX_ELEMENT;
+			if (realtime)
+				sleep_until_deadline(next, REALTIME_SPIN);
+			else
+				std::this_thread::sleep_until(next);
+			late.push_back(std::chrono::duration<double, std::micro>(clock::now() - next).count());
+		}
+	});
+	t.join();
+	return late;
+}
+
+void bench_tx() {
+	printf("%-10s %-6s %8s %8s %8s %8s\n", "sleep", "load", "edges", "p50 us", "p99 us", "max us");
+	for (bool loaded : {false, true}) {
+		std::atomic<bool> stop(false);
+		std::vector<std::thread> load;
+		if (loaded) {
+			for (unsigned i = 0; i < std::max(1U, std::thread::hardware_concurrency()); ++i)
+				load.emplace_back([&stop]() { while (!stop) /* spin */; });
+		}
+		for (bool realtime : {false, true}) {
+			bool got_realtime = false;
+			std::vector<double> late = tx_lateness(realtime, got_realtime);
+			std::sort(late.begin(), late.end());
+			const char *name = !realtime ? "normal" : got_realtime ? "realtime" : "deadline";
+			printf("%-10s %-6s %8zu %8.0f %8.0f %8.0f\n", name, loaded ? "busy" : "idle", late.size(),
+			       late[late.size() / 2], late[late.size() * 99 / 100], late.back());
+		}
+		stop = true;
+		for (std::thread &t : load)
+			t.join();
+	}
+}
+
+// Notification reports for keying the elements on ACQUIRE_KEY_PIN
+// (active low, like the controller's key), bouncing on every edge
+std::vector<GpioReport> key_reports(const std::vector<CwElement> &elements, unsigned bounces, std::mt19937 &rng) {
+	std::uniform_int_distribution<uint32_t> bounce(ACQUIRE_BOUNCE_TIME / 2, ACQUIRE_BOUNCE_TIME * 3 / 2);
+	std::vector<GpioReport> reports;
+	uint16_t seqno = 0;
+	uint32_t tick = 1000000;
+	const uint32_t up = 1U << ACQUIRE_KEY_PIN;
+	for (const CwElement &e : elements) {
+		uint32_t settled = e.Mark ? 0 : up;
+		uint32_t t = tick;
+		for (unsigned i = 0; i < bounces; ++i) {
+			reports.push_back({seqno++, 0, t, i % 2 ? up - settled : settled});
+			t += bounce(rng);
+		}
+		reports.push_back({seqno++, 0, t, settled});
+		tick += e.Length;
+	}
+	return reports;
+}
+
+struct AcquireResult {
+	size_t edges;
+	double cpu_ns;
+	unsigned wakeups;
+	unsigned empty_wakeups;
+	unsigned overflows;
+	std::string decoded;
+};
+
+// CPU time of the calling thread, in ns
+double thread_cpu_ns() {
+	timespec t;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+AcquireResult run_acquire(const std::vector<GpioReport> &reports, bool batched, unsigned wpm) {
+	using clock = std::chrono::steady_clock;
+	struct Event {
+		uint32_t tick;
+		unsigned level;
+	};
+	// The same size as the controller's
+	std::unique_ptr<SpscRing<Event, 1024>> ring(new SpscRing<Event, 1024>());
+	sem_t ready;
+	sem_init(&ready, 0, 0);
+	std::atomic<bool> done(false);
+	double reader_ns = 0, decoder_ns = 0;
+	AcquireResult result = {0, 0, 0, 0, 0, ""};
+
+	int fds[2];
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+
+	std::thread writer([&]() {
+		clock::time_point start = clock::now();
+		size_t i = 0;
+		while (i < reports.size()) {
+			auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start);
+			uint32_t until = reports[0].tick + elapsed.count();
+			size_t end = i;
+			while (end < reports.size() && (int32_t)(reports[end].tick - until) <= 0)
+				end++;
+			if (end > i && write(fds[1], &reports[i], (end - i) * sizeof(GpioReport)) < 0) {
+				perror("write");
+				exit(1);
+			}
+			i = end;
+			std::this_thread::sleep_for(ACQUIRE_WRITE_PERIOD);
+		}
+		close(fds[1]);
+	});
+
+	std::thread reader([&]() {
+		double cpu_start = thread_cpu_ns();
+		GpioReportParser parser(1U << ACQUIRE_KEY_PIN);
+		GpioReport buf[NOTIFY_BATCH];
+		std::vector<GpioEdge> batch;
+		ssize_t n;
+		while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+			parser.parse(buf, n / sizeof(GpioReport), 1U << ACQUIRE_KEY_PIN, [&](const GpioEdge &e) {
+				if (batched) {
+					batch.push_back(e);
+				} else if (ring->Push({e.tick, e.level})) {
+					sem_post(&ready);
+				}
+			});
+			bool pushed = false;
+			for (const GpioEdge &e : batch)
+				pushed |= ring->Push({e.tick, e.level});
+			if (pushed)
+				sem_post(&ready);
+			batch.clear();
+		}
+		close(fds[0]);
+		result.edges = parser.get_stats().edges;
+		done = true;
+		sem_post(&ready);
+		reader_ns = thread_cpu_ns() - cpu_start;
+	});
+
+	std::thread decoder([&]() {
+		double cpu_start = thread_cpu_ns();
+		CwTimingLogic timing;
+		CwDecoderLogic decoder;
+		timing.RxWPM(wpm);
+		timing.RxMode(SpeedAuto);
+		// Only for the watchdog, whose timeouts are not simulated
+		SimulatedGpio gpio;
+		gpio.recording = false;
+		CwReceiver receiver(timing, decoder, &gpio, ACQUIRE_KEY_PIN);
+		receiver.on_text = [&result](const char *t) { result.decoded += t; };
+		Event ev = {0, 0};
+		while (true) {
+			sem_wait(&ready);
+			bool finished = done;
+			unsigned edges = 0;
+			while (ring->Pop(ev)) {
+				receiver.process_edge(ev.level, ev.tick);
+				edges++;
+			}
+			if (edges)
+				result.wakeups++;
+			else
+				result.empty_wakeups++;
+			if (finished)
+				break;
+		}
+		// There is no watchdog to end the last word
+		receiver.process_edge(GPIO_TIMEOUT, ev.tick + 10000000);
+		decoder_ns = thread_cpu_ns() - cpu_start;
+	});
+
+	writer.join();
+	reader.join();
+	decoder.join();
+	sem_destroy(&ready);
+	result.cpu_ns = (reader_ns + decoder_ns) / result.edges;
+	result.overflows = ring->Overflows();
+	return result;
+}
+
+void bench_acquire() {
+	const unsigned wpm = 30;
+	const std::string text = "CQ DE PA3ABC";
+	std::mt19937 rng(1);
+	std::vector<CwElement> elements = key_text(text + " ", CwTimingLogic::DotLengthAtOneWpm / wpm, JITTER, rng);
+
+	printf("RX edge acquisition (%u wpm, %zu elements, %u CPUs)\n", wpm, elements.size(),
+	       std::thread::hardware_concurrency());
+	printf("%-8s %-9s %7s %9s %9s %9s %9s %7s\n", "bounces", "handoff", "edges", "cpu ns", "wakeups",
+	       "empty", "overflows", "cer");
+	for (unsigned bounces : {0U, ACQUIRE_BOUNCES}) {
+		std::vector<GpioReport> reports = key_reports(elements, bounces, rng);
+		for (bool batched : {false, true}) {
+			AcquireResult r = run_acquire(reports, batched, wpm);
+			printf("%-8u %-9s %7zu %9.0f %9u %9u %9u %6.1f%%\n", bounces,
+			       batched ? "per-read" : "per-edge", r.edges, r.cpu_ns, r.wakeups, r.empty_wakeups,
+			       r.overflows, 100.0 * edit_distance(trim(r.decoded), text) / text.size());
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	const struct {
+		const char *name;
+		void (*run)();
+	} benchmarks[] = {
+		{"lock", bench_lock},
+		{"beam", bench_beam},
+		{"micro", bench_micro},
+		{"tx", bench_tx},
+		{"ensemble", bench_ensemble},
+		{"dict", bench_dict},
+		{"acquire", bench_acquire},
+	};
+
+	for (auto &b : benchmarks) {
+		bool selected = argc < 2;
+		for (int i = 1; i < argc; ++i)
+			selected = selected || strcmp(argv[i], b.name) == 0;
+		if (selected) {
+			b.run();
+			printf("\n");
+		}
+	}
+	return 0;
+}
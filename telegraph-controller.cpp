@@ -26,11 +26,17 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <termios.h>
+#include <getopt.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <atomic>
 #include <chrono>
+#include <map>
+#include <mutex>
 #include <thread>
 using namespace std::chrono_literals;
 
-#include <pigpiod_if2.h>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 #include <hiredis/adapters/libev.h>
@@ -41,114 +47,530 @@ using namespace std::chrono_literals;
 #include "CircularBuffer.h"
 #include "CwTimingLogic.h"
 #include "CwDecoderLogic.h"
+#include "CwReceiver.h"
+#include "EdgeRecorder.h"
+#include "GpioBackend.h"
+#include "Histogram.h"
+#include "PigpiodGpio.h"
+#include "Realtime.h"
+#include "RedisPublisher.h"
+#include "SpscRing.h"
+#include "TxQueue.h"
+#include "StationConfig.h"
+#include "TimingState.h"
+#include "WaveTx.h"
 
 // import some namespaces
 using namespace KK5JY::Collections;
 using namespace KK5JY::CW;
 
-const uint32_t HW_PWM_MAX_DUTYCYCLE = 1E6;
-const uint32_t DMA_PWM_MAX_DUTYCYCLE = 256;
-
-const uint8_t STEPPER_DIR_PIN = 6;
-const uint8_t STEPPER_ENABLE_PIN = 26;
-const uint8_t STEPPER_STEP_PIN = 13; // PWM
 const uint32_t STEPPER_FREQ = 7000;
-const auto STEPPER_LEAD_IN = 100ms;
 const auto STEPPER_LEAD_OUT = 3500ms;
 
-const uint8_t COIL_PIN = 16;
 // Only specific frequencies are available for DMA-driven PWM
 const uint32_t COIL_FREQ = 8000;
 const uint8_t COIL_DUTYCYCLE = 0.3 * DMA_PWM_MAX_DUTYCYCLE;
 
-const uint8_t SPEAKER_PIN = 18; // PWM
-const uint32_t TONE_FREQ = 700;
+// When TX falls further behind its timeline than this (because the
+// system stalled), it continues from the current time instead of
+// squashing the elements that follow.
+const auto TX_MAX_LATE = 20ms;
+
+// With -b, text from the beam decoder is published on the publish topic
+// of the station with this suffix, as the text followed by a tab and the
+// confidence of every character.
+const char *BEAM_TOPIC_SUFFIX = ":beam";
+// Messages on the subscribe topic of a station with these suffixes are
+// sent before normal messages, or cancel the queued (and current)
+// messages with the same text (or all messages, when empty).
+const char *PRIORITY_TOPIC_SUFFIX = ":priority";
+const char *CANCEL_TOPIC_SUFFIX = ":cancel";
+
+GpioBackend *gpio = NULL;
+// Set when running against pigpiod, for its statistics
+PigpiodGpio *pigpiod = NULL;
+
+// Latency of the RX and TX stages of all stations, see dump_stats()
+LatencyHistogram EdgeLatency("rx_edge");	// edge callback -> picked up by decoder thread
+LatencyHistogram CharLatency("rx_char");	// end of last mark -> character decoded
+LatencyHistogram PublishLatency("rx_publish");	// character decoded -> PUBLISH acknowledged
+LatencyHistogram TxStartLatency("tx_start");	// message received -> first coil_on
+LatencyHistogram TxEdgeLatency("tx_edge");	// scheduled -> actual coil edge, per TX mark
+LatencyHistogram *Histograms[] = {&EdgeLatency, &CharLatency, &PublishLatency, &TxStartLatency, &TxEdgeLatency};
+
+// Statistics are periodically stored in this Redis hash, and optionally
+// written to stats_file.
+const auto STATS_INTERVAL = 60s;
+const char *STATS_KEY = "telegraph:stats";
+const char *stats_file = NULL;
+
+// Always-on recording of the last key edges and TX elements, to
+// investigate misdecodes after the fact using telegraph-replay. At a few
+// edges per second, this covers days of keying in 6MiB.
+const char *RECORDER_FILE = "/var/tmp/telegraph-edges.bin";
+const uint32_t RECORDER_CAPACITY = 262144;
+EdgeRecorder Recorder;
+
+// The learned timing of every station is saved here, and loaded again
+// at startup, so decoding after a restart does not start from scratch.
+// Timing is only snapshot at pauses in the keying, the file is written
+// when one of the snapshots changed.
+const char *STATE_FILE = "/var/tmp/telegraph-timing.state";
+const auto STATE_INTERVAL = 30s;
+
+// Publishes decoded text without blocking the decoder threads
+RedisPublisher Publisher("127.0.0.1", 6379);
 
-const uint8_t KEY_PIN = 17;
+using time_point = std::chrono::steady_clock::time_point;
 
-const char *PUBLISH_TOPIC = "toSL";
-const char *SUBSCRIBE_TOPIC = "toPlayers";
+// An edge as passed from the GPIO callback to the decoder thread
+struct RxEvent {
+	uint32_t tick;
+	unsigned level;
+	time_point received;
+};
+
+// One telegraph set: a key, a sounder (coil and speaker) and optionally
+// a stepper, with its own decoder thread and TX thread. Stations share
+// the GPIO backend, the Redis connection and the statistics.
+class Station {
+public:
+	Station(const StationConfig &config, bool multiple)
+		: config(config), Receiver(Timing, Decoder, NULL, config.key_pin) {
+		if (multiple)
+			label = config.name + ": ";
+	}
 
-int pigpiod = -1;
+	const StationConfig config;
+	// Prefixed to console output, only when there are multiple stations
+	std::string label;
+
+	// With ensemble_threads not negative, RX text is picked per word
+	// from an ensemble of decoders, using that many extra threads. With
+	// a dictionary, RX words are corrected with it.
+	void setup(bool use_waves, bool use_cluster, bool use_beam, int ensemble_threads,
+	           const MorseDictionary *dictionary, const TimingStates &states) {
+		if (config.stepper_enable_pin != PIN_NONE) {
+			// Enable is active-low, so disable by writing 1
+			gpio->set_mode(config.stepper_enable_pin, GPIO_OUTPUT);
+			stepper_off();
+		}
 
-// the clock restoration logic
-CwTimingLogic Timing;
+		if (config.stepper_dir_pin != PIN_NONE) {
+			// Direction 1 is forward
+			gpio->set_mode(config.stepper_dir_pin, GPIO_OUTPUT);
+			gpio->write(config.stepper_dir_pin, 1);
+		}
 
-// the decoder
-CwDecoderLogic Decoder;
+		// Set up the step pin to continuously generate step pulses, the
+		// stepper is controlled using the enable pin.
+		if (config.stepper_step_pin != PIN_NONE)
+			gpio->hardware_pwm(config.stepper_step_pin, STEPPER_FREQ, HW_PWM_MAX_DUTYCYCLE / 2);
 
-void tone_on() {
-	hardware_PWM(pigpiod, SPEAKER_PIN, TONE_FREQ, HW_PWM_MAX_DUTYCYCLE / 2);
-}
+		gpio->set_mode(config.key_pin, GPIO_INPUT);
+		gpio->set_pull_up_down(config.key_pin, GPIO_PULL_UP);
 
-void tone_off() {
-	set_mode(pigpiod, SPEAKER_PIN, PI_OUTPUT);
-	gpio_write(pigpiod, SPEAKER_PIN, 0);
-}
+		tone_off();
+		coil_off();
 
-void coil_on() {
-	set_PWM_dutycycle(pigpiod, COIL_PIN, COIL_DUTYCYCLE);
-}
+		if (use_waves)
+			wave_tx = new WaveTx(gpio, config.coil_pin, config.speaker_pin, config.tone_freq,
+			                     (float)COIL_DUTYCYCLE / DMA_PWM_MAX_DUTYCYCLE);
 
-void coil_off() {
-	set_mode(pigpiod, COIL_PIN, PI_OUTPUT);
-	gpio_write(pigpiod, COIL_PIN, 0);
-}
+		configure_timing(Timing);
+		if (use_cluster)
+			Timing.Estimator(EstimatorCluster);
 
-void stepper_on() {
-	gpio_write(pigpiod, STEPPER_ENABLE_PIN, 0);
-}
+		auto state = states.find(config.name);
+		if (state != states.end()) {
+			if (Timing.LoadState(state->second))
+				printf("%sRestored timing state: %.0f wpm\n", label.c_str(), Timing.RxWPM());
+			else
+				fprintf(stderr, "%sIgnoring invalid timing state\n", label.c_str());
+		}
+		Timing.SaveState(State);
+
+		Receiver.set_gpio(gpio);
+		Receiver.char_latency = &CharLatency;
+		Receiver.recorder = &Recorder;
+		if (dictionary) {
+			Corrector = new WordCorrector(*dictionary);
+			Receiver.corrector = Corrector;
+		}
+		if (ensemble_threads >= 0) {
+			Ensemble = new CwEnsemble(default_ensemble(), Timing.RxWPM(), ensemble_threads);
+			Ensemble->on_text = [this](const char *text) { process_rx_text(text); };
+			if (dictionary)
+				Ensemble->use_dictionary(*dictionary);
+			Receiver.ensemble = Ensemble;
+		} else {
+			Receiver.on_text = [this](const char *text) { process_rx_text(text); };
+		}
+		if (use_beam) {
+			Receiver.beam = &Beam;
+			Receiver.on_beam_text = [this](const BeamCharacter *chars, int count) {
+				process_rx_beam(chars, count);
+			};
+		}
+		sem_init(&RxReady, 0, 0);
+	}
 
-void stepper_off() {
-	gpio_write(pigpiod, STEPPER_ENABLE_PIN, 1);
-}
+	// Start the threads and edge callback. When cpu is not negative,
+	// the decoder thread is bound to that CPU. When tx_cpu is not
+	// negative, the TX thread runs at real-time priority on that CPU.
+	// With batched, edges are taken from the GPIO backend in batches.
+	void start(int cpu, int tx_cpu, bool batched) {
+		std::thread rx_thread([this]() { process_rx(); });
+		if (cpu >= 0) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(cpu, &cpus);
+			int err = pthread_setaffinity_np(rx_thread.native_handle(), sizeof(cpus), &cpus);
+			if (err)
+				fprintf(stderr, "%sFailed to set decoder thread affinity: %s\n", label.c_str(), strerror(err));
+		}
+		rx_thread.detach();
+
+		std::thread tx_thread([this, tx_cpu]() {
+			if (tx_cpu >= 0)
+				tx_realtime = make_thread_realtime(TX_PRIORITY, tx_cpu, label.c_str());
+			process_tx();
+		});
+		tx_thread.detach();
+
+		if (batched) {
+			gpio->on_edges(config.key_pin, [this](const GpioEdge *edges, size_t count) {
+				process_rx_edges(edges, count);
+			});
+		} else {
+			gpio->on_edge(config.key_pin, [this](unsigned pin, unsigned level, uint32_t tick) {
+				process_rx_edge(level, tick);
+			});
+		}
+	}
+
+	// Messages waiting to be sent
+	TxQueue Queue;
 
-// TODO: Cleanup on error/signal using atexit & signal handlers?
+	// Copy the last snapshot of the timing state. Returns the number of
+	// snapshots taken so far, to detect changes.
+	unsigned get_state(CwTimingState &state) {
+		std::lock_guard<std::mutex> lock(StateLock);
+		state = State;
+		return StateVersion;
+	}
+
+	// Add the statistics of this station, with names prefixed by prefix
+	template <typename Add>
+	void add_stats(const std::string &prefix, Add add) {
+		add(prefix + "rx_ring.high_water", RxRing.HighWater());
+		add(prefix + "rx_ring.overflows", RxRing.Overflows());
+		add(prefix + "rx_buffer.overflows", Receiver.overflows());
+		add(prefix + "rx.edges", RxEdges);
+		add(prefix + "rx.wakeups", RxWakeups);
+
+		TxQueueStats tx = Queue.get_stats();
+		add(prefix + "tx_queue.depth", tx.depth);
+		add(prefix + "tx_queue.max_depth", tx.max_depth);
+		add(prefix + "tx_queue.cancelled", tx.cancelled);
+		add(prefix + "tx_queue.last_wait_ms", std::chrono::duration_cast<std::chrono::milliseconds>(tx.last_wait).count());
+		add(prefix + "tx_queue.max_wait_ms", std::chrono::duration_cast<std::chrono::milliseconds>(tx.max_wait).count());
+		add(prefix + "tx.realtime", tx_realtime);
+		add(prefix + "tx.slips", TxSlips);
+		if (Ensemble) {
+			for (auto &m : Ensemble->get_members())
+				add(prefix + "ensemble." + m->config.name + ".wins", m->wins.load(std::memory_order_relaxed));
+		}
+		if (Corrector) {
+			WordCorrectorStats dict = Corrector->get_stats();
+			add(prefix + "dict.words", dict.words);
+			add(prefix + "dict.exact", dict.exact);
+			add(prefix + "dict.corrected", dict.corrected);
+			add(prefix + "dict.ambiguous", dict.ambiguous);
+			add(prefix + "dict.over_budget", dict.over_budget);
+		}
+	}
 
+private:
+	// the clock restoration logic
+	CwTimingLogic Timing;
 
-using time_point = std::chrono::steady_clock::time_point;
+	// the decoder
+	CwDecoderLogic Decoder;
+
+	// the RX path
+	CwReceiver Receiver;
+
+	// the soft-decision decoder, running next to the normal one when enabled
+	CwBeamDecoder Beam;
 
-void process_tx_char(char ch, time_point tx_start) {
-	time_point tx_next = tx_start;
+	// Set when RX text comes from an ensemble of decoders
+	CwEnsemble *Ensemble = NULL;
 
-	ch = toupper(ch);
-	std::queue<MorseElements> elems;
-	Decoder.Encode(ch, elems);
+	// Set when RX words are corrected with a dictionary
+	WordCorrector *Corrector = NULL;
 
-	while (!elems.empty()) {
-		MorseElements elem = elems.front();
-		elems.pop();
+	// Set when TX should use hardware-timed waveforms
+	WaveTx *wave_tx = NULL;
 
-		CwElement cwe = Timing.Encode(elem);
-		std::this_thread::sleep_until(tx_next);
+	// Set when the TX thread got real-time priority, see TX_PRIORITY
+	std::atomic<bool> tx_realtime{false};
 
-		if (cwe.Mark) {
-			tone_on();
-			coil_on();
+	// Times TX fell too far behind and restarted its timeline
+	std::atomic<unsigned> TxSlips{0};
+
+	// Edges waiting to be decoded. The GPIO callback is the only producer,
+	// process_rx() the only consumer. RxReady is posted once for every
+	// edge or batch of edges pushed.
+	SpscRing<RxEvent, 1024> RxRing;
+	sem_t RxReady;
+
+	// Edges decoded, and times the decoder thread found edges waiting
+	std::atomic<unsigned> RxEdges{0};
+	std::atomic<unsigned> RxWakeups{0};
+
+	// Snapshot of the timing state, taken by the decoder thread
+	std::mutex StateLock;
+	CwTimingState State;
+	unsigned StateVersion = 0;
+
+	void tone_on() {
+		gpio->hardware_pwm(config.speaker_pin, config.tone_freq, HW_PWM_MAX_DUTYCYCLE / 2);
+	}
+
+	void tone_off() {
+		gpio->set_mode(config.speaker_pin, GPIO_OUTPUT);
+		gpio->write(config.speaker_pin, 0);
+	}
+
+	void coil_on() {
+		gpio->set_pwm_dutycycle(config.coil_pin, COIL_DUTYCYCLE);
+	}
+
+	void coil_off() {
+		gpio->set_mode(config.coil_pin, GPIO_OUTPUT);
+		gpio->write(config.coil_pin, 0);
+	}
+
+	void stepper_on() {
+		if (config.stepper_enable_pin != PIN_NONE)
+			gpio->write(config.stepper_enable_pin, 0);
+	}
+
+	void stepper_off() {
+		if (config.stepper_enable_pin != PIN_NONE)
+			gpio->write(config.stepper_enable_pin, 1);
+	}
+
+	// TODO: Cleanup on error/signal using atexit & signal handlers?
+
+	// Sleep until time t on the TX timeline, precisely with -x
+	void tx_sleep_until(time_point t) {
+		if (tx_realtime)
+			sleep_until_deadline(t, REALTIME_SPIN);
+		else
+			std::this_thread::sleep_until(t);
+	}
+
+	// Send a character, starting at tx_next on the timeline of the
+	// message, and return where it ends on that timeline. Every element
+	// is scheduled relative to the start of the message, so being late
+	// for one edge does not delay all later ones.
+	// first_mark is cleared after the first coil_on, to record the latency
+	// since the message was received.
+	time_point process_tx_char(char ch, time_point tx_next, const TxMessage &tx, bool &first_mark) {
+		ch = toupper(ch);
+		std::queue<MorseElements> elems;
+		Decoder.Encode(ch, elems);
+
+		while (!elems.empty()) {
+			MorseElements elem = elems.front();
+			elems.pop();
+
+			CwElement cwe = Timing.Encode(elem);
+			time_point now = std::chrono::steady_clock::now();
+			if (now - tx_next > TX_MAX_LATE) {
+				tx_next = now;
+				TxSlips++;
+			}
+			Recorder.record_tx(config.coil_pin, tx_next, cwe.Mark, cwe.Length);
+			tx_sleep_until(tx_next);
+
+			// The edges are timed when the writes return, which is
+			// an upper bound on when they happened
+			if (cwe.Mark) {
+				tone_on();
+				coil_on();
+				TxEdgeLatency.record_duration(std::chrono::steady_clock::now() - tx_next);
+				if (first_mark) {
+					TxStartLatency.record_duration(std::chrono::steady_clock::now() - tx.queued);
+					first_mark = false;
+				}
+			}
+
+			tx_next += std::chrono::microseconds(cwe.Length);
+			tx_sleep_until(tx_next);
+
+			tone_off();
+			coil_off();
+			if (cwe.Mark)
+				TxEdgeLatency.record_duration(std::chrono::steady_clock::now() - tx_next);
 		}
+		return tx_next;
+	}
 
-		tx_next += std::chrono::milliseconds(cwe.Length);
-		std::this_thread::sleep_until(tx_next);
+	// Send a message by compiling it into waveforms, and letting the
+	// hardware time it.
+	void process_tx_message_wave(const TxMessage &tx) {
+		std::vector<CwElement> elements;
+		for (const char *msg = tx.text.c_str(); *msg; msg++) {
+			std::queue<MorseElements> elems;
+			Decoder.Encode(toupper(*msg), elems);
+			while (!elems.empty()) {
+				elements.push_back(Timing.Encode(elems.front()));
+				elems.pop();
+			}
+		}
+		time_point start = std::chrono::steady_clock::now();
+		TxStartLatency.record_duration(start - tx.queued);
+		for (const CwElement &e : elements) {
+			Recorder.record_tx(config.coil_pin, start, e.Mark, e.Length);
+			start += std::chrono::microseconds(e.Length);
+		}
+		wave_tx->send(elements, [this, &tx]() { return Queue.cancelled(tx.id); });
+	}
 
-		tone_off();
-		coil_off();
+	void process_tx_message(const TxMessage &tx) {
+		if (wave_tx) {
+			process_tx_message_wave(tx);
+			return;
+		}
+
+		time_point tx_next = std::chrono::steady_clock::now();
+		bool first_mark = true;
+		for (const char *msg = tx.text.c_str(); *msg; msg++) {
+			if (Queue.cancelled(tx.id))
+				break;
+			tx_next = process_tx_char(*msg, tx_next, tx, first_mark);
+		}
 	}
-}
 
-void process_tx_message(const char *msg) {
-	printf("Sending message: %s\n", msg);
+	// TX scheduler thread: sends queued messages back to back. The stepper
+	// is kept running between messages and only stopped when no new message
+	// arrived within the lead-out time.
+	void process_tx() {
+		bool stepper_running = false;
+		while (true) {
+			TxMessage tx;
+			if (stepper_running) {
+				if (!Queue.pop(tx, STEPPER_LEAD_OUT)) {
+					stepper_off();
+					stepper_running = false;
+					continue;
+				}
+			} else {
+				Queue.pop(tx);
+				stepper_on();
+				stepper_running = true;
+			}
+
+			auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tx.queued);
+			printf("%sSending message: %s (queued for %lld ms, %zu more waiting)\n", label.c_str(),
+				tx.text.c_str(), (long long)waited.count(), Queue.depth());
 
-	stepper_on();
-	time_point tx_start = std::chrono::steady_clock::now() + STEPPER_LEAD_IN;
-	tx_start = std::chrono::steady_clock::now();
-	while (*msg) {
-		process_tx_char(*msg, tx_start);
-		tx_start = std::chrono::steady_clock::now();
-		msg++;
+			process_tx_message(tx);
+			if (Queue.cancelled(tx.id))
+				printf("%sMessage cancelled\n", label.c_str());
+			Queue.done(tx.id);
+		}
 	}
-	std::this_thread::sleep_for(STEPPER_LEAD_OUT);
-	stepper_off();
-}
+
+	// Called when the key pin changes, or a timeout occurs. This runs on
+	// the pigpiod_if2 callback thread, so it only queues the edge,
+	// decoding happens in process_rx(). This way, slow decoding or
+	// publishing never delays delivery of later edges, also not those
+	// of other stations.
+	void process_rx_edge(unsigned level, uint32_t tick) {
+		RxEvent ev = {tick, level, std::chrono::steady_clock::now()};
+		if (RxRing.Push(ev))
+			sem_post(&RxReady);
+	}
+
+	// Like process_rx_edge(), for a batch of edges from the GPIO
+	// backend, which wakes up the decoder thread only once
+	void process_rx_edges(const GpioEdge *edges, size_t count) {
+		time_point now = std::chrono::steady_clock::now();
+		bool pushed = false;
+		for (size_t i = 0; i < count; ++i) {
+			RxEvent ev = {edges[i].tick, edges[i].level, now};
+			pushed |= RxRing.Push(ev);
+		}
+		if (pushed)
+			sem_post(&RxReady);
+	}
+
+	// Decoder thread, runs the RX path for queued edges. Every wakeup
+	// decodes all edges queued so far, so with per-edge posts, later
+	// wakeups can find the ring empty.
+	void process_rx() {
+		unsigned overflows = 0;
+		while (true) {
+			if (sem_wait(&RxReady) < 0) {
+				if (errno != EINTR)
+					perror("sem_wait");
+				continue;
+			}
+
+			// Edges were lost, the timing of the next element will be
+			// off, but at least make it visible.
+			if (RxRing.Overflows() != overflows) {
+				overflows = RxRing.Overflows();
+				fprintf(stderr, "%sRX ring overflow: %u edges lost so far, high-water mark %u/%u\n",
+					label.c_str(), overflows, RxRing.HighWater(), RxRing.Capacity());
+			}
+
+			RxEvent ev;
+			unsigned edges = 0;
+			bool timeout = false;
+			while (RxRing.Pop(ev)) {
+				EdgeLatency.record_duration(std::chrono::steady_clock::now() - ev.received);
+				Receiver.process_edge(ev.level, ev.tick);
+				timeout |= ev.level == GPIO_TIMEOUT;
+				edges++;
+			}
+			if (!edges)
+				continue;
+			RxEdges += edges;
+			RxWakeups++;
+
+			// Watchdog timeouts mark pauses in the keying, when the
+			// estimate is as good as it gets
+			if (timeout) {
+				std::lock_guard<std::mutex> lock(StateLock);
+				Timing.SaveState(State);
+				StateVersion++;
+			}
+		}
+	}
+
+	void process_rx_text(const char *text) {
+		printf("%s%s", label.c_str(), text);
+		Publisher.publish(config.publish_topic, text);
+	}
+
+	void process_rx_beam(const BeamCharacter *chars, int count) {
+		std::string text, confidence;
+		for (int i = 0; i < count; ++i) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "%s%.2f", i ? " " : "", chars[i].Confidence);
+			text += chars[i].Value;
+			confidence += buf;
+		}
+		Publisher.publish(config.publish_topic + BEAM_TOPIC_SUFFIX, text + "\t" + confidence);
+	}
+};
+
+std::vector<Station*> Stations;
 
 #if 0
 void setup_stdin() {
@@ -176,163 +598,309 @@ void process_tx() {
 }
 #endif
 
-void process_rx_msg(const char*msg) {
-	static redisContext *publishContext = NULL;
-	if (!publishContext)
-		publishContext = redisConnect("127.0.0.1", 6379);
-	redisCommand(publishContext, "PUBLISH %s %s", PUBLISH_TOPIC, msg);
-}
-
-// buffer for pulse timing data
-CircularBuffer<CwElement> CwBuffer(32);
-
-// buffer for decoded elements
-CircularBuffer<MorseElements> ElementBuffer(32);
-//
-//  Pulse(...) - run the decoder on a state change
-//
-static void Pulse(unsigned pulseWidth, bool state) {
-	CwElement cw;
-	cw.Mark = state; // the keyer pulls LOW, so state becomes true *after* a mark
-	cw.Length = (unsigned)pulseWidth;
-	CwBuffer.Add(cw);
-#ifdef TIMING_DEBUG
-	if (state)
-		printf("(%u) ", pulseWidth);
-	else
-		printf("%u ", pulseWidth);
-#endif
-
-	if (Timing.Decode(CwBuffer, ElementBuffer)) {
-		// I/O buffer
-		char ioBuffer[32];
-
-		uint8_t ct = Decoder.Decode(ElementBuffer, ioBuffer, 8);
-		if (ct > 0) {
-			ioBuffer[ct] = 0;
-			printf("%s", ioBuffer);
-			process_rx_msg(ioBuffer);
-#ifdef TIMING_DEBUG
-			printf(" --> %f\n", Timing.DotLength());
-#endif
-		}
+// Periodically write the timing state of all stations to state_file,
+// when it changed
+void process_state(const char *state_file) {
+	unsigned written = 0;
+	while (true) {
+		std::this_thread::sleep_for(STATE_INTERVAL);
+		TimingStates states;
+		unsigned version = 0;
+		for (Station *s : Stations)
+			version += s->get_state(states[s->config.name]);
+		if (version != written && write_timing_state(state_file, states))
+			written = version;
 	}
 }
 
+// Store latency percentiles and queue counters in Redis, and write the
+// full histograms to stats_file when set.
+void dump_stats() {
+	std::vector<std::string> hmset = {"HMSET", STATS_KEY};
+	auto add = [&hmset](const std::string &field, unsigned long long value) {
+		hmset.push_back(field);
+		hmset.push_back(std::to_string(value));
+	};
+
+	for (LatencyHistogram *h : Histograms) {
+		LatencyHistogram::Snapshot s = h->snapshot();
+		std::string name = h->name;
+		add(name + ".count", s.total);
+		add(name + ".p50_us", s.percentile(0.5));
+		add(name + ".p99_us", s.percentile(0.99));
+		add(name + ".p999_us", s.percentile(0.999));
+		add(name + ".max_us", s.max());
+	}
 
-// Callback, called when the key pin changes, or a timeout occurs
-void process_rx_edge(int pi, unsigned user_gpio, unsigned level, uint32_t tick) {
-	static uint32_t prev_edge = 0;
-	static bool active = false;
-
-	uint32_t duration = tick - prev_edge;
-	prev_edge = tick;
+	add("publish.queue_depth", Publisher.queue_depth());
+	add("publish.dropped", Publisher.dropped_count());
+	add("publish.disconnects", Publisher.disconnect_count());
 
-	// Debounce
-	// TODO: Improve?
-	if (duration < 5000)
-		return;
+	if (pigpiod && pigpiod->notifying()) {
+		GpioReportStats notify = pigpiod->notify_stats();
+		add("notify.batches", notify.batches);
+		add("notify.reports", notify.reports);
+		add("notify.edges", notify.edges);
+		add("notify.lost", notify.lost);
+	}
 
-	// Eat up the first edge after some time of inactivity, and set a
-	// watchdog to detect inactivity after the GPIO stops changing.
-	if (!active) {
-		set_watchdog(pi, user_gpio, Timing.MinimumWordSpace * Timing.DotLength());
-		active = true;
-		return;
+	// With a single station, keep the field names unprefixed, so
+	// existing dashboards keep working
+	for (Station *s : Stations)
+		s->add_stats(Stations.size() > 1 ? s->config.name + "." : "", add);
+
+	Publisher.command(hmset);
+
+	if (stats_file) {
+		// Write to a temporary file and rename, so readers never
+		// see a partial file
+		std::string tmp = std::string(stats_file) + ".tmp";
+		FILE *f = fopen(tmp.c_str(), "w");
+		if (!f) {
+			perror(tmp.c_str());
+			return;
+		}
+		for (LatencyHistogram *h : Histograms)
+			h->print_summary(f);
+		for (LatencyHistogram *h : Histograms)
+			h->print_buckets(f);
+		fclose(f);
+		rename(tmp.c_str(), stats_file);
 	}
+}
 
-	if (level == PI_TIMEOUT) {
-		// Watchdog timeout, some time passed without events. Disable
-		// the watchdog and generate a trailing space pulse.
-		set_watchdog(pi, user_gpio, 0);
-		active = false;
-		Pulse(duration / 1000, false);
-		return;
+void process_stats() {
+	while (true) {
+		std::this_thread::sleep_for(STATS_INTERVAL);
+		dump_stats();
 	}
-	
-	Pulse(duration / 1000, level == PI_HIGH);
 }
 
-	/*
-		MorseElements elem;
-		{
-			std::lock_guard<std::mutex> lock (tx_queue_mutex);
-			while (tx_queue.empty())
-				tx_queue_ready.wait();
-			elem = tx_queue.front();
-			tx_queue.pop();
-		}
-		*/
+enum SubscribeKind { SUBSCRIBE_NORMAL, SUBSCRIBE_PRIORITY, SUBSCRIBE_CANCEL };
 
+// Subscriber for all stations, only queues messages so it never waits
+// for TX
 void process_redis_tx() {
+	// Maps every subscribed channel to its station and kind
+	std::map<std::string, std::pair<Station*, SubscribeKind>> channels;
+	for (Station *s : Stations) {
+		const std::string &topic = s->config.subscribe_topic;
+		channels[topic] = {s, SUBSCRIBE_NORMAL};
+		channels[topic + PRIORITY_TOPIC_SUFFIX] = {s, SUBSCRIBE_PRIORITY};
+		channels[topic + CANCEL_TOPIC_SUFFIX] = {s, SUBSCRIBE_CANCEL};
+	}
+
+	std::vector<const char*> argv = {"SUBSCRIBE"};
+	for (auto &c : channels)
+		argv.push_back(c.first.c_str());
+
 	redisContext *subscribeContext = redisConnect("127.0.0.1", 6379);
-	redisReply *reply = (redisReply*)redisCommand(subscribeContext,"SUBSCRIBE toPlayers");
+	redisReply *reply = (redisReply*)redisCommandArgv(subscribeContext, argv.size(), argv.data(), NULL);
 	freeReplyObject(reply);
 	while(redisGetReply(subscribeContext,(void**)&reply) == REDIS_OK) {
 		if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3 &&
-		    reply->element[0]->type == REDIS_REPLY_STRING &&
-		    reply->element[2]->type == REDIS_REPLY_STRING) {
+		    reply->element[0]->type == REDIS_REPLY_STRING) {
 			const char *kind = reply->element[0]->str;
-			if (strcmp(kind, "message") == 0) {
-				process_tx_message(reply->element[2]->str);
-				continue;
-			} else if (strcmp(kind, "subscribe")) {
-				// Ignore subscribe confirmation
-				continue;
-			} else {
+			if (strcmp(kind, "message") == 0 &&
+			    reply->element[1]->type == REDIS_REPLY_STRING &&
+			    reply->element[2]->type == REDIS_REPLY_STRING) {
+				const char *channel = reply->element[1]->str;
+				const char *msg = reply->element[2]->str;
+				auto it = channels.find(channel);
+				if (it == channels.end()) {
+					fprintf(stderr, "Message on unexpected channel: %s\n", channel);
+				} else {
+					Station *s = it->second.first;
+					if (it->second.second == SUBSCRIBE_CANCEL)
+						printf("%sCancelled %zu messages\n", s->label.c_str(), s->Queue.cancel(msg));
+					else if (it->second.second == SUBSCRIBE_PRIORITY)
+						s->Queue.push(msg, TX_PRIORITY_HIGH);
+					else
+						s->Queue.push(msg);
+				}
+			} else if (strcmp(kind, "subscribe") != 0) {
+				// subscribe confirmations are expected, anything
+				// else is not
 				fprintf(stderr, "Unexpected redis reply: %s\n", kind);
 			}
 		} else {
-			fprintf(stderr, "Unexpected redis reply");
+			fprintf(stderr, "Unexpected redis reply\n");
 		}
 
-    		// consume message
+		// consume message
 		freeReplyObject(reply);
 	}
 	redisFree(subscribeContext);
 }
 
+void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-n] [-w] [-c] [-b] [-e threads] [-d file] [-p] [-x cpu] [-s file] [-l file] [-r file | -R] [-t file | -T]\n", prog);
+	fprintf(stderr, "  -n  Do not touch any hardware, use a simulated GPIO backend\n");
+	fprintf(stderr, "  -w  Use hardware-timed waveforms for TX (single station only)\n");
+	fprintf(stderr, "  -c  Use the cluster speed estimator for RX\n");
+	fprintf(stderr, "  -b  Also decode RX with the beam decoder, publish to <topic>%s\n", BEAM_TOPIC_SUFFIX);
+	fprintf(stderr, "  -e  Publish the RX text of the best of several decoders per word, using this many extra threads\n");
+	fprintf(stderr, "  -d  Correct RX words with this dictionary (word list or compiled, see telegraph-dict)\n");
+	fprintf(stderr, "  -p  Read RX edges in batches from a pigpio notification pipe, instead of a callback per edge\n");
+	fprintf(stderr, "  -x  Run TX at real-time priority on this CPU, with all memory locked\n");
+	fprintf(stderr, "  -s  Read the stations (pins and topics) from this file\n");
+	fprintf(stderr, "  -l  Periodically write latency histograms to this file\n");
+	fprintf(stderr, "  -r  Record edges to this file (default %s)\n", RECORDER_FILE);
+	fprintf(stderr, "  -R  Do not record edges\n");
+	fprintf(stderr, "  -t  Save and restore the timing state in this file (default %s)\n", STATE_FILE);
+	fprintf(stderr, "  -T  Do not save or restore the timing state\n");
+}
+
 int main(int argc, char **argv) {
-	// Connect to localhost
-	pigpiod = pigpio_start(NULL, NULL);
+	bool simulate = false;
+	bool use_waves = false;
+	bool use_cluster = false;
+	bool use_beam = false;
+	int ensemble_threads = -1;
+	const char *dictionary_file = NULL;
+	bool batched = false;
+	int tx_cpu = -1;
+	const char *station_file = NULL;
+	const char *recorder_file = RECORDER_FILE;
+	const char *state_file = STATE_FILE;
+	int opt;
+	while ((opt = getopt(argc, argv, "nwcbe:d:px:s:l:r:Rt:T")) != -1) {
+		switch (opt) {
+			case 'n':
+				simulate = true;
+				break;
+			case 'w':
+				use_waves = true;
+				break;
+			case 'c':
+				use_cluster = true;
+				break;
+			case 'b':
+				use_beam = true;
+				break;
+			case 'e':
+				ensemble_threads = atoi(optarg);
+				if (ensemble_threads < 0) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'd':
+				dictionary_file = optarg;
+				break;
+			case 'p':
+				batched = true;
+				break;
+			case 'x':
+				tx_cpu = atoi(optarg);
+				break;
+			case 's':
+				station_file = optarg;
+				break;
+			case 'l':
+				stats_file = optarg;
+				break;
+			case 'r':
+				recorder_file = optarg;
+				break;
+			case 'R':
+				recorder_file = NULL;
+				break;
+			case 't':
+				state_file = optarg;
+				break;
+			case 'T':
+				state_file = NULL;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
 
-	// Enable is active-low, so disable by writing 1
-	set_mode(pigpiod, STEPPER_ENABLE_PIN, PI_OUTPUT);
-	stepper_off();
+	// Shared by all stations, only read
+	MorseDictionary *dictionary = NULL;
+	if (dictionary_file) {
+		dictionary = new MorseDictionary();
+		if (!dictionary->load(dictionary_file))
+			return 1;
+	}
 
-	// Direction 1 is forward
-	set_mode(pigpiod, STEPPER_DIR_PIN, PI_OUTPUT);
-	gpio_write(pigpiod, STEPPER_DIR_PIN, 1);
+	// Without a station file, run the single station of the default
+	// configuration
+	std::vector<StationConfig> configs;
+	if (!station_file)
+		configs.push_back(StationConfig());
+	else if (!read_station_config(station_file, configs))
+		return 1;
+
+	// Waveforms are global to pigpio, so only one station can send
+	// them at a time
+	if (use_waves && configs.size() > 1) {
+		fprintf(stderr, "-w only works with a single station\n");
+		return 1;
+	}
 
-	// Set up the step pin to continuously generate step pulses, the
-	// stepper is controlled using the enable pin.
-	hardware_PWM(pigpiod, STEPPER_STEP_PIN, STEPPER_FREQ, HW_PWM_MAX_DUTYCYCLE / 2);
+	unsigned cpus = std::thread::hardware_concurrency();
+	if (tx_cpu >= (int)cpus) {
+		fprintf(stderr, "-x: there are only %u CPUs\n", cpus);
+		return 1;
+	}
+	// Before any threads are started, so their stacks are only locked
+	// as far as they are used
+	if (tx_cpu >= 0)
+		lock_memory();
+
+	if (simulate) {
+		gpio = new SimulatedGpio();
+	} else {
+		// Connect to localhost
+		pigpiod = new PigpiodGpio();
+		if (!pigpiod->connected()) {
+			fprintf(stderr, "Failed to connect to pigpiod\n");
+			return 1;
+		}
+		gpio = pigpiod;
+	}
 
-	set_mode(pigpiod, KEY_PIN, PI_INPUT);
-	set_pull_up_down(pigpiod, KEY_PIN, PI_PUD_UP);
+	// Not being able to record is no reason not to run
+	if (recorder_file && !Recorder.open(recorder_file, RECORDER_CAPACITY))
+		fprintf(stderr, "Edge recording disabled\n");
 
-	tone_off();
-	coil_off();
+	Publisher.ack_latency = &PublishLatency;
+	Publisher.start();
 
-	// initialize WPM
-	Timing.RxWPM(10);
-	Timing.TxWPM(10);
-	Timing.RxMode(SpeedAuto);
-	Timing.TxMode(SpeedManual);
+	// Not being able to restore is no reason not to run either
+	TimingStates states;
+	if (state_file)
+		read_timing_state(state_file, states);
 
-	// Be a bit more lenient about the length of spaces, to
-	// facilitate inexperienced operators
-	Timing.MaximumDotSpaceLength = 4;
-	Timing.MinimumWordSpace = 15;
+	for (const StationConfig &config : configs) {
+		Station *s = new Station(config, configs.size() > 1);
+		s->setup(use_waves, use_cluster, use_beam, ensemble_threads, dictionary, states);
+		Stations.push_back(s);
+	}
 
-	// Setup callback to run on RX changes. This uses a background thread.
-	callback(pigpiod, KEY_PIN, EITHER_EDGE, process_rx_edge);
+	// Setup callbacks to run on RX changes. These all run on a single
+	// background thread, which hands edges to the decoder thread of
+	// each station. With multiple stations, spread those over the
+	// CPUs, so one busy station does not delay decoding of another.
+	for (size_t i = 0; i < Stations.size(); ++i)
+		Stations[i]->start(Stations.size() > 1 && cpus > 1 ? i % cpus : -1, tx_cpu, batched);
+
+	std::thread stats_thread(process_stats);
+	stats_thread.detach();
+
+	if (state_file) {
+		std::thread state_thread(process_state, state_file);
+		state_thread.detach();
+	}
 
-	printf("Started\n");
+	printf("Started %zu station%s\n", Stations.size(), Stations.size() > 1 ? "s" : "");
 
 	// Does not normally return
 	process_redis_tx();
 
-	pigpio_stop(pigpiod);
+	delete gpio;
 	return 0;
 }
@@ -0,0 +1,118 @@
+/*
+ *    Compiles word lists into a dictionary file for the RX correction,
+ *    and shows how words would be corrected.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ * The controller reads word lists (see dictionary.txt) on every start.
+ * For large lists, like all callsigns in a database, compiling them once
+ * is faster: the controller maps a compiled dictionary in as it is.
+ *
+ *   telegraph-dict -o calls.dict dictionary.txt callsigns.txt
+ *   telegraph-dict -l calls.dict PA3ABD TNZ
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <string>
+#include <vector>
+
+#include "MorseDictionary.h"
+#include "WordCorrector.h"
+
+void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s -o file list...\n", prog);
+	fprintf(stderr, "       %s -l dictionary word...\n", prog);
+	fprintf(stderr, "  -o  Compile the word lists into this file\n");
+	fprintf(stderr, "  -l  Show how the words would be corrected with this dictionary (list or compiled)\n");
+}
+
+void lookup(const MorseDictionary &dictionary, const char *word) {
+	std::string key;
+	if (!MorseDictionary::make_key(word, key)) {
+		printf("%s: has characters without a code\n", word);
+		return;
+	}
+	const char *exact = dictionary.find(key.data(), key.size());
+	if (exact) {
+		printf("%s: in the dictionary\n", exact);
+		return;
+	}
+	unsigned distance = WordCorrector::max_distance(key.size());
+	if (!distance) {
+		printf("%s: too short to correct\n", word);
+		return;
+	}
+	MorseMatch match;
+	if (!dictionary.nearest(key.data(), key.size(), distance, CORRECTOR_BUDGET, match))
+		printf("%s: not corrected, search took over %u nodes\n", word, CORRECTOR_BUDGET);
+	else if (!match.word)
+		printf("%s: nothing within %u (%u nodes)\n", word, distance, match.visits);
+	else if (match.count > 1)
+		printf("%s: not corrected, %u words at %u, like %s (%u nodes)\n", word, match.count,
+		       match.distance, match.word, match.visits);
+	else
+		printf("%s: corrected to %s, at %u (%u nodes)\n", word, match.word, match.distance, match.visits);
+}
+
+int main(int argc, char **argv) {
+	const char *output = NULL;
+	const char *dictionary_file = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "o:l:h")) != -1) {
+		switch (opt) {
+			case 'o':
+				output = optarg;
+				break;
+			case 'l':
+				dictionary_file = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (!output == !dictionary_file || optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	MorseDictionary dictionary;
+	if (output) {
+		std::vector<std::string> list;
+		for (int i = optind; i < argc; ++i) {
+			if (!MorseDictionary::read_words(argv[i], list))
+				return 1;
+		}
+		unsigned skipped = dictionary.build(list);
+		if (skipped)
+			fprintf(stderr, "Skipped %u words with characters without a code\n", skipped);
+		if (!dictionary.save(output))
+			return 1;
+		printf("%zu words, %zu nodes\n", dictionary.size(), dictionary.node_size());
+		return 0;
+	}
+
+	if (!dictionary.load(dictionary_file))
+		return 1;
+	for (int i = optind; i < argc; ++i)
+		lookup(dictionary, argv[i]);
+	return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ *    Decodes CW from audio, with the same RX logic as the controller.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ * Reads a 16-bit PCM WAV file (or stream, on stdin), detects the tone
+ * with ToneDetector and runs the resulting pulses through CwReceiver,
+ * just like pulses from the key. The decoded text goes to stdout as it
+ * is decoded.
+ *
+ * Over the air keying usually has standard spacing, so this uses the
+ * default timing limits. The controller's lenient ones (-l) take most
+ * character spaces of well-timed keying for spaces within a character.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <chrono>
+#include <vector>
+
+#include "CwReceiver.h"
+#include "ToneDetector.h"
+#include "WavFile.h"
+
+// Samples read at a time
+const size_t READ_BLOCK = 16384;
+
+void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-f freq] [-w wpm] [-b ms] [-c] [-l] [-v] [-q] [file]\n", prog);
+	fprintf(stderr, "  -f  Tone frequency in Hz (default 700)\n");
+	fprintf(stderr, "  -w  Initial speed, before it is tracked (default 20)\n");
+	fprintf(stderr, "  -b  Detector block length in ms (default 4)\n");
+	fprintf(stderr, "  -c  Use the cluster speed estimator\n");
+	fprintf(stderr, "  -l  Use the lenient timing limits of the controller\n");
+	fprintf(stderr, "  -v  Print the detected pulses (in ms, marks in parentheses) to stderr\n");
+	fprintf(stderr, "  -q  Do not print statistics\n");
+	fprintf(stderr, "Reads the audio from stdin when no file is given.\n");
+}
+
+int main(int argc, char **argv) {
+	float freq = 700;
+	float block_ms = 4;
+	unsigned wpm = 20;
+	bool use_cluster = false;
+	bool lenient = false;
+	bool verbose = false;
+	bool quiet = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "f:w:b:clvq")) != -1) {
+		switch (opt) {
+			case 'f':
+				freq = atof(optarg);
+				break;
+			case 'w':
+				wpm = atoi(optarg);
+				break;
+			case 'b':
+				block_ms = atof(optarg);
+				break;
+			case 'c':
+				use_cluster = true;
+				break;
+			case 'l':
+				lenient = true;
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			case 'q':
+				quiet = true;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	WavReader wav;
+	if (!wav.open(optind < argc ? argv[optind] : "-"))
+		return 1;
+	if (freq <= 0 || freq >= wav.rate() / 2 || block_ms <= 0 || wpm == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	CwTimingLogic timing;
+	CwDecoderLogic decoder;
+	if (lenient) {
+		configure_timing(timing);
+	} else {
+		timing.RxWPM(wpm);
+		timing.RxMode(SpeedAuto);
+	}
+	if (use_cluster)
+		timing.Estimator(EstimatorCluster);
+	CwReceiver receiver(timing, decoder, NULL, 0);
+	receiver.on_text = [](const char *text) {
+		fputs(text, stdout);
+		fflush(stdout);
+	};
+
+	ToneDetector detector(wav.rate(), freq, block_ms);
+	unsigned pulses = 0;
+	detector.on_pulse = [&](bool mark, unsigned length) {
+		if (verbose)
+			fprintf(stderr, mark ? "(%.1f) " : "%.1f ", length / 1000.0);
+		receiver.Pulse(length, mark);
+		pulses++;
+	};
+
+	using clock = std::chrono::steady_clock;
+	clock::time_point start = clock::now();
+	std::vector<int16_t> samples(READ_BLOCK);
+	uint64_t total = 0;
+	size_t count;
+	while ((count = wav.read(samples.data(), samples.size())) > 0) {
+		detector.process(samples.data(), count);
+		total += count;
+	}
+
+	// End the last element, and follow it by a space long enough to
+	// end the word, like the watchdog on the key pin does
+	detector.flush();
+	receiver.Pulse(2 * timing.MinimumWordSpace * timing.RxDotLength(), false);
+	printf("\n");
+	fflush(stdout);
+
+	if (!quiet) {
+		double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+		double seconds = (double)total / wav.rate();
+		fprintf(stderr, "%.1f s of audio, %u pulses, %.0f wpm at the end, in %.3f s (%.0fx real time)\n",
+		        seconds, pulses, timing.RxWPM(), elapsed, seconds / elapsed);
+	}
+	return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ *    Renders text to a WAV file, keyed like the controller sends it.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ * The text comes from the arguments, or from stdin when there are none.
+ * Newlines are sent as word spaces. The elements come from the same
+ * CwTimingLogic::Encode the controller uses for TX, so the audio has the
+ * timing the sounder would have.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <chrono>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "CwDecoderLogic.h"
+#include "CwTimingLogic.h"
+#include "ToneRenderer.h"
+#include "WavFile.h"
+
+// Samples are written out whenever this many are buffered
+const size_t WRITE_BLOCK = 65536;
+
+void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-w wpm] [-f freq] [-r rate] [-e ms] [-a amplitude] [-o file] [-q] [text...]\n", prog);
+	fprintf(stderr, "  -w  Speed (default 20)\n");
+	fprintf(stderr, "  -f  Tone frequency in Hz (default 700)\n");
+	fprintf(stderr, "  -r  Sample rate (default 48000)\n");
+	fprintf(stderr, "  -e  Rise and fall time of the keying edges in ms (default 5)\n");
+	fprintf(stderr, "  -a  Amplitude, 0-1 (default 0.8)\n");
+	fprintf(stderr, "  -o  Output file, - for stdout (default)\n");
+	fprintf(stderr, "  -q  Do not print statistics\n");
+	fprintf(stderr, "Reads the text from stdin when none is given.\n");
+}
+
+int main(int argc, char **argv) {
+	unsigned wpm = 20;
+	float freq = 700;
+	unsigned rate = 48000;
+	float rise_ms = 5;
+	float amplitude = 0.8;
+	const char *output = "-";
+	bool quiet = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "w:f:r:e:a:o:q")) != -1) {
+		switch (opt) {
+			case 'w':
+				wpm = atoi(optarg);
+				break;
+			case 'f':
+				freq = atof(optarg);
+				break;
+			case 'r':
+				rate = atoi(optarg);
+				break;
+			case 'e':
+				rise_ms = atof(optarg);
+				break;
+			case 'a':
+				amplitude = atof(optarg);
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'q':
+				quiet = true;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (wpm == 0 || rate == 0 || freq <= 0 || freq >= rate / 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::string text;
+	for (int i = optind; i < argc; ++i) {
+		if (i > optind)
+			text += ' ';
+		text += argv[i];
+	}
+	bool from_stdin = optind == argc;
+
+	WavWriter wav;
+	if (!wav.open(output, rate))
+		return 1;
+
+	using clock = std::chrono::steady_clock;
+	clock::time_point start = clock::now();
+
+	CwTimingLogic timing;
+	CwDecoderLogic decoder;
+	timing.TxWPM(wpm);
+	ToneRenderer renderer(rate, freq, rise_ms, amplitude);
+	std::vector<int16_t> samples;
+	samples.reserve(WRITE_BLOCK * 2);
+
+	size_t pos = 0;
+	while (true) {
+		int ch;
+		if (from_stdin) {
+			ch = getchar();
+			if (ch == EOF)
+				break;
+		} else {
+			if (pos == text.size())
+				break;
+			ch = (unsigned char)text[pos++];
+		}
+
+		std::queue<MorseElements> elems;
+		decoder.Encode(toupper(ch), elems);
+		while (!elems.empty()) {
+			renderer.render(timing.Encode(elems.front()), samples);
+			elems.pop();
+		}
+
+		if (samples.size() >= WRITE_BLOCK) {
+			if (!wav.write(samples.data(), samples.size())) {
+				perror("write");
+				return 1;
+			}
+			samples.clear();
+		}
+	}
+
+	renderer.finish(samples);
+	if (!wav.write(samples.data(), samples.size()) || !wav.close()) {
+		perror("write");
+		return 1;
+	}
+
+	if (!quiet) {
+		double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+		double seconds = (double)renderer.samples() / rate;
+		fprintf(stderr, "%.1f s of audio in %.3f s (%.0fx real time)\n",
+		        seconds, elapsed, seconds / elapsed);
+	}
+	return 0;
+}
@@ -0,0 +1,288 @@
+/*
+ *    Replays a recorded key edge trace through the RX path, as fast as
+ *    possible, and reports decoding speed and the decoded text.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ * Trace files contain one edge per line, as two numbers: the pigpio tick
+ * (in µs, wrapping at 32 bits) and the level (0 = low, 1 = high, 2 =
+ * watchdog timeout). Empty lines and lines starting with # are ignored.
+ * Watchdog timeouts need not be in the trace, they are generated from
+ * the watchdog the RX path sets, just like pigpiod would.
+ *
+ * Edge recordings written by the controller (see EdgeRecorder.h) can be
+ * replayed directly. Their recorded watchdog timeouts are skipped, since
+ * the simulated watchdog regenerates them.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "CwReceiver.h"
+#include "EdgeRecorder.h"
+#include "GpioBackend.h"
+
+// The key pin as used by the controller, only used to identify the
+// input to the simulated backend.
+const unsigned KEY_PIN = 17;
+
+struct Edge {
+	uint32_t tick;
+	unsigned level;
+};
+
+bool read_trace(FILE *f, std::vector<Edge> &edges) {
+	char line[128];
+	unsigned lineno = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		char *p = line;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		unsigned long tick;
+		unsigned level;
+		if (sscanf(p, "%lu %u", &tick, &level) != 2 || level > GPIO_TIMEOUT) {
+			fprintf(stderr, "Invalid trace line %u: %s", lineno, line);
+			return false;
+		}
+		edges.push_back({(uint32_t)tick, level});
+	}
+	return true;
+}
+
+// Read the RX edges of one key pin from a recording, keeping only those
+// in the last seconds before the newest record (all when 0). When pin is
+// negative, the key pin of the first edge is used.
+bool read_recording(const char *path, unsigned seconds, int pin, bool dump, std::vector<Edge> &edges) {
+	std::vector<EdgeSample> samples;
+	if (!EdgeRecorder::read(path, samples))
+		return false;
+
+	if (pin < 0) {
+		for (const EdgeSample &s : samples) {
+			if (s.type != EDGE_RX)
+				continue;
+			if (pin < 0) {
+				pin = s.gpio;
+			} else if (s.gpio != pin) {
+				fprintf(stderr, "Recording has edges for multiple key pins, using pin %d (see -p)\n", pin);
+				break;
+			}
+		}
+	}
+
+	uint64_t newest = 0;
+	for (const EdgeSample &s : samples)
+		newest = std::max(newest, s.time);
+	uint64_t since = seconds && newest > seconds * 1000000ULL ? newest - seconds * 1000000ULL : 0;
+
+	for (const EdgeSample &s : samples) {
+		if (s.time < since)
+			continue;
+		if (dump) {
+			if (s.type == EDGE_TX)
+				printf("# %llu tx %u %s %u\n", (unsigned long long)s.time, s.gpio, s.level ? "mark" : "space", s.tick);
+			else if (s.gpio == pin)
+				printf("# %llu rx%s\n", (unsigned long long)s.time, s.flags & EDGE_DEBOUNCED ? " bounce" : "");
+		}
+		if (s.type != EDGE_RX || s.gpio != pin || s.level == GPIO_TIMEOUT)
+			continue;
+		if (dump)
+			printf("%u %u\n", s.tick, s.level);
+		edges.push_back({s.tick, s.level});
+	}
+	return true;
+}
+
+struct RunResult {
+	std::string text;
+	std::chrono::nanoseconds elapsed;
+	std::vector<uint32_t> edge_ns;
+};
+
+// Push all edges through a fresh RX path
+RunResult replay(const std::vector<Edge> &edges, bool time_edges, SpeedEstimators estimator) {
+	using clock = std::chrono::steady_clock;
+
+	SimulatedGpio gpio;
+	gpio.recording = false;
+	CwTimingLogic timing;
+	CwDecoderLogic decoder;
+	configure_timing(timing);
+	timing.Estimator(estimator);
+
+	CwReceiver receiver(timing, decoder, &gpio, KEY_PIN);
+	RunResult result;
+	receiver.on_text = [&result](const char *text) { result.text += text; };
+	gpio.on_edge(KEY_PIN, [&receiver](unsigned gpio, unsigned level, uint32_t tick) {
+		receiver.process_edge(level, tick);
+	});
+
+	if (time_edges)
+		result.edge_ns.reserve(edges.size());
+
+	clock::time_point start = clock::now();
+	for (const Edge &e : edges) {
+		if (time_edges) {
+			clock::time_point before = clock::now();
+			if (e.level == GPIO_TIMEOUT)
+				gpio.inject_timeout(KEY_PIN, e.tick);
+			else
+				gpio.inject_edge(KEY_PIN, e.level, e.tick);
+			result.edge_ns.push_back((clock::now() - before).count());
+		} else {
+			if (e.level == GPIO_TIMEOUT)
+				gpio.inject_timeout(KEY_PIN, e.tick);
+			else
+				gpio.inject_edge(KEY_PIN, e.level, e.tick);
+		}
+	}
+	// Let the final watchdogs fire, to flush the last character and
+	// word. The RX path rearms the watchdog until it sees the end of
+	// the transmission.
+	uint32_t tick = edges.empty() ? 0 : edges.back().tick;
+	while (!edges.empty() && gpio.watchdog(KEY_PIN)) {
+		tick += gpio.watchdog(KEY_PIN) * 1000;
+		gpio.advance(KEY_PIN, tick);
+	}
+	result.elapsed = clock::now() - start;
+	return result;
+}
+
+void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-r repeats] [-q] [-c] [-s seconds] [-p pin] [-d] [trace]\n", prog);
+	fprintf(stderr, "  -r  Replay the trace this many times, report the fastest run\n");
+	fprintf(stderr, "  -q  Do not print the decoded text\n");
+	fprintf(stderr, "  -c  Use the cluster speed estimator\n");
+	fprintf(stderr, "  -s  Only replay the last seconds of an edge recording\n");
+	fprintf(stderr, "  -p  Replay the edges of this key pin from an edge recording\n");
+	fprintf(stderr, "  -d  Dump an edge recording as a trace, instead of replaying it\n");
+	fprintf(stderr, "Reads the trace from stdin when no file is given.\n");
+}
+
+int main(int argc, char **argv) {
+	int repeats = 1;
+	bool quiet = false;
+	int seconds = 0;
+	int pin = -1;
+	bool dump = false;
+	SpeedEstimators estimator = EstimatorBoxCar;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:qcs:p:d")) != -1) {
+		switch (opt) {
+			case 'r':
+				repeats = atoi(optarg);
+				if (repeats < 1) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'q':
+				quiet = true;
+				break;
+			case 'c':
+				estimator = EstimatorCluster;
+				break;
+			case 's':
+				seconds = atoi(optarg);
+				if (seconds < 0) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'p':
+				pin = atoi(optarg);
+				break;
+			case 'd':
+				dump = true;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	std::vector<Edge> edges;
+	if (optind < argc && EdgeRecorder::is_recording(argv[optind])) {
+		if (!read_recording(argv[optind], seconds, pin, dump, edges))
+			return 1;
+		if (dump)
+			return 0;
+	} else {
+		FILE *f = stdin;
+		if (optind < argc) {
+			f = fopen(argv[optind], "r");
+			if (!f) {
+				perror(argv[optind]);
+				return 1;
+			}
+		}
+		if (!read_trace(f, edges))
+			return 1;
+		if (f != stdin)
+			fclose(f);
+	}
+
+	if (edges.empty()) {
+		fprintf(stderr, "Trace is empty\n");
+		return 1;
+	}
+
+	// Throughput runs do not time individual edges, since reading
+	// the clock is a significant part of the per-edge cost.
+	RunResult best;
+	for (int i = 0; i < repeats; ++i) {
+		RunResult r = replay(edges, false, estimator);
+		if (i == 0 || r.elapsed < best.elapsed)
+			best = r;
+	}
+
+	// Separate run to get the per-edge latency distribution
+	RunResult timed = replay(edges, true, estimator);
+	std::sort(timed.edge_ns.begin(), timed.edge_ns.end());
+	auto pct = [&timed](double p) {
+		return timed.edge_ns[std::min(timed.edge_ns.size() - 1, (size_t)(p * timed.edge_ns.size()))];
+	};
+
+	if (!quiet)
+		printf("%s\n", best.text.c_str());
+
+	double ns = best.elapsed.count();
+	printf("edges: %zu\n", edges.size());
+	printf("chars: %zu\n", best.text.size());
+	printf("elapsed: %.3f ms\n", ns / 1e6);
+	printf("edges/sec: %.0f\n", edges.size() / (ns / 1e9));
+	printf("ns/edge: %.1f\n", ns / edges.size());
+	printf("edge latency p50/p99/max: %u/%u/%u ns\n", pct(0.5), pct(0.99), timed.edge_ns.back());
+
+	if (timed.text != best.text) {
+		fprintf(stderr, "Decoded text differs between runs!\n");
+		return 1;
+	}
+	return 0;
+}
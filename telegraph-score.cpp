@@ -0,0 +1,452 @@
+/*
+ *    Scores the RX path on generated keying, over a range of speeds and
+ *    operator styles.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ * For every scenario (a style of keying, see SCENARIOS) and speed, text
+ * is keyed by FistGenerator and the edges are fed through CwReceiver,
+ * with the simulated watchdog, exactly like the controller would see
+ * them. Every decoder configuration starts from scratch at the initial
+ * speed, like the controller does without saved state.
+ *
+ * Reported are the character error rate (the edit distance to the keyed
+ * text, relative to its length) and the latency of every correctly
+ * decoded character: the time from the end of its last mark until it
+ * was decoded, in simulated time. A match decoded before its character
+ * was keyed is a coincidence of the alignment, and has no latency.
+ *
+ * A configuration is a name, the MaximumDotSpaceLength and
+ * MinimumWordSpace limits (in dots) and the speed estimator, e.g.
+ * "-C mine:3:6:cluster". The default configurations are the lenient
+ * limits of the controller and the standard ones of CwTimingLogic, each
+ * with both estimators. With -e, the ensemble the controller uses with
+ * -e is scored too, see CwEnsemble.h. With -d, the words decoded by
+ * every configuration are corrected with a dictionary, like with the -d
+ * option of the controller.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "CwReceiver.h"
+#include "FistGenerator.h"
+#include "GpioBackend.h"
+
+// Only used to identify the input to the simulated backend
+const unsigned KEY_PIN = 17;
+
+const char *DEFAULT_TEXT =
+	"CQ CQ CQ DE PA3ABC PA3ABC K "
+	"PA3ABC DE DL1XYZ GM OM TNX FER CALL UR RST 599 5NN NAME IS HANS QTH BERLIN HW? "
+	"THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG 0123456789 "
+	"WX HR IS SUNNY ES 22C RIG IS 100W ANT DIPOLE 73 ES GUD DX SK";
+
+struct Scenario {
+	const char *name;
+	const char *description;
+	void (*setup)(FistParams &p, float wpm);
+};
+
+const Scenario SCENARIOS[] = {
+	{"clean", "3% jitter", [](FistParams &p, float wpm) {
+		p.jitter = 0.03;
+	}},
+	{"jitter", "15% jitter", [](FistParams &p, float wpm) {
+		p.jitter = 0.15;
+	}},
+	{"drift", "5% jitter, speed drifting 3% per character", [](FistParams &p, float wpm) {
+		p.jitter = 0.05;
+		p.drift = 0.03;
+	}},
+	{"heavy", "5% jitter, marks 0.3 dot longer", [](FistParams &p, float wpm) {
+		p.jitter = 0.05;
+		p.weight = 0.3;
+	}},
+	{"light", "5% jitter, marks 0.3 dot shorter", [](FistParams &p, float wpm) {
+		p.jitter = 0.05;
+		p.weight = -0.3;
+	}},
+	{"farnsworth", "5% jitter, characters 1.5x as fast", [](FistParams &p, float wpm) {
+		p.jitter = 0.05;
+		p.farnsworth_wpm = wpm;
+		p.wpm = wpm * 1.5;
+	}},
+	{"bounce", "5% jitter, contact bounces twice within 3ms", [](FistParams &p, float wpm) {
+		p.jitter = 0.05;
+		p.bounces = 2;
+		p.bounce_ms = 3;
+	}},
+	{"change", "5% jitter, 1.5x faster halfway", [](FistParams &p, float wpm) {
+		p.jitter = 0.05;
+		p.speed_changes.push_back({0.5, wpm * 1.5f});
+	}},
+};
+
+struct Score {
+	unsigned errors = 0;
+	unsigned length = 0;
+	std::vector<double> latency_ms;
+
+	void add(const Score &other) {
+		errors += other.errors;
+		length += other.length;
+		latency_ms.insert(latency_ms.end(), other.latency_ms.begin(), other.latency_ms.end());
+	}
+
+	double cer() const {
+		return length ? (double)errors / length : 0;
+	}
+
+	// Percentile of the latencies, sorts them
+	double latency(unsigned percent) {
+		if (latency_ms.empty())
+			return 0;
+		std::sort(latency_ms.begin(), latency_ms.end());
+		return latency_ms[(latency_ms.size() - 1) * percent / 100];
+	}
+};
+
+struct Decoded {
+	char ch;
+	uint64_t time;
+};
+
+// Align the decoded text to the keyed text (minimum edit distance), and
+// score it
+Score score(const std::vector<Decoded> &raw, const FistTimeline &timeline) {
+	// Spaces only separate words, so compare them like the keyed text
+	std::vector<Decoded> decoded;
+	for (const Decoded &d : raw) {
+		if (d.ch == ' ' && (decoded.empty() || decoded.back().ch == ' '))
+			continue;
+		decoded.push_back(d);
+	}
+	if (!decoded.empty() && decoded.back().ch == ' ')
+		decoded.pop_back();
+
+	const std::string &text = timeline.text;
+	size_t n = decoded.size(), m = text.size();
+	std::vector<unsigned> d((n + 1) * (m + 1));
+	auto at = [m, &d](size_t i, size_t j) -> unsigned & { return d[i * (m + 1) + j]; };
+	for (size_t i = 0; i <= n; ++i)
+		at(i, 0) = i;
+	for (size_t j = 0; j <= m; ++j)
+		at(0, j) = j;
+	for (size_t i = 1; i <= n; ++i) {
+		for (size_t j = 1; j <= m; ++j) {
+			at(i, j) = std::min({at(i - 1, j) + 1, at(i, j - 1) + 1,
+			                     at(i - 1, j - 1) + (decoded[i - 1].ch != text[j - 1])});
+		}
+	}
+
+	Score s;
+	s.errors = at(n, m);
+	s.length = m;
+
+	// The keyed character of every position in the text
+	std::vector<int> truth(m, -1);
+	for (size_t j = 0, c = 0; j < m; ++j) {
+		if (text[j] != ' ')
+			truth[j] = c++;
+	}
+
+	// Walk back along the alignment, timing the matches
+	size_t i = n, j = m;
+	while (i > 0 && j > 0) {
+		bool match = decoded[i - 1].ch == text[j - 1];
+		if (at(i, j) == at(i - 1, j - 1) + !match) {
+			if (match && truth[j - 1] >= 0) {
+				// A match decoded before it was keyed only lines
+				// up by chance (mostly with a high CER)
+				uint64_t end = timeline.truth[truth[j - 1]].end;
+				if (decoded[i - 1].time >= end)
+					s.latency_ms.push_back(((double)decoded[i - 1].time - end) / 1000);
+			}
+			i--;
+			j--;
+		} else if (at(i, j) == at(i - 1, j) + 1) {
+			i--;
+		} else {
+			j--;
+		}
+	}
+	return s;
+}
+
+// When set, words are corrected with this dictionary
+MorseDictionary *dictionary = NULL;
+
+// Feed the timeline through a fresh RX path, with the given
+// configuration or, when that is NULL, the default ensemble
+Score run(const TimingConfig *config, unsigned ensemble_threads, float initial_wpm, const FistTimeline &timeline) {
+	SimulatedGpio gpio;
+	gpio.recording = false;
+	CwTimingLogic timing;
+	CwDecoderLogic decoder;
+	configure_timing(timing);
+	// Setting the speed drops into manual mode
+	timing.RxWPM(initial_wpm);
+	timing.RxMode(SpeedAuto);
+	if (config)
+		config->apply(timing);
+	CwReceiver receiver(timing, decoder, &gpio, KEY_PIN);
+
+	// Ticks wrap at 32 bits, the time of the receiver does not
+	std::vector<Decoded> decoded;
+	auto on_text = [&](const char *text) {
+		for (; *text; ++text)
+			decoded.push_back({*text, receiver.time()});
+	};
+	std::unique_ptr<CwEnsemble> ensemble;
+	std::unique_ptr<WordCorrector> corrector;
+	if (config) {
+		receiver.on_text = on_text;
+		if (dictionary) {
+			corrector.reset(new WordCorrector(*dictionary));
+			receiver.corrector = corrector.get();
+		}
+	} else {
+		ensemble.reset(new CwEnsemble(default_ensemble(), initial_wpm, ensemble_threads));
+		ensemble->on_text = on_text;
+		if (dictionary)
+			ensemble->use_dictionary(*dictionary);
+		receiver.ensemble = ensemble.get();
+	}
+	gpio.on_edge(KEY_PIN, [&](unsigned pin, unsigned level, uint32_t tick) {
+		receiver.process_edge(level, tick);
+	});
+
+	for (const FistEdge &e : timeline.edges)
+		gpio.inject_edge(KEY_PIN, e.level, e.time);
+
+	// Let the final watchdogs fire, like telegraph-replay
+	uint32_t tick = receiver.time();
+	while (gpio.watchdog(KEY_PIN)) {
+		tick += gpio.watchdog(KEY_PIN) * 1000;
+		gpio.advance(KEY_PIN, tick);
+	}
+	return score(decoded, timeline);
+}
+
+bool parse_config(const char *arg, TimingConfig &config) {
+	char name[64], estimator[16];
+	if (sscanf(arg, "%63[^:]:%f:%f:%15s", name, &config.dot_space, &config.word_space, estimator) != 4)
+		return false;
+	config.name = name;
+	if (strcmp(estimator, "boxcar") == 0)
+		config.estimator = EstimatorBoxCar;
+	else if (strcmp(estimator, "cluster") == 0)
+		config.estimator = EstimatorCluster;
+	else
+		return false;
+	return config.dot_space > 0 && config.word_space > config.dot_space;
+}
+
+std::string read_file(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	std::string text;
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		text.append(buf, n);
+	fclose(f);
+	return text;
+}
+
+void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-w from-to[:step]] [-s scenario,...] [-C config]... [-e threads] [-d file] [-i wpm] [-n trials] [-t file] [-j]\n", prog);
+	fprintf(stderr, "  -w  Speeds to key at (default 5-40:5)\n");
+	fprintf(stderr, "  -s  Only run these scenarios (default all)\n");
+	fprintf(stderr, "  -C  Score this configuration, as name:dot_space:word_space:boxcar|cluster\n");
+	fprintf(stderr, "  -e  Also score the ensemble of the controller, using this many extra threads\n");
+	fprintf(stderr, "  -d  Correct words with this dictionary (see telegraph-dict)\n");
+	fprintf(stderr, "  -i  Initial speed of the decoder (default 10)\n");
+	fprintf(stderr, "  -n  Trials per speed, with different random keying (default 3)\n");
+	fprintf(stderr, "  -t  Key the text in this file\n");
+	fprintf(stderr, "  -j  Print the results as JSON, one object per line\n");
+	fprintf(stderr, "Scenarios:\n");
+	for (const Scenario &s : SCENARIOS)
+		fprintf(stderr, "  %-11s %s\n", s.name, s.description);
+}
+
+int main(int argc, char **argv) {
+	float wpm_from = 5, wpm_to = 40, wpm_step = 5;
+	float initial_wpm = 10;
+	unsigned trials = 3;
+	std::string text = DEFAULT_TEXT;
+	std::vector<std::string> only;
+	std::vector<TimingConfig> configs;
+	int ensemble_threads = -1;
+	bool json = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "w:s:C:e:d:i:n:t:jh")) != -1) {
+		switch (opt) {
+			case 'w':
+				if (sscanf(optarg, "%f-%f:%f", &wpm_from, &wpm_to, &wpm_step) < 2) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 's': {
+				std::string list = optarg;
+				size_t pos = 0, comma;
+				while ((comma = list.find(',', pos)) != std::string::npos) {
+					only.push_back(list.substr(pos, comma - pos));
+					pos = comma + 1;
+				}
+				only.push_back(list.substr(pos));
+				break;
+			}
+			case 'C': {
+				TimingConfig config;
+				if (!parse_config(optarg, config)) {
+					fprintf(stderr, "Invalid configuration: %s\n", optarg);
+					return 1;
+				}
+				configs.push_back(config);
+				break;
+			}
+			case 'e':
+				ensemble_threads = atoi(optarg);
+				if (ensemble_threads < 0) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'd':
+				dictionary = new MorseDictionary();
+				if (!dictionary->load(optarg))
+					return 1;
+				break;
+			case 'i':
+				initial_wpm = atof(optarg);
+				break;
+			case 'n':
+				trials = atoi(optarg);
+				break;
+			case 't':
+				text = read_file(optarg);
+				break;
+			case 'j':
+				json = true;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (wpm_from <= 0 || wpm_to < wpm_from || wpm_step <= 0 || initial_wpm <= 0 || trials == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (configs.empty()) {
+		// The limits of configure_timing() and the CwTimingLogic
+		// defaults
+		configs = {
+			{"lenient", 4, 15, EstimatorBoxCar},
+			{"standard", 2, 4.5, EstimatorBoxCar},
+			{"lenient+cl", 4, 15, EstimatorCluster},
+			{"standard+cl", 2, 4.5, EstimatorCluster},
+		};
+	}
+
+	// The ensemble is scored as the last column
+	std::vector<std::string> names;
+	for (const TimingConfig &c : configs)
+		names.push_back(c.name);
+	if (ensemble_threads >= 0)
+		names.push_back("ensemble");
+
+	std::vector<const Scenario*> scenarios;
+	for (const Scenario &s : SCENARIOS) {
+		if (only.empty() || std::find(only.begin(), only.end(), s.name) != only.end())
+			scenarios.push_back(&s);
+	}
+	if (scenarios.empty()) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!json) {
+		printf("CER and median latency (ms) per configuration, %u trial%s per speed\n",
+		       trials, trials > 1 ? "s" : "");
+		printf("%-11s %4s", "scenario", "wpm");
+		for (const std::string &name : names)
+			printf("  %15s", name.c_str());
+		printf("\n");
+	}
+
+	std::vector<Score> totals(names.size());
+	for (const Scenario *scenario : scenarios) {
+		for (float wpm = wpm_from; wpm <= wpm_to + 1e-3; wpm += wpm_step) {
+			if (!json)
+				printf("%-11s %4.0f", scenario->name, wpm);
+			for (size_t c = 0; c < names.size(); ++c) {
+				const TimingConfig *config = c < configs.size() ? &configs[c] : NULL;
+				Score cell;
+				for (unsigned trial = 0; trial < trials; ++trial) {
+					FistParams params;
+					params.wpm = wpm;
+					scenario->setup(params, wpm);
+					FistGenerator generator(params, trial);
+					cell.add(run(config, ensemble_threads, initial_wpm, generator.generate(text)));
+				}
+				totals[c].add(cell);
+				if (json) {
+					printf("{\"scenario\": \"%s\", \"wpm\": %g, \"config\": \"%s\", \"cer\": %.4f, "
+					       "\"latency_p50_ms\": %.1f, \"latency_p95_ms\": %.1f, \"chars\": %u}\n",
+					       scenario->name, wpm, names[c].c_str(), cell.cer(),
+					       cell.latency(50), cell.latency(95), cell.length);
+				} else {
+					printf("  %6.1f%% %6.0fms", cell.cer() * 100, cell.latency(50));
+				}
+			}
+			if (!json)
+				printf("\n");
+		}
+	}
+
+	if (json) {
+		for (size_t c = 0; c < names.size(); ++c) {
+			printf("{\"scenario\": \"all\", \"config\": \"%s\", \"cer\": %.4f, "
+			       "\"latency_p50_ms\": %.1f, \"latency_p95_ms\": %.1f, \"chars\": %u}\n",
+			       names[c].c_str(), totals[c].cer(),
+			       totals[c].latency(50), totals[c].latency(95), totals[c].length);
+		}
+	} else {
+		printf("%-11s %4s", "all", "");
+		for (Score &t : totals)
+			printf("  %6.1f%% %6.0fms", t.cer() * 100, t.latency(50));
+		printf("\n");
+	}
+	return 0;
+}
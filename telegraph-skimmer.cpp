@@ -0,0 +1,175 @@
+/*
+ *    Decodes all CW signals in a wide audio passband at once.
+ *
+ *    License: GNU General Public License Version 3.0.
+ *
+ *    Copyright (C) 2017 by Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful, but
+ *    WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see: http://www.gnu.org/licenses/
+ *
+ *
+ * Reads a 16-bit PCM WAV file (or stream, on stdin), finds the signals
+ * in it with Skimmer and decodes each of them with its own timing and
+ * decoder logic. Every decoded word is printed on a line with the time
+ * and frequency. With -p, the text is instead published to Redis as it
+ * is decoded, as the frequency in Hz, a tab and the text.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RedisPublisher.h"
+#include "Skimmer.h"
+#include "WavFile.h"
+
+using namespace std::chrono_literals;
+
+// Samples read at a time
+const size_t READ_BLOCK = 16384;
+
+// How long to wait for Redis to acknowledge the last messages
+const auto PUBLISH_DRAIN_TIMEOUT = 5s;
+
+void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-b low-high] [-d hz] [-j threads] [-w wpm] [-c] [-p topic] [-q] [file]\n", prog);
+	fprintf(stderr, "  -b  Passband to skim in Hz (default 200-3000)\n");
+	fprintf(stderr, "  -d  Maximum bin spacing in Hz (default 50)\n");
+	fprintf(stderr, "  -j  Number of decoder threads (default one per CPU)\n");
+	fprintf(stderr, "  -w  Initial speed of each signal (default 20)\n");
+	fprintf(stderr, "  -c  Use the cluster speed estimator\n");
+	fprintf(stderr, "  -p  Publish the text to this Redis topic, instead of printing it\n");
+	fprintf(stderr, "  -q  Do not print statistics\n");
+	fprintf(stderr, "Reads the audio from stdin when no file is given.\n");
+}
+
+int main(int argc, char **argv) {
+	float low = 200, high = 3000;
+	float bin_hz = 50;
+	unsigned threads = std::thread::hardware_concurrency();
+	unsigned wpm = 20;
+	bool use_cluster = false;
+	const char *topic = NULL;
+	bool quiet = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:d:j:w:cp:q")) != -1) {
+		switch (opt) {
+			case 'b':
+				if (sscanf(optarg, "%f-%f", &low, &high) != 2) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'd':
+				bin_hz = atof(optarg);
+				break;
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'w':
+				wpm = atoi(optarg);
+				break;
+			case 'c':
+				use_cluster = true;
+				break;
+			case 'p':
+				topic = optarg;
+				break;
+			case 'q':
+				quiet = true;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	WavReader wav;
+	if (!wav.open(optind < argc ? argv[optind] : "-"))
+		return 1;
+	if (low < 0 || high <= low || high >= wav.rate() / 2 || bin_hz <= 0 || wpm == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	RedisPublisher publisher("127.0.0.1", 6379, 4096);
+	if (topic)
+		publisher.start();
+
+	// Words in progress, per signal
+	std::mutex words_lock;
+	std::map<unsigned, std::string> words;
+
+	Skimmer skimmer(wav.rate(), low, high, threads, bin_hz);
+	skimmer.wpm = wpm;
+	skimmer.use_cluster = use_cluster;
+	skimmer.on_text = [&](const SkimmerSignal &signal, const char *text) {
+		char freq[16];
+		snprintf(freq, sizeof(freq), "%.0f", signal.freq);
+		if (topic) {
+			publisher.publish(topic, std::string(freq) + "\t" + text);
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(words_lock);
+		std::string &word = words[signal.id];
+		for (const char *c = text; *c; ++c) {
+			if (*c != ' ') {
+				word += *c;
+			} else if (!word.empty()) {
+				printf("%8.1f %6s Hz  %s\n", signal.time(), freq, word.c_str());
+				word.clear();
+			}
+		}
+	};
+	skimmer.start();
+
+	using clock = std::chrono::steady_clock;
+	clock::time_point start = clock::now();
+	std::vector<int16_t> samples(READ_BLOCK);
+	uint64_t total = 0;
+	size_t count;
+	while ((count = wav.read(samples.data(), samples.size())) > 0) {
+		skimmer.process(samples.data(), count);
+		total += count;
+	}
+	skimmer.finish();
+	double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+	if (topic) {
+		clock::time_point deadline = clock::now() + PUBLISH_DRAIN_TIMEOUT;
+		while ((publisher.queue_depth() || publisher.in_flight_count()) && clock::now() < deadline)
+			std::this_thread::sleep_for(10ms);
+	}
+
+	if (!quiet) {
+		double seconds = (double)total / wav.rate();
+		double signal_seconds = skimmer.signal_seconds();
+		fprintf(stderr, "%.1f s of audio, %u bins of %.1f Hz, %llu signals (at most %u at once)\n",
+		        seconds, skimmer.bin_count(), skimmer.bin_hz(),
+		        (unsigned long long)skimmer.signals_started(), skimmer.signals_max());
+		fprintf(stderr, "channelizer %.3f s CPU, decoders %.3f s CPU (%.1f us per signal second), %u threads\n",
+		        skimmer.channelizer_cpu(), skimmer.decoder_cpu(),
+		        signal_seconds ? skimmer.decoder_cpu() / signal_seconds * 1e6 : 0, std::max(threads, 1U));
+		fprintf(stderr, "%.3f s wall clock (%.0fx real time)\n", elapsed, seconds / elapsed);
+	}
+	return 0;
+}